@@ -31,3 +31,306 @@ either expressed or implied, of the <project name> project.
 *******************************************************************************/
 
 #include "at_lib.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+at_command_t *at_format_command(const unsigned char *cmd, size_t len) {
+	at_command_t *c = calloc(1, sizeof(at_command_t));
+	while(len && (cmd[len-1]=='\n' || cmd[len-1]=='\r')) // \n -> \r for at commands
+		len--;
+	c->data = malloc(len+1);
+	memcpy(c->data, cmd, len);
+	c->data[len] = '\r';
+	c->len = len+1;
+	c->payload_fd = -1;
+	c->payload_terminator = -1;
+	c->rx_fd = -1;
+	c->pty_fd = -1;
+	return c;
+}
+
+at_command_t *at_format_payload_command(const unsigned char *cmd, size_t len, const char *prompt,
+		const unsigned char *payload, size_t payload_len, int payload_terminator) {
+	at_command_t *c = at_format_command(cmd, len);
+	c->prompt = prompt;
+	c->payload = payload;
+	c->payload_len = payload_len;
+	c->payload_terminator = payload_terminator;
+	return c;
+}
+
+at_command_t *at_format_stream_command(const unsigned char *cmd, size_t len, const char *prompt,
+		int payload_fd, size_t payload_len, int payload_terminator) {
+	at_command_t *c = at_format_command(cmd, len);
+	c->prompt = prompt;
+	c->payload_fd = payload_fd;
+	c->payload_len = payload_len;
+	c->payload_terminator = payload_terminator;
+	return c;
+}
+
+void at_free_command(at_command_t *cmd) {
+	if(!cmd) return;
+	if(cmd->data)
+		free(cmd->data);
+	free(cmd);
+}
+
+at_response_t *at_new_response() {
+	at_response_t *resp = calloc(1, sizeof(at_response_t));
+	resp->buf = calloc(1, sizeof(unsigned char));
+	return resp;
+}
+
+int at_append_response(at_response_t *resp, const unsigned char *buf, size_t len) {
+	unsigned char *p = realloc(resp->buf, resp->len+len+1);
+	if(!p) return -1;
+	memcpy(p+resp->len, buf, len);
+	resp->len += len;
+	p[resp->len] = 0;
+	resp->buf = p;
+	return 0;
+}
+
+void at_free_response(at_response_t *resp) {
+	if(!resp) return;
+	if(resp->buf)
+		free(resp->buf);
+	free(resp);
+}
+
+const unsigned char *at_find_line_end(const unsigned char *buf, size_t size) {
+	return memchr(buf, '\n', size);
+}
+
+int at_line_starts_with(const unsigned char *line, size_t len, const char *prefix) {
+	size_t plen = strlen(prefix);
+	return len>=plen && memcmp(line, prefix, plen)==0;
+}
+
+// information response parsers ////////////////////////////////////////////////
+// no allocation, no 0 terminator required: the cursor never goes past end
+
+typedef struct {
+	const unsigned char *p;
+	const unsigned char *end; // end of the line, without \r\n
+} at_cursor_t;
+
+// finds the line starting with prefix and positions the cursor after it. 0=success
+static int at_find_info_line(const unsigned char *buf, size_t size, const char *prefix, at_cursor_t *c) {
+	const unsigned char *end = buf+size;
+	while(buf<end) {
+		const unsigned char *eol = at_find_line_end(buf, end-buf);
+		const unsigned char *next = eol ? eol+1 : end;
+		while(buf<next && (*buf=='\r' || *buf=='\n' || *buf==' '))
+			buf++;
+		if(at_line_starts_with(buf, next-buf, prefix)) {
+			c->p = buf+strlen(prefix);
+			c->end = next;
+			while(c->end>c->p && (c->end[-1]=='\r' || c->end[-1]=='\n'))
+				c->end--;
+			return 0;
+		}
+		buf = next;
+	}
+	return -1;
+}
+
+static void at_skip_spaces(at_cursor_t *c) {
+	while(c->p<c->end && *c->p==' ')
+		c->p++;
+}
+
+// moves after the next ',' of the current field. 0=success, -1 at the end of the line
+static int at_next_field(at_cursor_t *c) {
+	int quoted = 0;
+	while(c->p<c->end) {
+		if(*c->p=='"')
+			quoted = !quoted;
+		else if(*c->p==',' && !quoted) {
+			c->p++;
+			return 0;
+		}
+		c->p++;
+	}
+	return -1;
+}
+
+static int at_field_is_quoted(at_cursor_t *c) {
+	at_skip_spaces(c);
+	return c->p<c->end && *c->p=='"';
+}
+
+// decimal, or hexadecimal when quoted (lac, ci). returns def for empty fields
+static long at_field_number(at_cursor_t *c, long def) {
+	long v = 0;
+	int digits = 0, hex = 0;
+	at_skip_spaces(c);
+	if(c->p<c->end && *c->p=='"') {
+		hex = 1;
+		c->p++;
+	}
+	for(;c->p<c->end;c->p++) {
+		unsigned char ch = *c->p;
+		int d;
+		if(ch>='0' && ch<='9')
+			d = ch-'0';
+		else if(hex && ch>='a' && ch<='f')
+			d = ch-'a'+10;
+		else if(hex && ch>='A' && ch<='F')
+			d = ch-'A'+10;
+		else
+			break;
+		if(v<LONG_MAX/16) // saturates on garbage
+			v = v*(hex?16:10)+d;
+		digits++;
+	}
+	if(hex && c->p<c->end && *c->p=='"')
+		c->p++;
+	return digits ? v : def;
+}
+
+// quoted or plain string, truncated to the destination size. returns the length
+static size_t at_field_string(at_cursor_t *c, char *dst, size_t dstsize) {
+	size_t len = 0;
+	int quoted;
+	at_skip_spaces(c);
+	quoted = c->p<c->end && *c->p=='"';
+	if(quoted)
+		c->p++;
+	while(c->p<c->end && (quoted ? *c->p!='"' : *c->p!=',')) {
+		if(len+1<dstsize)
+			dst[len++] = *c->p;
+		c->p++;
+	}
+	if(quoted && c->p<c->end)
+		c->p++;
+	if(dstsize)
+		dst[len] = 0;
+	return len;
+}
+
+int at_parse_csq(const unsigned char *buf, size_t size, at_csq_t *csq) {
+	at_cursor_t c;
+	if(at_find_info_line(buf, size, "+CSQ:", &c))
+		return -1;
+	csq->rssi = at_field_number(&c, 99);
+	csq->ber = at_next_field(&c) ? 99 : at_field_number(&c, 99);
+	return 0;
+}
+
+int at_parse_cesq(const unsigned char *buf, size_t size, at_cesq_t *cesq) {
+	at_cursor_t c;
+	if(at_find_info_line(buf, size, "+CESQ:", &c))
+		return -1;
+	cesq->rxlev = at_field_number(&c, 99);
+	cesq->ber = at_next_field(&c) ? 99 : at_field_number(&c, 99);
+	cesq->rscp = at_next_field(&c) ? 255 : at_field_number(&c, 255);
+	cesq->ecno = at_next_field(&c) ? 255 : at_field_number(&c, 255);
+	cesq->rsrq = at_next_field(&c) ? 255 : at_field_number(&c, 255);
+	cesq->rsrp = at_next_field(&c) ? 255 : at_field_number(&c, 255);
+	return 0;
+}
+
+// read response "<n>,<stat>[,<lac>,<ci>[,<AcT>]]" or urc "<stat>[,<lac>,<ci>[,<AcT>]]":
+// in the read response the second field is a plain number, in the urc it is the quoted lac
+int at_parse_reg(const unsigned char *buf, size_t size, const char *prefix, at_reg_t *reg) {
+	at_cursor_t c, second;
+	if(at_find_info_line(buf, size, prefix, &c))
+		return -1;
+	reg->n = -1;
+	reg->lac = -1;
+	reg->ci = -1;
+	reg->act = -1;
+	second = c;
+	if(at_next_field(&second)==0 && !at_field_is_quoted(&second)) {
+		reg->n = at_field_number(&c, -1);
+		at_next_field(&c);
+	}
+	reg->stat = at_field_number(&c, -1);
+	if(at_next_field(&c))
+		return 0;
+	reg->lac = at_field_number(&c, -1);
+	if(at_next_field(&c))
+		return 0;
+	reg->ci = at_field_number(&c, -1);
+	if(at_next_field(&c))
+		return 0;
+	reg->act = at_field_number(&c, -1);
+	return 0;
+}
+
+int at_parse_cops(const unsigned char *buf, size_t size, at_cops_t *cops) {
+	at_cursor_t c;
+	if(at_find_info_line(buf, size, "+COPS:", &c))
+		return -1;
+	cops->format = -1;
+	cops->oper[0] = 0;
+	cops->act = -1;
+	cops->mode = at_field_number(&c, -1);
+	if(at_next_field(&c))
+		return 0;
+	cops->format = at_field_number(&c, -1);
+	if(at_next_field(&c))
+		return 0;
+	at_field_string(&c, cops->oper, sizeof(cops->oper));
+	if(at_next_field(&c))
+		return 0;
+	cops->act = at_field_number(&c, -1);
+	return 0;
+}
+
+// returns the number of contexts, one per line
+int at_parse_cgdcont(const unsigned char *buf, size_t size, at_cgdcont_t *ctx, int max) {
+	at_cursor_t c;
+	int count = 0;
+	while(count<max && at_find_info_line(buf, size, "+CGDCONT:", &c)==0) {
+		at_cgdcont_t *x = &ctx[count++];
+		x->pdp_type[0] = x->apn[0] = x->addr[0] = 0;
+		x->cid = at_field_number(&c, -1);
+		if(at_next_field(&c)==0)
+			at_field_string(&c, x->pdp_type, sizeof(x->pdp_type));
+		if(at_next_field(&c)==0)
+			at_field_string(&c, x->apn, sizeof(x->apn));
+		if(at_next_field(&c)==0)
+			at_field_string(&c, x->addr, sizeof(x->addr));
+		size -= c.end-buf;
+		buf = c.end;
+	}
+	return count;
+}
+
+// returns the number of contexts, one per line
+int at_parse_cgpaddr(const unsigned char *buf, size_t size, at_cgpaddr_t *addr, int max) {
+	at_cursor_t c;
+	int count = 0;
+	while(count<max && at_find_info_line(buf, size, "+CGPADDR:", &c)==0) {
+		at_cgpaddr_t *x = &addr[count++];
+		x->addr1[0] = x->addr2[0] = 0;
+		x->cid = at_field_number(&c, -1);
+		if(at_next_field(&c)==0)
+			at_field_string(&c, x->addr1, sizeof(x->addr1));
+		if(at_next_field(&c)==0)
+			at_field_string(&c, x->addr2, sizeof(x->addr2));
+		size -= c.end-buf;
+		buf = c.end;
+	}
+	return count;
+}
+
+int at_parse_cpin(const unsigned char *buf, size_t size, at_cpin_t *cpin) {
+	at_cursor_t c;
+	if(at_find_info_line(buf, size, "+CPIN:", &c))
+		return -1;
+	at_field_string(&c, cpin->code, sizeof(cpin->code));
+	cpin->ready = strcmp(cpin->code, "READY")==0;
+	return 0;
+}
+
+int at_parse_ccid(const unsigned char *buf, size_t size, at_ccid_t *ccid) {
+	at_cursor_t c;
+	if(at_find_info_line(buf, size, "+CCID:", &c))
+		return -1;
+	return at_field_string(&c, ccid->iccid, sizeof(ccid->iccid)) ? 0 : -1;
+}
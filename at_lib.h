@@ -33,5 +33,132 @@ either expressed or implied, of the <project name> project.
 #ifndef __AT_LIB_H__
 #define __AT_LIB_H__
 
+#include <stddef.h>
+
+/* AT transaction: everything is length-delimited, so that commands, payloads and
+ * responses can carry any byte (including 0x00, 0x1A, and lines without \r\n).
+ * optional phases:
+ *	payload: after the command, wait for the prompt (eg: "> " for AT+CMGS), then send
+ *		the payload from memory or streamed from a file descriptor
+ *	rx body: a response line starting with rx_prefix (eg: "^SISR:") announces a raw body
+ *		of rx_len bytes (or the last number of the line if rx_len==0), kept in the response
+ *		or streamed to rx_fd
+ *	data mode: after CONNECT, the port is bridged to a pty until escape or hangup
+ */
+
+enum at_phases {
+	AT_PHASE_COMMAND	= 0, // waiting for the prompt or the response lines
+	AT_PHASE_RX_BODY	= 1, // receiving a raw body
+};
+
+typedef struct {
+	unsigned char *data; // command line, including the final \r
+	size_t len;
+
+	const char *prompt; // NULL if there is no payload phase
+	const unsigned char *payload; // payload from memory, or...
+	int payload_fd; // ...streamed from a file descriptor (-1 if not used)
+	size_t payload_len; // for payload_fd: 0 means until EOF
+	int payload_terminator; // byte sent after the payload (0x1A for sms), -1 for none
+
+	const char *rx_prefix; // NULL if there is no raw body in the response
+	size_t rx_len;
+	int rx_fd; // -1 to keep the body in the response
+
+	int pty_fd; // if >=0, after CONNECT the port switches to data mode, bridged to this pty master
+
+	// transaction state, for thread_at use
+	int phase;
+	size_t rx_remaining;
+} at_command_t;
+
+typedef struct {
+	unsigned char *buf; // always followed by a 0 (not part of len), for printing convenience
+	size_t len;
+} at_response_t;
+
+at_command_t *at_format_command(const unsigned char *cmd, size_t len); // appends \r if missing
+at_command_t *at_format_payload_command(const unsigned char *cmd, size_t len, const char *prompt,
+	const unsigned char *payload, size_t payload_len, int payload_terminator);
+at_command_t *at_format_stream_command(const unsigned char *cmd, size_t len, const char *prompt,
+	int payload_fd, size_t payload_len, int payload_terminator);
+void at_free_command(at_command_t *cmd);
+
+at_response_t *at_new_response();
+int at_append_response(at_response_t *resp, const unsigned char *buf, size_t len); // 0=success
+void at_free_response(at_response_t *resp);
+
+// line helpers (no 0 terminator required)
+const unsigned char *at_find_line_end(const unsigned char *buf, size_t size); // position of the \n, NULL if none
+int at_line_starts_with(const unsigned char *line, size_t len, const char *prefix);
+
+// information response parsers: no allocation, the buffer is the raw response (intermediate lines allowed).
+// return 0=success (-1 if the information line is missing), list parsers return the number of entries.
+// missing optional numeric fields are -1, except for signal values which use the 27.007 "unknown" value
+
+#define AT_OPER_LEN	(64)
+#define AT_APN_LEN	(101) // 100 + terminator
+#define AT_ADDR_LEN	(64) // ipv6 in dotted-decimal notation: 63 + terminator
+
+typedef struct {
+	int rssi; // 0..31, 99 unknown
+	int ber; // 0..7, 99 unknown
+} at_csq_t;
+
+typedef struct {
+	int rxlev; // 99 unknown
+	int ber; // 99 unknown
+	int rscp; // 255 unknown
+	int ecno; // 255 unknown
+	int rsrq; // 255 unknown
+	int rsrp; // 255 unknown
+} at_cesq_t;
+
+typedef struct {
+	int n; // -1 for urcs
+	int stat;
+	long lac; // lac or tac
+	long ci;
+	int act;
+} at_reg_t;
+
+typedef struct {
+	int mode;
+	int format;
+	char oper[AT_OPER_LEN];
+	int act;
+} at_cops_t;
+
+typedef struct {
+	int cid;
+	char pdp_type[16];
+	char apn[AT_APN_LEN];
+	char addr[AT_ADDR_LEN];
+} at_cgdcont_t;
+
+typedef struct {
+	int cid;
+	char addr1[AT_ADDR_LEN];
+	char addr2[AT_ADDR_LEN]; // ipv6 address for ipv4v6 contexts
+} at_cgpaddr_t;
+
+typedef struct {
+	char code[16]; // READY, SIM PIN, SIM PUK, ...
+	int ready;
+} at_cpin_t;
+
+typedef struct {
+	char iccid[24];
+} at_ccid_t;
+
+int at_parse_csq(const unsigned char *buf, size_t size, at_csq_t *csq);
+int at_parse_cesq(const unsigned char *buf, size_t size, at_cesq_t *cesq);
+int at_parse_reg(const unsigned char *buf, size_t size, const char *prefix, at_reg_t *reg); // "+CREG:", "+CGREG:" or "+CEREG:"
+int at_parse_cops(const unsigned char *buf, size_t size, at_cops_t *cops);
+int at_parse_cgdcont(const unsigned char *buf, size_t size, at_cgdcont_t *ctx, int max);
+int at_parse_cgpaddr(const unsigned char *buf, size_t size, at_cgpaddr_t *addr, int max);
+int at_parse_cpin(const unsigned char *buf, size_t size, at_cpin_t *cpin);
+int at_parse_ccid(const unsigned char *buf, size_t size, at_ccid_t *ccid);
+
 #endif /* __AT_LIB_H__ */
 
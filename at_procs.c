@@ -31,45 +31,141 @@ either expressed or implied, of the <project name> project.
 *******************************************************************************/
 
 #include "at_procs.h"
+#include "at_lib.h"
+#include "thread_at.h"
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define AT_UPLOAD_MIN_RATE	(4096) // bytes per second: the deadline of a file upload grows with its size
+
+// prints the information responses that at_lib knows
+static void generic_at_decode(client_params_t *cp, const at_response_t *r) {
+	at_csq_t csq;
+	at_cesq_t cesq;
+	at_reg_t reg;
+	at_cops_t cops;
+	at_cgdcont_t ctx[8];
+	at_cgpaddr_t addr[8];
+	at_cpin_t cpin;
+	at_ccid_t ccid;
+	static const char *reg_prefixes[] = { "+CREG:", "+CGREG:", "+CEREG:" };
+	int n;
+	if(at_parse_csq(r->buf, r->len, &csq)==0)
+		DBGC("signal: rssi %d, ber %d", csq.rssi, csq.ber)
+	if(at_parse_cesq(r->buf, r->len, &cesq)==0)
+		DBGC("signal: rxlev %d, ber %d, rscp %d, ecno %d, rsrq %d, rsrp %d",
+			cesq.rxlev, cesq.ber, cesq.rscp, cesq.ecno, cesq.rsrq, cesq.rsrp)
+	for(int i=0;i<3;i++)
+		if(at_parse_reg(r->buf, r->len, reg_prefixes[i], &reg)==0)
+			DBGC("%s stat %d, lac %lx, ci %lx, act %d", reg_prefixes[i], reg.stat, reg.lac, reg.ci, reg.act)
+	if(at_parse_cops(r->buf, r->len, &cops)==0)
+		DBGC("operator: '%s', mode %d, act %d", cops.oper, cops.mode, cops.act)
+	n = at_parse_cgdcont(r->buf, r->len, ctx, 8);
+	for(int i=0;i<n;i++)
+		DBGC("context %d: %s '%s'", ctx[i].cid, ctx[i].pdp_type, ctx[i].apn)
+	n = at_parse_cgpaddr(r->buf, r->len, addr, 8);
+	for(int i=0;i<n;i++)
+		DBGC("context %d: address %s %s", addr[i].cid, addr[i].addr1, addr[i].addr2)
+	if(at_parse_cpin(r->buf, r->len, &cpin)==0)
+		DBGC("sim: %s", cpin.code)
+	if(at_parse_ccid(r->buf, r->len, &ccid)==0)
+		DBGC("iccid: %s", ccid.iccid)
+}
+
+// the payload and the pty belong to the requester until the command is queued
+static void generic_at_free_command(at_command_t *cmd) {
+	if(cmd->payload)
+		free((void*)cmd->payload);
+	if(cmd->payload_fd>=0)
+		close(cmd->payload_fd);
+	if(cmd->pty_fd>=0) // no CONNECT, otherwise the data mode owns it
+		close(cmd->pty_fd);
+	at_free_command(cmd);
+}
 
 void *generic_at_client_thread(void *data) {
 	client_params_t *cp = data;
-	const unsigned char *response;
-	pthread_cond_init(&cp->waitcond, NULL); // initialize waiting condition
-	pthread_mutex_init(&cp->waitmutex, NULL);
-	pthread_mutex_lock(&cp->waitmutex);
-	append_elem_to_queue(&cp->tp_interface->sq, cp);
-	pthread_cond_wait(&cp->waitcond, &cp->waitmutex);
-	// option1 for timeout: use pthread_cond_timedwait
-	// option2 for timeout, better: implement it on the loop_thread
-	free(cp->command); cp->command=NULL;
-	response = cp->response;
-	DBGC("COMMAND RESPONSE:'%s'", response);
-	free(cp->response); cp->response=NULL;
-
-	pthread_cond_destroy(&cp->waitcond);
-	pthread_mutex_destroy(&cp->waitmutex);
-	if(cp->command)
-		free(cp->command);
-	if(cp->response)
-		free(cp->response);
+	at_command_t *cmd = cp->command;
+	at_response_t *response;
+
+	if(send_command(cmd, cp))
+		DBGC("COMMAND FAILED (status %d)", cp->status);
+	response = cp->response; // can be partial or missing after a timeout
+	if(response) {
+		DBGC("COMMAND RESPONSE:'%.*s'", (int)response->len, response->buf);
+		generic_at_decode(cp, response);
+		at_free_response(response); cp->response=NULL;
+	}
+
+	// the payload belongs to the client thread
+	generic_at_free_command(cmd); cp->command=NULL;
 	destroy_client_thread(cp);
 	return NULL;
 }
 
-// return 0=success
-int generic_at_send(thread_params_t *tp, const unsigned char *command) {
+// the port for the next command of tp, NULL if none works yet (for example a pool still being set up)
+thread_params_t *generic_at_port(thread_params_t *tp) {
+	return tp->at_pool ? at_pool_get_port(tp->at_pool) : tp->tp_at;
+}
+
+static int generic_at_spawn(thread_params_t *tp, at_command_t *cmd, int priority) {
 	char name[64];
-	int n = snprintf(name, sizeof(name), "%p.%s", tp, command);
-	if(name[n-1]=='\r') name[n-1]=0;
-	client_params_t *cp = new_client_thread(name, tp->tp_at);
-	char *cmd;
-	cmd = strdup(command);
-	cmd[strlen(cmd)-1]='\r'; // \n -> \r for at commands // TODO: verify that it is still so...
+	thread_params_t *port = generic_at_port(tp);
+	if(!port) {
+		DBGT("no AT port")
+		generic_at_free_command(cmd);
+		return -1;
+	}
+	snprintf(name, sizeof(name), "%p.%.*s", tp, (int)cmd->len-1, cmd->data); // without the \r
+	client_params_t *cp = new_client_thread(name, port);
+	if(cmd->payload_fd>=0) // streams of unknown size (eg: a fifo) have no deadline
+		cp->timeout_msec = cmd->payload_len ? COMMAND_DEFAULT_TIMEOUT_MSEC + cmd->payload_len*1000/AT_UPLOAD_MIN_RATE : 0;
 	cp->command = cmd;
 	cp->status = COMMAND_STATE_WAIT_TO_SEND;
+	cp->priority = priority;
+	cp->flow = tp; // commands of the same requester share their class bandwidth
 	DBGT("spawn: %s", cp->name)
 	return pthread_create(&cp->tid, NULL, generic_at_client_thread, cp);
 }
+
+// return 0=success
+int generic_at_send(thread_params_t *tp, const unsigned char *command) {
+	return generic_at_spawn(tp, at_format_command(command, strlen((const char*)command)), COMMAND_PRIORITY_INTERACTIVE);
+}
+
+// return 0=success. the payload is copied
+int generic_at_send_payload(thread_params_t *tp, const unsigned char *command, const char *prompt,
+		const unsigned char *payload, size_t payload_len, int payload_terminator) {
+	unsigned char *p = malloc(payload_len);
+	memcpy(p, payload, payload_len);
+	return generic_at_spawn(tp, at_format_payload_command(command, strlen((const char*)command), prompt, p, payload_len, payload_terminator), COMMAND_PRIORITY_INTERACTIVE);
+}
+
+// return 0=success. the file is streamed to the port, not loaded in memory
+int generic_at_send_file(thread_params_t *tp, const unsigned char *command, const char *prompt, const char *path) {
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if(fd<0)
+		return -1;
+	if(fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	return generic_at_spawn(tp, at_format_stream_command(command, strlen((const char*)command), prompt, fd, S_ISREG(st.st_mode)?st.st_size:0, -1), COMMAND_PRIORITY_BULK);
+}
+
+// return 0=success. after CONNECT the port is bridged to a new pty, for example for pppd
+int generic_at_dial(thread_params_t *tp, const unsigned char *command) {
+	char slave[64];
+	at_command_t *cmd;
+	int pty = open_pty(slave, sizeof(slave));
+	if(pty<0)
+		return -1;
+	cmd = at_format_command(command, strlen((const char*)command));
+	cmd->pty_fd = pty;
+	DBGT("data mode pty: %s", slave)
+	return generic_at_spawn(tp, cmd, COMMAND_PRIORITY_CONTROL);
+}
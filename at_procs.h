@@ -35,6 +35,13 @@ either expressed or implied, of the <project name> project.
 
 #include "thread.h"
 
+thread_params_t *generic_at_port(thread_params_t *tp); // NULL when no AT port can take commands
 int generic_at_send(thread_params_t *tp, const unsigned char *command);
+// commands with a payload phase: the payload is sent after the prompt (eg: "> ")
+int generic_at_send_payload(thread_params_t *tp, const unsigned char *command, const char *prompt,
+	const unsigned char *payload, size_t payload_len, int payload_terminator);
+int generic_at_send_file(thread_params_t *tp, const unsigned char *command, const char *prompt, const char *path);
+// dial commands (eg: "atd*99#"): the data mode is bridged to a pty, whose name is printed
+int generic_at_dial(thread_params_t *tp, const unsigned char *command);
 
 #endif /* __AT_PROCS_H__ */
\ No newline at end of file
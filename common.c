@@ -30,6 +30,7 @@ either expressed or implied, of the <project name> project.
 
 *******************************************************************************/
 
+#define _GNU_SOURCE // posix_openpt
 #include "common.h"
 #include <stdlib.h>
 #include <fcntl.h>
@@ -42,6 +43,8 @@ either expressed or implied, of the <project name> project.
 #include <termios.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <errno.h>
 
 // conversions /////////////////////////////////////////////////////////////////
 
@@ -90,9 +93,16 @@ int count_runes_utf8(const char *utf8, int params) {
 
 uint32_t bin_to_uint32(const unsigned char* buf, int params) {
 	if(params&USE_LITTLE_ENDIAN)
-		return (buf[3]<<24)|(buf[2]<<16)|(buf[1]<<8)|buf[0];
+		return ((uint32_t)buf[3]<<24)|(buf[2]<<16)|(buf[1]<<8)|buf[0];
 	else
-		return (buf[0]<<24)|(buf[1]<<16)|(buf[2]<<8)|buf[3];
+		return ((uint32_t)buf[0]<<24)|(buf[1]<<16)|(buf[2]<<8)|buf[3];
+}
+
+uint64_t bin_to_uint64(const unsigned char* buf, int params) {
+	if(params&USE_LITTLE_ENDIAN)
+		return ((uint64_t)bin_to_uint32(buf+4, params)<<32) | bin_to_uint32(buf, params);
+	else
+		return ((uint64_t)bin_to_uint32(buf, params)<<32) | bin_to_uint32(buf+4, params);
 }
 
 //int ucs2_to_utf8(const unsigned char *ucs2, int num_runes, char *utf8, int params);
@@ -176,41 +186,51 @@ void init_queue(queue_t *queue) {
 }
 
 void append_elem_to_queue(queue_t *queue, void *elem) {
-	queue_elem_t* newelem = (queue_elem_t*)calloc(1, sizeof(queue_elem_t));
-	newelem->elem = elem;
-
 	pthread_mutex_lock(&queue->lock);
-		if(!queue->head)
-			queue->head = newelem;
-		else {
-			queue_elem_t* p = queue->head;
-			while(p->next)
-				p=p->next;
-			p->next = newelem;
-		}
+		append_elem_to_queue_nolock(queue, elem);
 	pthread_mutex_unlock(&queue->lock);
 };
 
 void remove_elem_from_queue(queue_t *queue, void *elem) {
-	queue_elem_t* oldelem;
-
-	// assume that elem is in queue, no check.
 	pthread_mutex_lock(&queue->lock);
-		if(queue->head->elem == elem) {
-			oldelem = queue->head;
-			queue->head = queue->head->next;
-		} else {
-			queue_elem_t* p = queue->head;
-			while(p->next->elem != elem)
-				p=p->next;
-			oldelem = p->next;
-			p->next = oldelem->next;
-		}
-		//free(oldelem->elem);
-		free(oldelem);
+		remove_elem_from_queue_nolock(queue, elem);
 	pthread_mutex_unlock(&queue->lock);
 };
 
+void append_elem_to_queue_nolock(queue_t *queue, void *elem) {
+	queue_elem_t* newelem = (queue_elem_t*)calloc(1, sizeof(queue_elem_t));
+	newelem->elem = elem;
+
+	if(!queue->head)
+		queue->head = newelem;
+	else {
+		queue_elem_t* p = queue->head;
+		while(p->next)
+			p=p->next;
+		p->next = newelem;
+	}
+	queue->count++;
+}
+
+void remove_elem_from_queue_nolock(queue_t *queue, void *elem) {
+	queue_elem_t* oldelem;
+
+	// assume that elem is in queue, no check.
+	if(queue->head->elem == elem) {
+		oldelem = queue->head;
+		queue->head = queue->head->next;
+	} else {
+		queue_elem_t* p = queue->head;
+		while(p->next->elem != elem)
+			p=p->next;
+		oldelem = p->next;
+		p->next = oldelem->next;
+	}
+	//free(oldelem->elem);
+	free(oldelem);
+	queue->count--;
+}
+
 void destroy_queue(queue_t *queue) {
 	pthread_mutex_destroy(&queue->lock);
 }
@@ -263,6 +283,33 @@ int openport(const char *portname, struct termios *oldt, struct termios *newt) {
 	return port;
 }
 
+int wait_port(int port, short events, long timeout_msec) {
+	struct pollfd fds[1];
+	int pollret;
+	fds[0].fd = port;
+	fds[0].events = events | POLLERR | POLLHUP | POLLNVAL;
+	do {
+		pollret = poll(fds, 1, timeout_msec);
+	} while(pollret==0 || (pollret<0 && errno==EINTR)); // in case of timeout, just repeat
+	if(pollret<0 || (fds[0].revents & (POLLERR | POLLNVAL)) || !(fds[0].revents & events))
+		return -1; // do not process error here, the reading poll will do it
+	return 0;
+}
+
+int write_port(int port, const unsigned char *buf, size_t bufsize, long timeout_msec) {
+	size_t written = 0;
+	while(written<bufsize) {
+		if(wait_port(port, POLLOUT, timeout_msec))
+			return -1;
+		ssize_t ret = write(port, buf+written, bufsize-written);
+		if(ret>0)
+			written += ret;
+		else if(ret<0 && errno!=EAGAIN && errno!=EINTR)
+			return -1;
+	}
+	return 0;
+}
+
 void closeport(int port, struct termios *oldt) {
 	if(port>=0){
 		tcsetattr(port, TCSANOW, oldt);
@@ -271,6 +318,132 @@ void closeport(int port, struct termios *oldt) {
 	}
 }
 
+int open_pty(char *slave_name, size_t len) {
+	struct termios t;
+	int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(master<0)
+		return -1;
+	if(grantpt(master) || unlockpt(master) || ptsname_r(master, slave_name, len)) {
+		close(master);
+		return -1;
+	}
+	tcgetattr(master, &t);
+	cfmakeraw(&t); // data is passed as is
+	tcsetattr(master, TCSANOW, &t);
+	return master;
+}
+
+// time ////////////////////////////////////////////////////////////////////////
+
+void get_timeout_abstime(struct timespec *ts, long timeout_msec) {
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += timeout_msec/1000;
+	ts->tv_nsec += (timeout_msec%1000)*1000000;
+	if(ts->tv_nsec>=1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+uint64_t get_monotonic_msec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+// timers //////////////////////////////////////////////////////////////////////
+
+#define TWHEEL_MASK		(TWHEEL_SLOTS-1)
+#define TWHEEL_RANGE		(1ULL<<(TWHEEL_BITS*TWHEEL_LEVELS)) // in ticks
+
+void init_timing_wheel(timing_wheel_t *tw, long tick_msec) {
+	memset(tw, 0, sizeof(timing_wheel_t));
+	tw->tick_msec = tick_msec;
+	tw->current = get_monotonic_msec()/tick_msec;
+}
+
+// the slot depends on the distance from the current tick: far timers go to the upper levels and cascade down
+static void timing_wheel_link(timing_wheel_t *tw, timer_node_t *t) {
+	uint64_t expires = t->expires;
+	uint64_t delta;
+	timer_node_t **slot;
+	int level = 0;
+	if(expires<tw->current)
+		expires = tw->current; // already expired: next tick
+	delta = expires-tw->current;
+	if(delta>=TWHEEL_RANGE) {
+		delta = TWHEEL_RANGE-1; // will be re-cascaded
+		expires = tw->current+delta;
+	}
+	while(level<TWHEEL_LEVELS-1 && delta>=(1ULL<<(TWHEEL_BITS*(level+1))))
+		level++;
+	slot = &tw->slots[level][(expires>>(TWHEEL_BITS*level)) & TWHEEL_MASK];
+	t->next = *slot;
+	if(t->next)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void timing_wheel_unlink(timer_node_t *t) {
+	*t->pprev = t->next;
+	if(t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+void add_timer(timing_wheel_t *tw, timer_node_t *t, long timeout_msec) {
+	if(t->pprev)
+		del_timer(tw, t);
+	t->expires = (get_monotonic_msec()+timeout_msec+tw->tick_msec-1)/tw->tick_msec;
+	timing_wheel_link(tw, t);
+	tw->count++;
+}
+
+void del_timer(timing_wheel_t *tw, timer_node_t *t) {
+	if(!t->pprev)
+		return; // not pending
+	timing_wheel_unlink(t);
+	tw->count--;
+}
+
+static void timing_wheel_cascade(timing_wheel_t *tw, int level) {
+	timer_node_t **slot = &tw->slots[level][(tw->current>>(TWHEEL_BITS*level)) & TWHEEL_MASK];
+	timer_node_t *t = *slot;
+	*slot = NULL;
+	while(t) {
+		timer_node_t *next = t->next;
+		timing_wheel_link(tw, t);
+		t = next;
+	}
+}
+
+int run_timers(timing_wheel_t *tw) {
+	uint64_t target = get_monotonic_msec()/tw->tick_msec;
+	int expired = 0;
+	if(!tw->count) {
+		tw->current = target+1; // nothing to do for the elapsed ticks
+		return 0;
+	}
+	while(tw->current<=target) {
+		timer_node_t **slot = &tw->slots[0][tw->current & TWHEEL_MASK];
+		for(int level=1;level<TWHEEL_LEVELS;level++) {
+			if((tw->current>>(TWHEEL_BITS*(level-1))) & TWHEEL_MASK)
+				break;
+			timing_wheel_cascade(tw, level);
+		}
+		while(*slot) {
+			timer_node_t *t = *slot;
+			del_timer(tw, t);
+			t->expired(t, t->data); // can add or delete timers
+			expired++;
+		}
+		tw->current++;
+	}
+	return expired;
+}
+
 // debug ///////////////////////////////////////////////////////////////////////
 
 const char *getdatetime()
@@ -37,6 +37,7 @@ either expressed or implied, of the <project name> project.
 #include <pthread.h>
 #include <termios.h>
 #include <stdio.h>
+#include <time.h>
 
 // conversions /////////////////////////////////////////////////////////////////
 
@@ -81,6 +82,7 @@ int count_runes_utf8(const char *utf8, int params);
 int ucs2_to_utf8(const unsigned char *ucs2, int num_runes, char *utf8, int params);
 int buflen_ucs2_to_utf8(const unsigned char *ucs2, int num_runes, int params);
 
+unsigned int hex2binC(const char c); // 0..15, (unsigned)-1 if not an hex digit
 // ignore extra spaces and dashes, use uppercase/lowercase, return bin_buf length if >=0, -error if <0
 int hex_to_bin(const char *hex_buf, unsigned char*bin_buf);
 int hex_to_bin_len(const char *hex_buf);
@@ -107,12 +109,15 @@ struct queue_elem_t {
 typedef struct {
 	queue_elem_t *head;
 	pthread_mutex_t lock;
+	size_t count; // number of elements
 } queue_t;
 
 queue_t *create_queue(); // does calloc and init
 void init_queue(queue_t *queue); // initialize mutex
 void append_elem_to_queue(queue_t *queue, void *elem);
 void remove_elem_from_queue(queue_t *queue, void *elem);
+void append_elem_to_queue_nolock(queue_t *queue, void *elem); // with queue->lock already taken
+void remove_elem_from_queue_nolock(queue_t *queue, void *elem);
 void destroy_queue(queue_t *queue); // destroys mutex
 void free_queue(queue_t *queue); // destroy and free
 
@@ -122,6 +127,43 @@ void test_queues();
 
 int openport(const char *portname, struct termios *oldt, struct termios *newt);
 void closeport(int port, struct termios *oldt);
+int wait_port(int port, short events, long timeout_msec); // 0 when the poll events are available, -1 on port error
+int write_port(int port, const unsigned char *buf, size_t bufsize, long timeout_msec); // 0=success, also for non-blocking ports
+int open_pty(char *slave_name, size_t len); // raw, non-blocking pty master, -1 on error
+
+// time ////////////////////////////////////////////////////////////////////////
+
+void get_timeout_abstime(struct timespec *ts, long timeout_msec); // CLOCK_REALTIME, for pthread_cond_timedwait
+uint64_t get_monotonic_msec();
+
+// timers //////////////////////////////////////////////////////////////////////
+
+// hierarchical timing wheel: O(1) add and delete, each timer is cascaded at most TWHEEL_LEVELS-1 times.
+// not thread safe: the owner protects it with its own lock. timer nodes are embedded, no allocation
+#define TWHEEL_BITS		(6)
+#define TWHEEL_SLOTS		(1<<TWHEEL_BITS)
+#define TWHEEL_LEVELS		(4) // with 10 msec ticks, about 46 hours. longer timers are clamped and cascaded again
+
+typedef struct timer_node_t timer_node_t;
+struct timer_node_t {
+	timer_node_t *next;
+	timer_node_t **pprev; // NULL if not pending
+	uint64_t expires; // in ticks
+	void (*expired)(timer_node_t *t, void *data);
+	void *data;
+};
+
+typedef struct {
+	timer_node_t *slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+	uint64_t current; // next tick to process
+	long tick_msec;
+	size_t count; // pending timers
+} timing_wheel_t;
+
+void init_timing_wheel(timing_wheel_t *tw, long tick_msec);
+void add_timer(timing_wheel_t *tw, timer_node_t *t, long timeout_msec); // rearms if already pending
+void del_timer(timing_wheel_t *tw, timer_node_t *t); // no effect if not pending
+int run_timers(timing_wheel_t *tw); // calls the expired timers, returns how many
 
 // debug ///////////////////////////////////////////////////////////////////////
 
@@ -33,4 +33,13 @@ either expressed or implied, of the <project name> project.
 #ifndef __FREEMBIM_H__
 #define __FREEMBIM_H__
 
+// command line options
+typedef struct {
+	int cmux_channels; // 0: no multiplexer on the AT port
+	int auto_init; // mbim init on discovery, without the tty
+	const char *auto_apn; // connected once registered after the auto init, NULL: none
+} freembim_options_t;
+
+extern freembim_options_t freembim_options;
+
 #endif /* __FREEMBIM_H__ */
@@ -30,6 +30,7 @@ either expressed or implied, of the <project name> project.
 
 *******************************************************************************/
 
+#define _GNU_SOURCE // unshare
 #include "freembim.h"
 #include "common.h"
 #include "version.h"
@@ -38,8 +39,19 @@ either expressed or implied, of the <project name> project.
 #include "thread_at.h"
 #include "thread_mbim.h"
 #include "thread_udev.h"
+#include "thread_cmux.h"
+#include "at_lib.h"
+#include "mbim_procs.h"
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 void test_queues() {
 	queue_t msg_queue = {NULL, 0};
@@ -78,6 +90,384 @@ void test_queues() {
 	pthread_mutex_destroy(&msg_queue.lock);
 }
 
+// 27.010 peer on the master side of a pty: it accepts AT+CMUX and the channels, and answers OK to every AT command
+static void test_cmux_frame(int fd, int dlci, unsigned char control, const char *info, size_t len) {
+	unsigned char frame[64];
+	unsigned char crc = 0xFF;
+	frame[0] = 0xF9;
+	frame[1] = (dlci<<2) | 0x01;
+	frame[2] = control;
+	frame[3] = (len<<1) | 0x01;
+	for(int i=1;i<4;i++) { // UA and UIH: only the header is covered
+		crc ^= frame[i];
+		for(int j=0;j<8;j++)
+			crc = (crc&1) ? (crc>>1)^0xE0 : crc>>1;
+	}
+	memcpy(frame+4, info, len);
+	frame[4+len] = 0xFF-crc;
+	frame[5+len] = 0xF9;
+	write_port(fd, frame, 6+len, 1000);
+}
+
+static void *test_cmux_peer(void *data) {
+	int fd = *(int*)data;
+	unsigned char buf[1024];
+	size_t len = 0;
+	int answered = 0;
+	for(int idle=0;answered<2 && idle<50;idle++) { // 5 seconds without traffic
+		struct pollfd fds[1] = {{ .fd = fd, .events = POLLIN }};
+		ssize_t n;
+		size_t i = 0;
+		if(poll(fds, 1, 100)<=0 || !(fds[0].revents & POLLIN))
+			continue; // POLLHUP until the slave is opened
+		n = read(fd, buf+len, sizeof(buf)-len);
+		if(n<=0)
+			continue;
+		idle = 0;
+		len += n;
+		if(len>=10 && memcmp(buf, "AT+CMUX=0\r", 10)==0) {
+			write_port(fd, (const unsigned char *)"\r\nOK\r\n", 6, 1000);
+			len = 0;
+			continue;
+		}
+		while(len-i>=6) {
+			int dlci = buf[i+1]>>2;
+			unsigned char type = buf[i+2] & ~0x10;
+			size_t flen = buf[i+3]>>1;
+			if(buf[i]!=0xF9 || buf[i+1]==0xF9) {
+				i++;
+				continue;
+			}
+			if(len-i<6+flen)
+				break;
+			if(type==0x2F) // SABM -> UA
+				test_cmux_frame(fd, dlci, 0x63 | 0x10, NULL, 0);
+			else if(type==0xEF && dlci>0) {
+				DBG("dlc %d: '%.*s'", dlci, (int)flen-1, buf+i+4)
+				test_cmux_frame(fd, dlci, 0xEF, "\r\nOK\r\n", 6);
+				answered++;
+			}
+			i += 5+flen;
+		}
+		memmove(buf, buf+i, len-i);
+		len -= i;
+	}
+	return NULL;
+}
+
+void test_cmux() {
+	char slave[64];
+	pthread_t peer;
+	thread_params_t *tp_mux;
+	int fd = open_pty(slave, sizeof(slave));
+	DBG()
+
+	if(fd<0)
+		return;
+	pthread_create(&peer, NULL, test_cmux_peer, &fd);
+	tp_mux = create_cmux_thread(slave, 2);
+	if(!tp_mux) {
+		DBG("no multiplexer")
+		pthread_join(peer, NULL);
+		close(fd);
+		return;
+	}
+	for(int dlci=1;dlci<=2;dlci++) {
+		thread_params_t *tp_at = cmux_get_channel(tp_mux, dlci);
+		client_params_t *cp;
+		if(!tp_at) {
+			DBG("dlc %d not open", dlci)
+			continue;
+		}
+		cp = new_client_thread("test_cmux", tp_at);
+		cp->command = at_format_command((const unsigned char *)"at", 2);
+		cp->status = COMMAND_STATE_WAIT_TO_SEND;
+		DBG("dlc %d: %s", dlci, send_command(cp->command, cp) ? "failed" : "OK") // OK
+		if(cp->response)
+			at_free_response(cp->response);
+		at_free_command(cp->command);
+		destroy_client_thread(cp);
+	}
+	pthread_join(peer, NULL);
+	close(fd); // hangup: the mux thread exits and stops the channels
+	pthread_join(tp_mux->tid, NULL); // the uplink threads are joined on exit
+	DBG("mux exited")
+}
+
+// modem on the master side of a pty: OK to every command and CONNECT to atd, then the data is echoed until +++
+static void *test_data_mode_peer(void *data) {
+	int fd = *(int*)data;
+	unsigned char buf[4096];
+	size_t len = 0;
+	int online = 0, hangup = 0;
+	for(int idle=0;!hangup && idle<50;idle++) { // 5 seconds without traffic
+		struct pollfd fds[1] = {{ .fd = fd, .events = POLLIN }};
+		ssize_t n;
+		if(poll(fds, 1, 100)<=0 || !(fds[0].revents & POLLIN))
+			continue; // POLLHUP until the slave is opened
+		n = read(fd, buf+len, sizeof(buf)-len);
+		if(n<=0)
+			continue;
+		idle = 0;
+		len += n;
+		if(online) {
+			if(len==3 && memcmp(buf, "+++", 3)==0) { // alone thanks to the guard time
+				online = 0;
+				write_port(fd, (const unsigned char *)"\r\nOK\r\n", 6, 1000);
+			} else
+				write_port(fd, buf, len, 1000);
+			len = 0;
+			continue;
+		}
+		if(!memchr(buf, '\r', len))
+			continue;
+		if(len>=3 && memcmp(buf, "atd", 3)==0) {
+			online = 1;
+			write_port(fd, (const unsigned char *)"\r\nCONNECT\r\n", 11, 1000);
+		} else {
+			hangup = len>=3 && memcmp(buf, "ath", 3)==0;
+			write_port(fd, (const unsigned char *)"\r\nOK\r\n", 6, 1000);
+		}
+		len = 0;
+	}
+	return NULL;
+}
+
+static int test_at_command(thread_params_t *tp, const char *command, int pty_fd) {
+	client_params_t *cp = new_client_thread("test", tp);
+	at_command_t *cmd = at_format_command((const unsigned char *)command, strlen(command));
+	int ret;
+	cmd->pty_fd = pty_fd;
+	cp->command = cmd;
+	cp->status = COMMAND_STATE_WAIT_TO_SEND;
+	at_response_t *response;
+	ret = send_command(cmd, cp);
+	response = cp->response;
+	DBG("%s: %s", command, ret || !response ? "failed" : (char*)response->buf)
+	if(response)
+		at_free_response(response);
+	if(cmd->pty_fd>=0) // no CONNECT
+		close(cmd->pty_fd);
+	at_free_command(cmd);
+	destroy_client_thread(cp);
+	return ret;
+}
+
+// loopback benchmark of the data mode: pty -> AT port -> echo -> AT port -> pty
+void test_data_mode() {
+	char modem[64], slave[64];
+	unsigned char chunk[16*1024];
+	size_t total = 16*1024*1024, sent = 0, received = 0;
+	struct timespec start, stop;
+	pthread_t peer;
+	thread_params_t *tp_at;
+	int fd = open_pty(modem, sizeof(modem)), pty, data = -1;
+	long msec;
+	DBG()
+
+	if(fd<0)
+		return;
+	pthread_create(&peer, NULL, test_data_mode_peer, &fd);
+	tp_at = create_at_thread(modem);
+	usleep(100000); // temp hack, as in testthreads: the loop initializes its queue and timers
+	pty = open_pty(slave, sizeof(slave));
+	if(!tp_at || pty<0 || test_at_command(tp_at, "atd*99#", pty))
+		goto end;
+	data = open(slave, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(data<0)
+		goto end;
+	memset(chunk, 'x', sizeof(chunk));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while(received<total) {
+		struct pollfd fds[1] = {{ .fd = data, .events = POLLIN | (sent<total ? POLLOUT : 0) }};
+		ssize_t n;
+		if(poll(fds, 1, 1000)<=0) {
+			DBG("stalled after %lu bytes", received)
+			break;
+		}
+		if(fds[0].revents & POLLOUT) {
+			n = write(data, chunk, total-sent<sizeof(chunk) ? total-sent : sizeof(chunk));
+			if(n>0)
+				sent += n;
+		}
+		if(fds[0].revents & POLLIN) {
+			unsigned char echo[sizeof(chunk)];
+			n = read(data, echo, sizeof(echo));
+			if(n>0)
+				received += n;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	msec = (stop.tv_sec-start.tv_sec)*1000 + (stop.tv_nsec-start.tv_nsec)/1000000;
+	DBG("%lu bytes echoed in %ld msec: %ld KB/s", received, msec, msec ? (long)(received/msec) : 0)
+
+	at_data_mode_escape(tp_at);
+	for(int i=0;i<50 && at_in_data_mode(tp_at);i++)
+		usleep(100000);
+	test_at_command(tp_at, "at", -1); // OK: back in command mode
+	test_at_command(tp_at, "ath", -1);
+end:
+	if(data>=0)
+		close(data);
+	pthread_join(peer, NULL);
+	close(fd); // hangup: the AT thread exits
+}
+
+// responses and urcs seen on real modems, plus malformed ones. the parsers are run on each entry,
+// on all of its truncations and on random mutations: under ASan this is the fuzz corpus
+static const char *test_at_corpus[] = {
+	"\r\n+CSQ: 17,99\r\n\r\nOK\r\n",
+	"\r\n+CSQ: 99,99\r\n",
+	"+CSQ: ,\r\n",
+	"\r\n+CESQ: 99,99,255,255,20,45\r\n\r\nOK\r\n",
+	"+CESQ: 99,99,255,255\r\n",
+	"\r\n+CREG: 2,1,\"1A2B\",\"01C3D4E5\",7\r\n\r\nOK\r\n",
+	"\r\n+CREG: 0,5\r\n\r\nOK\r\n",
+	"+CREG: 1,\"1A2B\",\"01C3D4E5\",7\r\n",
+	"+CGREG: 1\r\n",
+	"\r\n+CEREG: 2,1,\"00C1\",\"0A1B2C3D\",7\r\n\r\nOK\r\n",
+	"+CEREG: 4,\"FFFFFFFFFFFFFFFFFFFFFFFF\",\"\"\r\n",
+	"\r\n+COPS: 0,0,\"Vodafone IT\",7\r\n\r\nOK\r\n",
+	"\r\n+COPS: 0\r\n\r\nOK\r\n",
+	"+COPS: 0,2,\"22210\r\n",
+	"\r\n+CGDCONT: 1,\"IP\",\"internet\",\"0.0.0.0\",0,0\r\n+CGDCONT: 2,\"IPV4V6\",\"ims\",\"\",0,0\r\n\r\nOK\r\n",
+	"+CGDCONT: 3,\"IPV6\",\"a,b\"\"c\r\n",
+	"\r\n+CGPADDR: 1,\"10.11.12.13\"\r\n+CGPADDR: 2,\"10.0.0.1\",\"32.1.13.184.0.0.0.0.0.0.0.0.0.0.0.1\"\r\n\r\nOK\r\n",
+	"+CGPADDR: 1\r\n",
+	"\r\n+CPIN: READY\r\n\r\nOK\r\n",
+	"+CPIN: SIM PIN\r\n",
+	"\r\n+CCID: 89390100001234567890\r\n\r\nOK\r\n",
+	"+CCID: \"8939010000123456789012345678901234\"\r\n",
+	"+CCID:\r\n",
+	"\r\n\r\n\r\n",
+	"+",
+	"",
+};
+
+static void test_at_parse_all(const unsigned char *buf, size_t size) {
+	at_csq_t csq;
+	at_cesq_t cesq;
+	at_reg_t reg;
+	at_cops_t cops;
+	at_cgdcont_t ctx[4];
+	at_cgpaddr_t addr[4];
+	at_cpin_t cpin;
+	at_ccid_t ccid;
+	at_parse_csq(buf, size, &csq);
+	at_parse_cesq(buf, size, &cesq);
+	at_parse_reg(buf, size, "+CREG:", &reg);
+	at_parse_reg(buf, size, "+CEREG:", &reg);
+	at_parse_cops(buf, size, &cops);
+	at_parse_cgdcont(buf, size, ctx, 4);
+	at_parse_cgpaddr(buf, size, addr, 4);
+	at_parse_cpin(buf, size, &cpin);
+	at_parse_ccid(buf, size, &ccid);
+}
+
+void test_at_parsers() {
+	const int entries = sizeof(test_at_corpus)/sizeof(test_at_corpus[0]);
+	const int rounds = 100000;
+	struct timespec start, stop;
+	unsigned int seed = 1;
+	long nsec;
+	DBG()
+
+	for(int i=0;i<entries;i++) { // every truncation, in a buffer of the exact size so that ASan sees overreads
+		size_t len = strlen(test_at_corpus[i]);
+		for(size_t cut=0;cut<=len;cut++) {
+			unsigned char *buf = malloc(cut ? cut : 1);
+			memcpy(buf, test_at_corpus[i], cut);
+			test_at_parse_all(buf, cut);
+			free(buf);
+		}
+	}
+	for(int round=0;round<rounds;round++) { // random mutations
+		const char *src = test_at_corpus[round%entries];
+		size_t len = strlen(src);
+		unsigned char *buf = malloc(len ? len : 1);
+		memcpy(buf, src, len);
+		for(int m=0;len && m<4;m++) {
+			seed = seed*1103515245+12345;
+			buf[(seed>>8)%len] = "\",\r\n 0aF+:"[(seed>>20)%10];
+		}
+		test_at_parse_all(buf, len);
+		free(buf);
+	}
+	DBG("corpus: %d entries, %d mutations", entries, rounds)
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int round=0;round<rounds;round++)
+		for(int i=0;i<entries;i++)
+			test_at_parse_all((const unsigned char *)test_at_corpus[i], strlen(test_at_corpus[i]));
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	nsec = (stop.tv_sec-start.tv_sec)*1000000000L + (stop.tv_nsec-start.tv_nsec);
+	DBG("%ld nsec for all the parsers on an entry", nsec/((long)rounds*entries))
+}
+
+// address events received since the previous call
+static void test_ip_config_events(int fd, int *added, int *deleted) {
+	unsigned char buf[8192];
+	ssize_t n;
+	*added = *deleted = 0;
+	while((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT))>0) {
+		for(struct nlmsghdr *nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, n); nlh = NLMSG_NEXT(nlh, n)) {
+			if(nlh->nlmsg_type==RTM_NEWADDR)
+				(*added)++;
+			else if(nlh->nlmsg_type==RTM_DELADDR)
+				(*deleted)++;
+		}
+	}
+}
+
+// as root: a session configured on a veth, in a network namespace of its own (the calling thread stays in it)
+void test_ip_config() {
+	struct sockaddr_nl groups = { .nl_family = AF_NETLINK, .nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR };
+	mbim_ip_config_t ip = {0};
+	int fd, added, deleted;
+	DBG()
+
+	if(unshare(CLONE_NEWNET) || system("ip link add wwan0 type veth peer name wwan0p")) {
+		DBG("no network namespace or no veth")
+		return;
+	}
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if(fd<0 || bind(fd, (struct sockaddr *)&groups, sizeof(groups))) {
+		DBG("no rtnetlink")
+		goto end;
+	}
+	ip.IPv4ConfigurationAvailable = 1 | 2 | 8; // address, gateway, mtu
+	ip.IPv4AddressCount = 1;
+	ip.IPv4Address[0].OnLinkPrefixLength = 24;
+	memcpy(ip.IPv4Address[0].IPv4Address, (const uint8_t[]){ 10, 0, 0, 2 }, 4);
+	memcpy(ip.IPv4Gateway, (const uint8_t[]){ 10, 0, 0, 1 }, 4);
+	ip.IPv4Mtu = 1400;
+	ip.IPv6ConfigurationAvailable = 1;
+	ip.IPv6AddressCount = 1;
+	ip.IPv6Address[0].OnLinkPrefixLength = 64;
+	memcpy(ip.IPv6Address[0].IPv6Address, (const uint8_t[]){ 0x20, 0x01, 0x0d, 0xb8, [15] = 2 }, 16);
+
+	DBG("up: %d", mbim_apply_ip_config("wwan0", 0, &ip)) // 0
+	test_ip_config_events(fd, &added, &deleted);
+	DBG("added %d, deleted %d", added, deleted) // 2, 0
+	DBG("same again: %d", mbim_apply_ip_config("wwan0", 0, &ip)) // 0
+	test_ip_config_events(fd, &added, &deleted);
+	DBG("deleted %d", deleted) // 0: the addresses stay through a reconnection to the same ones
+	ip.IPv4Address[0].IPv4Address[3] = 3;
+	DBG("new ipv4 address: %d", mbim_apply_ip_config("wwan0", 0, &ip)) // 0
+	test_ip_config_events(fd, &added, &deleted);
+	DBG("added %d, deleted %d", added, deleted) // 2, 1: the ipv6 address is replaced in place, only the previous ipv4 address goes
+	DBG("down: %d", mbim_apply_ip_config("wwan0", 0, NULL)) // 0
+	test_ip_config_events(fd, &added, &deleted);
+	DBG("deleted %d", deleted) // 2
+end:
+	if(fd>=0)
+		close(fd);
+	if(system("ip link del wwan0"))
+		DBG("veth not deleted")
+}
+
+freembim_options_t freembim_options;
+
 thread_params_t *tp_tty; // temp hack -> add external interfaces dictionary: interfaces.h/c
 
 void testthreads() {
@@ -92,9 +482,44 @@ void testthreads() {
 	free(tp_udev);
 }
 
+void usage() {
+	printf("usage: %s [options]\n"
+		"\t-m <n>\tuse a 27.010 multiplexer with <n> channels on the AT port (1..%d)\n"
+		"\t-i\tinitialize mbim on discovery\n"
+		"\t-a <apn>\tas -i, and connect <apn> once registered\n"
+		"\t-h\tthis help\n",
+		PROGRAM_NAME, CMUX_MAX_DLC);
+}
+
 int main(int argc, char *argv[]) {
+	int opt;
+	while((opt = getopt(argc, argv, "m:ia:h")) != -1) {
+		switch(opt) {
+		case 'm':
+			freembim_options.cmux_channels = atoi(optarg);
+			if(freembim_options.cmux_channels<0 || freembim_options.cmux_channels>CMUX_MAX_DLC) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'i':
+			freembim_options.auto_init = 1;
+			break;
+		case 'a':
+			freembim_options.auto_init = 1;
+			freembim_options.auto_apn = optarg;
+			break;
+		default:
+			usage();
+			return opt=='h' ? 0 : 1;
+		}
+	}
 	DBG("%s %s\n", PROGRAM_NAME, PROGRAM_VERSION);
 	//test_queues();
+	//test_at_parsers();
+	//test_cmux();
+	//test_data_mode();
+	//test_ip_config();
 	testthreads();
 }
 
@@ -35,6 +35,7 @@ either expressed or implied, of the <project name> project.
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 void bin_to_hex(const unsigned char*bin, char *hex, size_t binbuflen) {
 	for(size_t i=0;i<binbuflen;i++) {
@@ -68,11 +69,48 @@ void mbim_free_message(mbim_message_t *msg) {
 
 void mbim_free_function_message(mbim_function_message_t *msg) {
 	if(!msg) return;
+	if(__atomic_fetch_sub(&msg->refs, 1, __ATOMIC_ACQ_REL)>0) // still shared
+		return;
 	if(msg->bin_buf)
 		free(msg->bin_buf);
 	free(msg);
 }
 
+mbim_function_message_t *mbim_ref_function_message(mbim_function_message_t *msg) {
+	__atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+	return msg;
+}
+
+mbim_function_message_t *mbim_copy_function_message(const mbim_function_message_t *msg) {
+	mbim_function_message_t *m = calloc(1, sizeof(mbim_function_message_t));
+	m->type = msg->type;
+	m->sequence_id = msg->sequence_id;
+	m->size = msg->size;
+	m->bin_buf = malloc(msg->size);
+	memcpy(m->bin_buf, msg->bin_buf, msg->size);
+	return m;
+}
+
+// CommandType is the 6th uint32 after the uuid: decoded from the hex buffer without conversion of the rest
+int mbim_message_is_query(const mbim_message_t *msg) {
+	unsigned char head[UUID_LEN+2*sizeof(uint32_t)];
+	size_t n = 0;
+	const char *p = msg->hex_buf;
+	if(msg->type!=MBIM_COMMAND_MSG || !p)
+		return 0;
+	while(*p && n<sizeof(head)) {
+		if(hex2binC(p[0])==-1) {
+			p++;
+			continue;
+		}
+		if(hex2binC(p[1])==-1)
+			return 0;
+		head[n++] = (hex2binC(p[0])<<4) | hex2binC(p[1]);
+		p+=2;
+	}
+	return n==sizeof(head) && bin_to_uint32(head+UUID_LEN+sizeof(uint32_t), USE_LITTLE_ENDIAN)==0;
+}
+
 mbim_message_t *mbim_format_open() {
 	mbim_message_t *msg = calloc(1, sizeof(mbim_message_t));
 	msg->type = MBIM_OPEN;
@@ -98,7 +136,7 @@ mbim_message_t *mbim_format_query_device_capabilities() {
 	return msg;
 }
 
-mbim_message_t *mbim_format_set_subscriptions(int ElementCount, ...) { // paramlist TODO
+static mbim_message_t *mbim_format_set_subscription_groups(int ElementCount, char **groups) {
 	mbim_message_t *msg = calloc(1, sizeof(mbim_message_t));
 	uint32_t code = mbim_get_cmd_code(MBIM_CID_DEVICE_SERVICE_SUBSCRIBE_LIST);
 	UUID_t uuid = mbim_get_uuid(MBIM_CID_DEVICE_SERVICE_SUBSCRIBE_LIST);
@@ -106,32 +144,19 @@ mbim_message_t *mbim_format_set_subscriptions(int ElementCount, ...) { // paraml
 
 	char *buffer = NULL;
 	size_t size = snprintf(buffer, 0, FUINT32LE, VUINT32LE(0))*(1+2*ElementCount);
-
-	va_list args;
-  	va_start (args, ElementCount);
-	for(int i = 0;i<ElementCount;i++) {
-		char *subGroup = va_arg(args, char*);
-		size += strlen(subGroup);
-	}
-	va_end (args);
+	for(int i = 0;i<ElementCount;i++)
+		size += strlen(groups[i]);
 	size++;
 	buffer = calloc(size, sizeof(char));
 	int pos = snprintf(buffer, size, FUINT32LE, VUINT32LE(ElementCount));
 	uint32_t offset = 4+8*ElementCount;
-  	va_start (args, ElementCount);
 	for(int i = 0;i<ElementCount;i++) {
-		char *subGroup = va_arg(args, char*);
-		uint32_t grouplen = hex_to_bin_len(subGroup);
+		uint32_t grouplen = hex_to_bin_len(groups[i]);
 		pos += snprintf(buffer+pos, size-pos, FUINT32LE FUINT32LE, VUINT32LE(offset), VUINT32LE(grouplen));
 		offset += grouplen;
 	}
-	va_end (args);
-  	va_start (args, ElementCount);
-	for(int i = 0;i<ElementCount;i++) {
-		char *subGroup = va_arg(args, char*);
-		pos += snprintf(buffer+pos, size-pos, "%s", subGroup);
-	}
-	va_end (args);
+	for(int i = 0;i<ElementCount;i++)
+		pos += snprintf(buffer+pos, size-pos, "%s", groups[i]);
 
 	msg->type = MBIM_COMMAND_MSG;
 	msg->hex_buf = strdup_printf("%s " FUINT32LE FUINT32LE FUINT32LE "%s", uuid, VUINT32LE(code), VUINT32LE(command_type), VUINT32LE(hex_to_bin_len(buffer)), buffer);
@@ -139,6 +164,18 @@ mbim_message_t *mbim_format_set_subscriptions(int ElementCount, ...) { // paraml
 	return msg;
 }
 
+mbim_message_t *mbim_format_set_subscriptions(int ElementCount, ...) { // paramlist TODO
+	char **groups = calloc(ElementCount+1, sizeof(char *));
+	va_list args;
+  	va_start (args, ElementCount);
+	for(int i = 0;i<ElementCount;i++)
+		groups[i] = va_arg(args, char*);
+	va_end (args);
+	mbim_message_t *msg = mbim_format_set_subscription_groups(ElementCount, groups);
+	free(groups);
+	return msg;
+}
+
 char *mbim_get_subscription_group(UUID_t uuid, uint32_t CidCount, ...) {
 	char *s = NULL;
 	size_t size = snprintf (s, 0, "%s " FUINT32LE, uuid, VUINT32LE(CidCount)) + snprintf(s, 0, FUINT32LE, VUINT32LE(0))*CidCount+1;
@@ -269,6 +306,88 @@ error:
 	return NULL;
 }
 
+static mbim_message_t *mbim_format_command(enum mbim_command_code cc, uint32_t command_type, const unsigned char *info, uint32_t len) {
+	mbim_message_t *msg = calloc(1, sizeof(mbim_message_t));
+
+	uint32_t code = mbim_get_cmd_code(cc);
+	UUID_t uuid = mbim_get_uuid(cc);
+
+	char *infobuf = calloc(len*2+1, sizeof(char));
+	bin_to_hex(info, infobuf, len);
+
+	msg->type = MBIM_COMMAND_MSG;
+	msg->hex_buf = strdup_printf("%s " FUINT32LE FUINT32LE FUINT32LE "%s", uuid, VUINT32LE(code), VUINT32LE(command_type), VUINT32LE(len), infobuf);
+
+	free(infobuf);
+	return msg;
+}
+
+mbim_message_t *mbim_format_query(enum mbim_command_code cc, const unsigned char *info, uint32_t len) {
+	return mbim_format_command(cc, 0, info, len);
+}
+
+mbim_message_t *mbim_format_set(enum mbim_command_code cc, const unsigned char *info, uint32_t len) {
+	return mbim_format_command(cc, 1, info, len);
+}
+
+static void info_put_uint32(unsigned char *info, uint32_t offset, uint32_t v) {
+	info[offset] = v & 0xFF;
+	info[offset+1] = (v>>8) & 0xFF;
+	info[offset+2] = (v>>16) & 0xFF;
+	info[offset+3] = (v>>24) & 0xFF;
+}
+
+#define PAD4(n)	(((n)+3) & ~3u)
+
+// SessionId, PacketFiltersCount, PacketFilterRefList, then for each filter: FilterSize, PacketFilterOffset, PacketMaskOffset, filter, mask
+mbim_message_t *mbim_format_set_packet_filters(const mbim_packet_filters_t *f) {
+	uint32_t count = f->PacketFiltersCount<MBIM_MAX_PACKET_FILTERS ? f->PacketFiltersCount : MBIM_MAX_PACKET_FILTERS;
+	uint32_t len = 2*sizeof(uint32_t)+count*2*sizeof(uint32_t);
+	for(uint32_t i=0;i<count;i++)
+		len += 3*sizeof(uint32_t)+PAD4(2*f->filters[i].FilterSize);
+	unsigned char *info = calloc(len, 1);
+	uint32_t pos = 2*sizeof(uint32_t)+count*2*sizeof(uint32_t);
+	info_put_uint32(info, 0, f->SessionId);
+	info_put_uint32(info, 4, count);
+	for(uint32_t i=0;i<count;i++) {
+		const mbim_packet_filter_t *pf = &f->filters[i];
+		uint32_t size = 3*sizeof(uint32_t)+PAD4(2*pf->FilterSize);
+		info_put_uint32(info, 8+i*8, pos);
+		info_put_uint32(info, 8+i*8+4, size);
+		info_put_uint32(info, pos, pf->FilterSize);
+		info_put_uint32(info, pos+4, 3*sizeof(uint32_t)); // from the start of this filter
+		info_put_uint32(info, pos+8, 3*sizeof(uint32_t)+pf->FilterSize);
+		memcpy(info+pos+12, pf->PacketFilter, pf->FilterSize);
+		memcpy(info+pos+12+pf->FilterSize, pf->PacketMask, pf->FilterSize);
+		pos += size;
+	}
+	mbim_message_t *msg = mbim_format_set(MBIM_CID_IP_PACKET_FILTERS, info, len);
+	free(info);
+	return msg;
+}
+
+mbim_message_t *mbim_format_query_packet_filters(uint32_t session_id) {
+	unsigned char info[2*sizeof(uint32_t)] = {0};
+	info_put_uint32(info, 0, session_id);
+	return mbim_format_query(MBIM_CID_IP_PACKET_FILTERS, info, sizeof(info));
+}
+
+// interval in seconds between reports, rssi threshold in 2 dBm steps, error rate threshold in coded steps
+mbim_message_t *mbim_format_set_signal_state(uint32_t interval_sec, uint32_t rssi_threshold, uint32_t error_rate_threshold) {
+	mbim_message_t *msg = calloc(1, sizeof(mbim_message_t));
+
+	uint32_t code = mbim_get_cmd_code(MBIM_CID_SIGNAL_STATE);
+	UUID_t uuid = mbim_get_uuid(MBIM_CID_SIGNAL_STATE);
+	uint32_t command_type = 1; // set
+
+	msg->type = MBIM_COMMAND_MSG;
+	msg->hex_buf = strdup_printf("%s " FUINT32LE FUINT32LE FUINT32LE FUINT32LE FUINT32LE FUINT32LE, uuid, VUINT32LE(code),
+		VUINT32LE(command_type), VUINT32LE(3*sizeof(uint32_t)),
+		VUINT32LE(interval_sec), VUINT32LE(rssi_threshold), VUINT32LE(error_rate_threshold));
+
+	return msg;
+}
+
 mbim_message_t *mbim_format_query_ip_configuration(uint32_t sessionId) {
 	mbim_message_t *msg = calloc(1, sizeof(mbim_message_t));
 
@@ -332,9 +451,59 @@ void print_mbim_frame(unsigned char *buf) {
 	print_hexa(buf, frame_length);
 }
 
-// TODO: split the command type==MBIM_COMMAND_MSG in frames if size>MaxControlTransfer
+int mbim_parse_usb_descriptors(const unsigned char *desc, uint32_t len, mbim_usb_limits_t *limits) {
+	memset(limits, 0, sizeof(mbim_usb_limits_t));
+	for(uint32_t offset=0;offset+2<=len;offset+=desc[offset]) {
+		const unsigned char *d = desc+offset;
+		if(d[0]<2 || offset+d[0]>len)
+			break; // truncated
+		if(d[1]!=0x24 || d[0]<3) // CS_INTERFACE
+			continue;
+		if(d[2]==0x1B && d[0]>=12 && !limits->MaxControlMessage) { // the first MBIM function
+			limits->MaxControlMessage = d[5] | d[6]<<8;
+			limits->NumberFilters = d[7];
+			limits->MaxFilterSize = d[8];
+			limits->MaxSegmentSize = d[9] | d[10]<<8;
+			limits->NetworkCapabilities = d[11];
+		} else if(d[2]==0x1C && d[0]>=8 && !limits->MTU) {
+			limits->MaxOutstandingCommandMessages = d[5];
+			limits->MTU = d[6] | d[7]<<8;
+		}
+	}
+	return limits->MaxControlMessage ? 0 : -1;
+}
+
+// a command longer than MaxControlTransfer is split in fragments, each one written as a control transfer
+static mbim_frame_t *mbim_command_to_fragments(mbim_message_t *msg, uint32_t sequenceId, uint32_t MaxControlTransfer) {
+	const uint32_t header_len = 5*sizeof(uint32_t); // message and fragment headers
+	mbim_frame_t *first = NULL, **next = &first;
+	int len = hex_to_bin_len(msg->hex_buf); // DeviceServiceUUID, CID, CommandType, InformationBufferLength and InformationBuffer
+	if(len<0)
+		exit(2);
+	unsigned char *payload = malloc(len ? len : 1);
+	hex_to_bin(msg->hex_buf, payload);
+	uint32_t chunk = MaxControlTransfer>header_len ? MaxControlTransfer-header_len : (uint32_t)len;
+	uint32_t total = len && chunk ? (len+chunk-1)/chunk : 1;
+	for(uint32_t i=0, offset=0;i<total;i++) {
+		uint32_t size = (uint32_t)len-offset<chunk ? (uint32_t)len-offset : chunk;
+		mbim_frame_t *frame = calloc(1, sizeof(mbim_frame_t));
+		frame->data = malloc(header_len+size);
+		info_put_uint32(frame->data, 0, msg->type);
+		info_put_uint32(frame->data, 4, header_len+size);
+		info_put_uint32(frame->data, 8, sequenceId);
+		info_put_uint32(frame->data, 12, total);
+		info_put_uint32(frame->data, 16, i);
+		memcpy(frame->data+header_len, payload+offset, size);
+		offset += size;
+		*next = frame;
+		next = &frame->next;
+	}
+	free(payload);
+	return first;
+}
+
 mbim_frame_t *mbim_message_to_frames(mbim_message_t *msg, uint32_t sequenceId, uint32_t MaxControlTransfer) {
-	mbim_frame_t *frame = calloc(1, sizeof(mbim_frame_t));
+	mbim_frame_t *frame;
 	char *buf;
 	switch(msg->type) {
 	case MBIM_OPEN:
@@ -348,20 +517,13 @@ mbim_frame_t *mbim_message_to_frames(mbim_message_t *msg, uint32_t sequenceId, u
 			VUINT32LE(msg->type), VUINT32LE(3*sizeof(uint32_t)), VUINT32LE(sequenceId));
 		break;
 	case MBIM_COMMAND_MSG:
-		buf = strdup_printf(FUINT32LE FUINT32LE FUINT32LE		// type, message_length, sequenceId
-			FUINT32LE FUINT32LE					// totalFragments=1, currentFragment=0,
-			"%s", 							// buffer, including DeviceServiceUUID, CID, CommandType, InformationBufferLength and InformationBuffer
-			VUINT32LE(msg->type), VUINT32LE(5*sizeof(uint32_t)+hex_to_bin_len(msg->hex_buf)), VUINT32LE(sequenceId),
-			VUINT32LE(1), VUINT32LE(0),
-			msg->hex_buf);
-		break;
+		return mbim_command_to_fragments(msg, sequenceId, MaxControlTransfer);
 	default: // invalid or not supported type
-		free(frame);
 		return NULL;
-		break;
 	}
 	if(hex_to_bin_len(buf)==-INCOMPLETE_HEX_VALUE)
 		exit(2);
+	frame = calloc(1, sizeof(mbim_frame_t));
 	frame->data = calloc(hex_to_bin_len(buf), sizeof(unsigned char));
 	hex_to_bin(buf, frame->data);
 	free(buf);
@@ -424,13 +586,48 @@ UUID_t mbim_get_uuid(enum mbim_command_code cc) {
 	return mbim_commands[cc].uuid;
 };
 
+// one group per service, in the order of mbim_commands where the services are contiguous
+mbim_message_t *mbim_format_set_subscription_mask(uint64_t cids) {
+	char *groups[MBIM_INVALID];
+	uint32_t cid[MBIM_INVALID];
+	int count = 0;
+	for(enum mbim_command_code cc = 0;cc<MBIM_INVALID;) {
+		UUID_t uuid = mbim_commands[cc].uuid;
+		uint32_t n = 0;
+		for(;cc<MBIM_INVALID && strcmp((const char *)mbim_commands[cc].uuid, (const char *)uuid)==0;cc++)
+			if(cids & MBIM_CID_BIT(cc))
+				cid[n++] = mbim_commands[cc].CID;
+		if(!n)
+			continue;
+		size_t size = strlen((const char *)uuid)+1+(1+n)*strlen("00000000 ")+1;
+		char *s = calloc(size, sizeof(char));
+		int pos = snprintf(s, size, "%s " FUINT32LE, uuid, VUINT32LE(n));
+		for(uint32_t i=0;i<n;i++)
+			pos += snprintf(s+pos, size-pos, FUINT32LE, VUINT32LE(cid[i]));
+		groups[count++] = s;
+	}
+	mbim_message_t *msg = mbim_format_set_subscription_groups(count, groups);
+	for(int i=0;i<count;i++)
+		free(groups[i]);
+	return msg;
+}
+
+static unsigned char mbim_commands_uuid_bin[MBIM_INVALID][UUID_LEN]; // converted once
+static pthread_once_t mbim_commands_uuid_once = PTHREAD_ONCE_INIT;
+
+static void mbim_commands_uuid_init() {
+	for(enum mbim_command_code cc = 0;cc<MBIM_INVALID;cc++)
+		hex_to_bin(mbim_commands[cc].uuid, mbim_commands_uuid_bin[cc]);
+}
+
 enum mbim_command_code mbim_get_msg_cmd_code(mbim_function_message_t* msg) {
 	enum mbim_command_code cc = MBIM_CID_DEVICE_CAPS;
-	unsigned char uuid_bin[UUID_LEN];
+	if(!msg->bin_buf || msg->size<UUID_LEN+sizeof(uint32_t))
+		return MBIM_INVALID;
+	pthread_once(&mbim_commands_uuid_once, mbim_commands_uuid_init);
+	uint32_t CID = bin_to_uint32(msg->bin_buf+UUID_LEN, USE_LITTLE_ENDIAN);
 	while(cc<MBIM_INVALID) {
-		hex_to_bin(mbim_commands[cc].uuid, uuid_bin);
-		uint32_t CID = bin_to_uint32(msg->bin_buf+UUID_LEN, USE_LITTLE_ENDIAN);
-		if(memcmp(uuid_bin, msg->bin_buf, UUID_LEN)==0 && CID==mbim_commands[cc].CID)
+		if(CID==mbim_commands[cc].CID && memcmp(mbim_commands_uuid_bin[cc], msg->bin_buf, UUID_LEN)==0)
 			return cc;
 		++cc;
 	}
@@ -450,3 +647,214 @@ const char*get_activation_state_string(uint32_t act_state) {
 		act_state=0;
 	return act_strings[act_state];
 }
+
+/******************************************************************************/
+// decoders
+
+int mbim_get_info_buffer(const mbim_function_message_t *msg, const unsigned char **info, uint32_t *len, uint32_t *status) {
+	uint32_t header = UUID_LEN+sizeof(uint32_t); // uuid, cid
+	if(msg->type==MBIM_COMMAND_DONE) {
+		if(msg->size<header+2*sizeof(uint32_t))
+			return -1;
+		if(status)
+			*status = bin_to_uint32(msg->bin_buf+header, USE_LITTLE_ENDIAN);
+		header += sizeof(uint32_t);
+	} else if(msg->type==MBIM_INDICATE_STATUS_MSG) {
+		if(msg->size<header+sizeof(uint32_t))
+			return -1;
+	} else
+		return -1;
+	*len = bin_to_uint32(msg->bin_buf+header, USE_LITTLE_ENDIAN);
+	*info = msg->bin_buf+header+sizeof(uint32_t);
+	if(*len>msg->size-header-sizeof(uint32_t))
+		return -1;
+	return 0;
+}
+
+static uint32_t info_uint32(const unsigned char *info, uint32_t i) {
+	return bin_to_uint32(info+i*sizeof(uint32_t), USE_LITTLE_ENDIAN);
+}
+
+// utf16le string at offset/size of the information buffer, to utf8. only the bmp is expected
+static void info_string(const unsigned char *info, uint32_t len, uint32_t offset, uint32_t size, char *dst, size_t dstsize) {
+	size_t n = 0;
+	if(offset>len || size>len-offset)
+		size = 0; // invalid reference
+	for(uint32_t i=0;i+1<size;i+=2) {
+		uint32_t c = info[offset+i] | (info[offset+i+1]<<8);
+		size_t need = c<0x80 ? 1 : c<0x800 ? 2 : 3;
+		if(n+need>=dstsize)
+			break;
+		if(need==1)
+			dst[n++] = c;
+		else if(need==2) {
+			dst[n++] = 0xC0 | (c>>6);
+			dst[n++] = 0x80 | (c & 0x3F);
+		} else {
+			dst[n++] = 0xE0 | (c>>12);
+			dst[n++] = 0x80 | ((c>>6) & 0x3F);
+			dst[n++] = 0x80 | (c & 0x3F);
+		}
+	}
+	dst[n] = 0;
+}
+
+int mbim_decode_device_caps(const unsigned char *info, uint32_t len, mbim_device_caps_t *s) {
+	if(len<16*sizeof(uint32_t))
+		return -1;
+	s->DeviceType = info_uint32(info, 0);
+	s->CellularClass = info_uint32(info, 1);
+	s->VoiceClass = info_uint32(info, 2);
+	s->SimClass = info_uint32(info, 3);
+	s->DataClass = info_uint32(info, 4);
+	s->SmsCaps = info_uint32(info, 5);
+	s->ControlCaps = info_uint32(info, 6);
+	s->MaxSessions = info_uint32(info, 7);
+	info_string(info, len, info_uint32(info, 8), info_uint32(info, 9), s->CustomDataClass, sizeof(s->CustomDataClass));
+	info_string(info, len, info_uint32(info, 10), info_uint32(info, 11), s->DeviceId, sizeof(s->DeviceId));
+	info_string(info, len, info_uint32(info, 12), info_uint32(info, 13), s->FirmwareInfo, sizeof(s->FirmwareInfo));
+	info_string(info, len, info_uint32(info, 14), info_uint32(info, 15), s->HardwareInfo, sizeof(s->HardwareInfo));
+	return 0;
+}
+
+int mbim_decode_subscriber_ready(const unsigned char *info, uint32_t len, mbim_subscriber_ready_t *s) {
+	if(len<7*sizeof(uint32_t))
+		return -1;
+	s->ReadyState = info_uint32(info, 0);
+	info_string(info, len, info_uint32(info, 1), info_uint32(info, 2), s->SubscriberId, sizeof(s->SubscriberId));
+	info_string(info, len, info_uint32(info, 3), info_uint32(info, 4), s->SimIccId, sizeof(s->SimIccId));
+	return 0;
+}
+
+int mbim_decode_radio_state(const unsigned char *info, uint32_t len, mbim_radio_state_t *s) {
+	if(len<2*sizeof(uint32_t))
+		return -1;
+	s->HwRadioState = info_uint32(info, 0);
+	s->SwRadioState = info_uint32(info, 1);
+	return 0;
+}
+
+int mbim_decode_register_state(const unsigned char *info, uint32_t len, mbim_register_state_t *s) {
+	if(len<12*sizeof(uint32_t))
+		return -1;
+	s->NwError = info_uint32(info, 0);
+	s->RegisterState = info_uint32(info, 1);
+	s->RegisterMode = info_uint32(info, 2);
+	s->AvailableDataClasses = info_uint32(info, 3);
+	s->CurrentCellularClass = info_uint32(info, 4);
+	info_string(info, len, info_uint32(info, 5), info_uint32(info, 6), s->ProviderId, sizeof(s->ProviderId));
+	info_string(info, len, info_uint32(info, 7), info_uint32(info, 8), s->ProviderName, sizeof(s->ProviderName));
+	info_string(info, len, info_uint32(info, 9), info_uint32(info, 10), s->RoamingText, sizeof(s->RoamingText));
+	s->RegistrationFlag = info_uint32(info, 11);
+	return 0;
+}
+
+int mbim_decode_packet_service(const unsigned char *info, uint32_t len, mbim_packet_service_t *s) {
+	if(len<7*sizeof(uint32_t))
+		return -1;
+	s->NwError = info_uint32(info, 0);
+	s->PacketServiceState = info_uint32(info, 1);
+	s->HighestAvailableDataClass = info_uint32(info, 2);
+	s->UplinkSpeed = bin_to_uint64(info+3*sizeof(uint32_t), USE_LITTLE_ENDIAN);
+	s->DownlinkSpeed = bin_to_uint64(info+5*sizeof(uint32_t), USE_LITTLE_ENDIAN);
+	return 0;
+}
+
+int mbim_decode_signal_state(const unsigned char *info, uint32_t len, mbim_signal_state_t *s) {
+	if(len<5*sizeof(uint32_t))
+		return -1;
+	s->Rssi = info_uint32(info, 0);
+	s->ErrorRate = info_uint32(info, 1);
+	s->SignalStrengthInterval = info_uint32(info, 2);
+	s->RssiThreshold = info_uint32(info, 3);
+	s->ErrorRateThreshold = info_uint32(info, 4);
+	return 0;
+}
+
+int mbim_decode_connect(const unsigned char *info, uint32_t len, mbim_connect_state_t *s) {
+	if(len<5*sizeof(uint32_t)+UUID_LEN)
+		return -1;
+	s->SessionId = info_uint32(info, 0);
+	s->ActivationState = info_uint32(info, 1);
+	s->VoiceCallState = info_uint32(info, 2);
+	s->IPType = info_uint32(info, 3);
+	memcpy(s->ContextType, info+4*sizeof(uint32_t), UUID_LEN);
+	s->NwError = bin_to_uint32(info+4*sizeof(uint32_t)+UUID_LEN, USE_LITTLE_ENDIAN);
+	return 0;
+}
+
+// copies count elements of size at offset, within the buffer and up to max
+static uint32_t info_elements(const unsigned char *info, uint32_t len, uint32_t offset, uint32_t count, size_t size, void *dst, uint32_t max) {
+	if(count>max)
+		count = max;
+	if(!offset || offset>len || count*size>len-offset)
+		return 0;
+	memcpy(dst, info+offset, count*size);
+	return count;
+}
+
+int mbim_decode_packet_filters(const unsigned char *info, uint32_t len, mbim_packet_filters_t *s) {
+	if(len<2*sizeof(uint32_t))
+		return -1;
+	memset(s, 0, sizeof(mbim_packet_filters_t));
+	s->SessionId = info_uint32(info, 0);
+	uint32_t count = info_uint32(info, 1);
+	if(count>MBIM_MAX_PACKET_FILTERS || count>(len-8)/8)
+		return -1;
+	for(uint32_t i=0;i<count;i++) {
+		mbim_packet_filter_t *pf = &s->filters[i];
+		uint32_t offset = info_uint32(info, 2+2*i);
+		uint32_t size = info_uint32(info, 3+2*i);
+		if(offset>len || size>len-offset || size<3*sizeof(uint32_t))
+			return -1;
+		const unsigned char *p = info+offset;
+		uint32_t fsize = bin_to_uint32(p, USE_LITTLE_ENDIAN);
+		uint32_t foffset = bin_to_uint32(p+4, USE_LITTLE_ENDIAN);
+		uint32_t moffset = bin_to_uint32(p+8, USE_LITTLE_ENDIAN);
+		if(fsize>MBIM_MAX_FILTER_SIZE || foffset>size || fsize>size-foffset || moffset>size || fsize>size-moffset)
+			return -1;
+		pf->FilterSize = fsize;
+		memcpy(pf->PacketFilter, p+foffset, fsize);
+		memcpy(pf->PacketMask, p+moffset, fsize);
+	}
+	s->PacketFiltersCount = count;
+	return 0;
+}
+
+int mbim_decode_packet_statistics(const unsigned char *info, uint32_t len, mbim_packet_statistics_t *s) {
+	if(len<4*sizeof(uint32_t)+4*sizeof(uint64_t))
+		return -1;
+	s->InDiscards = info_uint32(info, 0);
+	s->InErrors = info_uint32(info, 1);
+	s->InOctets = bin_to_uint64(info+8, USE_LITTLE_ENDIAN);
+	s->InPackets = bin_to_uint64(info+16, USE_LITTLE_ENDIAN);
+	s->OutOctets = bin_to_uint64(info+24, USE_LITTLE_ENDIAN);
+	s->OutPackets = bin_to_uint64(info+32, USE_LITTLE_ENDIAN);
+	s->OutErrors = info_uint32(info, 10);
+	s->OutDiscards = info_uint32(info, 11);
+	return 0;
+}
+
+int mbim_decode_ip_configuration(const unsigned char *info, uint32_t len, mbim_ip_config_t *s) {
+	if(len<15*sizeof(uint32_t))
+		return -1;
+	memset(s, 0, sizeof(mbim_ip_config_t));
+	s->SessionId = info_uint32(info, 0);
+	s->IPv4ConfigurationAvailable = info_uint32(info, 1);
+	s->IPv6ConfigurationAvailable = info_uint32(info, 2);
+	s->IPv4AddressCount = info_elements(info, len, info_uint32(info, 4), info_uint32(info, 3), sizeof(mbim_ipv4_element), s->IPv4Address, MBIM_MAX_IP_ELEMENTS);
+	s->IPv6AddressCount = info_elements(info, len, info_uint32(info, 6), info_uint32(info, 5), sizeof(mbim_ipv6_element), s->IPv6Address, MBIM_MAX_IP_ELEMENTS);
+	for(int i=0;i<s->IPv4AddressCount;i++)
+		s->IPv4Address[i].OnLinkPrefixLength = bin_to_uint32((unsigned char *)&s->IPv4Address[i].OnLinkPrefixLength, USE_LITTLE_ENDIAN);
+	for(int i=0;i<s->IPv6AddressCount;i++)
+		s->IPv6Address[i].OnLinkPrefixLength = bin_to_uint32((unsigned char *)&s->IPv6Address[i].OnLinkPrefixLength, USE_LITTLE_ENDIAN);
+	if(s->IPv4ConfigurationAvailable & 2)
+		info_elements(info, len, info_uint32(info, 7), 1, sizeof(mbim_ipv4_address), s->IPv4Gateway, 1);
+	if(s->IPv6ConfigurationAvailable & 2)
+		info_elements(info, len, info_uint32(info, 8), 1, sizeof(mbim_ipv6_address), s->IPv6Gateway, 1);
+	s->IPv4DnsServerCount = info_elements(info, len, info_uint32(info, 10), info_uint32(info, 9), sizeof(mbim_ipv4_address), s->IPv4DnsServer, MBIM_MAX_IP_ELEMENTS);
+	s->IPv6DnsServerCount = info_elements(info, len, info_uint32(info, 12), info_uint32(info, 11), sizeof(mbim_ipv6_address), s->IPv6DnsServer, MBIM_MAX_IP_ELEMENTS);
+	s->IPv4Mtu = info_uint32(info, 13);
+	s->IPv6Mtu = info_uint32(info, 14);
+	return 0;
+}
@@ -62,17 +62,22 @@ typedef struct {
 	uint32_t sequence_id;
 	uint32_t size;
 	unsigned char*bin_buf;
+	int refs; // references beyond the first one: shared read only by all the receivers
 } mbim_function_message_t;
 
 char *mbim_get_string(const unsigned char*utf8);
 
 void mbim_free_message(mbim_message_t *msg);
-void mbim_free_function_message(mbim_function_message_t *msg);
+void mbim_free_function_message(mbim_function_message_t *msg); // drops a reference, frees with the last one
+mbim_function_message_t *mbim_ref_function_message(mbim_function_message_t *msg); // returns msg
+mbim_function_message_t *mbim_copy_function_message(const mbim_function_message_t *msg); // a private, writable copy
+int mbim_message_is_query(const mbim_message_t *msg); // command message of query type, idempotent
 mbim_message_t *mbim_format_open();
 mbim_message_t *mbim_format_query_device_capabilities();
 mbim_message_t *mbim_format_set_subscriptions(int ElementCount, ...);
 char *mbim_get_subscription_group(UUID_t uuid, uint32_t CidCount, ...);
 mbim_message_t *mbim_format_set_all_subscriptions();
+mbim_message_t *mbim_format_set_subscription_mask(uint64_t cids); // MBIM_CID_BIT set, see below
 mbim_message_t *mbim_format_close();
 mbim_message_t *mbim_format_suscriber_ready_status();
 mbim_message_t *mbim_format_set_connect(
@@ -86,6 +91,7 @@ mbim_message_t *mbim_format_set_connect(
 		uint32_t ip_type,
 		UUID_t context_type);
 mbim_message_t *mbim_format_query_ip_configuration(uint32_t sessionId);
+mbim_message_t *mbim_format_set_signal_state(uint32_t interval_sec, uint32_t rssi_threshold, uint32_t error_rate_threshold);
 
 
 typedef struct {
@@ -275,6 +281,22 @@ enum mbim_command_code {
 
 uint32_t mbim_get_cmd_code(enum mbim_command_code cc);
 UUID_t mbim_get_uuid(enum mbim_command_code cc);
+mbim_message_t *mbim_format_query(enum mbim_command_code cc, const unsigned char *info, uint32_t len); // generic query
+mbim_message_t *mbim_format_set(enum mbim_command_code cc, const unsigned char *info, uint32_t len); // generic set
+
+// sets of command codes, for the subscriptions
+#define MBIM_CID_BIT(cc)	((uint64_t)1<<(cc))
+// the ones having a notification, as subscribed by mbim_format_set_all_subscriptions
+#define MBIM_NOTIFICATION_CIDS	( \
+	MBIM_CID_BIT(MBIM_CID_SUBSCRIBER_READY_STATUS) | MBIM_CID_BIT(MBIM_CID_RADIO_STATE) | \
+	MBIM_CID_BIT(MBIM_CID_PREFERRED_PROVIDERS) | MBIM_CID_BIT(MBIM_CID_REGISTER_STATE) | \
+	MBIM_CID_BIT(MBIM_CID_PACKET_SERVICE) | MBIM_CID_BIT(MBIM_CID_SIGNAL_STATE) | \
+	MBIM_CID_BIT(MBIM_CID_CONNECT) | MBIM_CID_BIT(MBIM_CID_PROVISIONED_CONTEXTS) | \
+	MBIM_CID_BIT(MBIM_CID_IP_CONFIGURATION) | MBIM_CID_BIT(MBIM_CID_EMERGENCY_MODE) | \
+	MBIM_CID_BIT(MBIM_CID_MULTICARRIER_PROVIDERS) | MBIM_CID_BIT(MBIM_CID_SMS_CONFIGURATION) | \
+	MBIM_CID_BIT(MBIM_CID_SMS_READ) | MBIM_CID_BIT(MBIM_CID_SMS_MESSAGE_STORE_STATUS) | \
+	MBIM_CID_BIT(MBIM_CID_USSD) | MBIM_CID_BIT(MBIM_CID_PHONEBOOK_CONFIGURATION) | \
+	MBIM_CID_BIT(MBIM_CID_STK_PAC))
 
 /******************************************************************************/
 
@@ -392,6 +414,171 @@ typedef struct {
 
 const char*get_activation_state_string(uint32_t act_state);
 
+/******************************************************************************/
+// decoded information buffers: fixed size, strings converted to utf8 and truncated
+
+#define MBIM_SUBSCRIBER_READY_STATE_INITIALIZED	(1)
+#define MBIM_ACTIVATION_STATE_ACTIVATED		(1)
+#define MBIM_ACTIVATION_STATE_DEACTIVATED	(3)
+#define MBIM_REGISTER_STATE_HOME		(3)
+#define MBIM_REGISTER_STATE_ROAMING		(4)
+#define MBIM_REGISTER_STATE_PARTNER		(5)
+#define MBIM_CONTEXT_IP_TYPE_DEFAULT		(0)
+#define MBIM_CONTEXT_IP_TYPE_IPV4		(1)
+#define MBIM_CONTEXT_IP_TYPE_IPV6		(2)
+#define MBIM_CONTEXT_IP_TYPE_IPV4V6		(3)
+#define MBIM_MAX_IP_ELEMENTS			(4) // more addresses or dns servers are ignored
+
+typedef struct {
+	uint32_t DeviceType;
+	uint32_t CellularClass;
+	uint32_t VoiceClass;
+	uint32_t SimClass;
+	uint32_t DataClass;
+	uint32_t SmsCaps;
+	uint32_t ControlCaps;
+	uint32_t MaxSessions;
+	char CustomDataClass[32];
+	char DeviceId[40];
+	char FirmwareInfo[64];
+	char HardwareInfo[64];
+} mbim_device_caps_t;
+
+typedef struct {
+	uint32_t ReadyState;
+	char SubscriberId[32];
+	char SimIccId[32];
+} mbim_subscriber_ready_t;
+
+typedef struct {
+	uint32_t HwRadioState;
+	uint32_t SwRadioState;
+} mbim_radio_state_t;
+
+typedef struct {
+	uint32_t NwError;
+	uint32_t RegisterState;
+	uint32_t RegisterMode;
+	uint32_t AvailableDataClasses;
+	uint32_t CurrentCellularClass;
+	char ProviderId[8];
+	char ProviderName[64];
+	char RoamingText[64];
+	uint32_t RegistrationFlag;
+} mbim_register_state_t;
+
+typedef struct {
+	uint32_t NwError;
+	uint32_t PacketServiceState;
+	uint32_t HighestAvailableDataClass;
+	uint64_t UplinkSpeed;
+	uint64_t DownlinkSpeed;
+} mbim_packet_service_t;
+
+typedef struct {
+	uint32_t Rssi;
+	uint32_t ErrorRate;
+	uint32_t SignalStrengthInterval;
+	uint32_t RssiThreshold;
+	uint32_t ErrorRateThreshold;
+} mbim_signal_state_t;
+
+// MBIM_CID_IP_PACKET_FILTERS: the device forwards to the host only the packets matching one of the filters
+#define MBIM_MAX_PACKET_FILTERS		(16)
+#define MBIM_MAX_FILTER_SIZE		(128) // bytes from the start of the ip packet
+
+typedef struct {
+	uint32_t FilterSize;
+	unsigned char PacketFilter[MBIM_MAX_FILTER_SIZE];
+	unsigned char PacketMask[MBIM_MAX_FILTER_SIZE]; // a packet matches if (packet & mask)==filter
+} mbim_packet_filter_t;
+
+typedef struct {
+	uint32_t SessionId;
+	uint32_t PacketFiltersCount; // 0: no filtering
+	mbim_packet_filter_t filters[MBIM_MAX_PACKET_FILTERS];
+} mbim_packet_filters_t;
+
+mbim_message_t *mbim_format_set_packet_filters(const mbim_packet_filters_t *f); // count 0 clears them
+mbim_message_t *mbim_format_query_packet_filters(uint32_t session_id);
+
+// SET SIGNAL_STATE values
+#define MBIM_SIGNAL_DEFAULT		(0) // device default interval or threshold
+#define MBIM_SIGNAL_THRESHOLD_DISABLED	(0xFFFFFFFF) // no report on change
+
+typedef struct {
+	uint32_t SessionId;
+	uint32_t ActivationState;
+	uint32_t VoiceCallState;
+	uint32_t IPType;
+	unsigned char ContextType[UUID_LEN];
+	uint32_t NwError;
+} mbim_connect_state_t;
+
+typedef struct {
+	uint32_t SessionId;
+	uint32_t IPv4ConfigurationAvailable;
+	uint32_t IPv6ConfigurationAvailable;
+	uint32_t IPv4AddressCount;
+	mbim_ipv4_element IPv4Address[MBIM_MAX_IP_ELEMENTS];
+	uint32_t IPv6AddressCount;
+	mbim_ipv6_element IPv6Address[MBIM_MAX_IP_ELEMENTS];
+	mbim_ipv4_address IPv4Gateway;
+	mbim_ipv6_address IPv6Gateway;
+	uint32_t IPv4DnsServerCount;
+	mbim_ipv4_address IPv4DnsServer[MBIM_MAX_IP_ELEMENTS];
+	uint32_t IPv6DnsServerCount;
+	mbim_ipv6_address IPv6DnsServer[MBIM_MAX_IP_ELEMENTS];
+	uint32_t IPv4Mtu;
+	uint32_t IPv6Mtu;
+} mbim_ip_config_t;
+
+// MBIM_CID_PACKET_STATISTICS: device wide, all the sessions together
+typedef struct {
+	uint32_t InDiscards;
+	uint32_t InErrors;
+	uint64_t InOctets;
+	uint64_t InPackets;
+	uint64_t OutOctets;
+	uint64_t OutPackets;
+	uint32_t OutErrors;
+	uint32_t OutDiscards;
+} mbim_packet_statistics_t;
+
+// information buffer of a COMMAND_DONE (status is set) or INDICATE_STATUS message. 0=success
+int mbim_get_info_buffer(const mbim_function_message_t *msg, const unsigned char **info, uint32_t *len, uint32_t *status);
+
+// all return 0=success, -1 if the buffer is too short
+int mbim_decode_device_caps(const unsigned char *info, uint32_t len, mbim_device_caps_t *s);
+int mbim_decode_subscriber_ready(const unsigned char *info, uint32_t len, mbim_subscriber_ready_t *s);
+int mbim_decode_radio_state(const unsigned char *info, uint32_t len, mbim_radio_state_t *s);
+int mbim_decode_register_state(const unsigned char *info, uint32_t len, mbim_register_state_t *s);
+int mbim_decode_packet_service(const unsigned char *info, uint32_t len, mbim_packet_service_t *s);
+int mbim_decode_signal_state(const unsigned char *info, uint32_t len, mbim_signal_state_t *s);
+int mbim_decode_packet_filters(const unsigned char *info, uint32_t len, mbim_packet_filters_t *s);
+int mbim_decode_connect(const unsigned char *info, uint32_t len, mbim_connect_state_t *s);
+int mbim_decode_ip_configuration(const unsigned char *info, uint32_t len, mbim_ip_config_t *s);
+int mbim_decode_packet_statistics(const unsigned char *info, uint32_t len, mbim_packet_statistics_t *s);
+
+/******************************************************************************/
+// device limits from the USB MBIM functional descriptors: class specific interface (0x24), subtype 0x1B,
+// and the extended one 0x1C. all 0 if unknown
+
+#define MBIM_DEFAULT_MAX_CONTROL_TRANSFER	(4096) // without descriptor
+
+typedef struct {
+	uint16_t MaxControlMessage; // wMaxControlMessage: the MaxControlTransfer of the OPEN
+	uint8_t NumberFilters; // packet filters per session
+	uint8_t MaxFilterSize;
+	uint16_t MaxSegmentSize;
+	uint8_t NetworkCapabilities;
+	uint8_t MaxOutstandingCommandMessages; // extended descriptor
+	uint16_t MTU; // extended descriptor
+} mbim_usb_limits_t;
+
+// desc: the descriptors of the USB device (its sysfs "descriptors" file). return 0=success, -1 if no MBIM function
+int mbim_parse_usb_descriptors(const unsigned char *desc, uint32_t len, mbim_usb_limits_t *limits);
+
 /******************************************************************************/
 
 // for MBIM thread exclusive use:
@@ -416,7 +603,7 @@ void print_mbim_frame(unsigned char *buf);
 
 enum mbim_command_code mbim_get_msg_cmd_code(mbim_function_message_t* msg);
 
-mbim_frame_t *mbim_message_to_frames(mbim_message_t *msg, uint32_t sequenceId, uint32_t MaxControlTransfer);
+mbim_frame_t *mbim_message_to_frames(mbim_message_t *msg, uint32_t sequenceId, uint32_t MaxControlTransfer); // commands are fragmented
 mbim_message_t *mbim_frames_to_message(mbim_frame_t *frame);
 
 #endif /* __MBIM_LIB_H__ */
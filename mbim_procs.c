@@ -32,17 +32,136 @@ either expressed or implied, of the <project name> project.
 
 #include "mbim_procs.h"
 #include "mbim_lib.h"
+#include "mbim_state.h"
+#include "thread_mbim.h"
+#include "rtnl_lib.h"
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <net/if.h>
 
+// long running procedures: starting a new one stops the previous one of the same kind
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	unsigned int generation;
+} proc_generation_t;
+
+// per modem state of the procedures, kept in the MBIM thread_params_t
+struct mbim_procs_t {
+	proc_generation_t signal_policy;
+	proc_generation_t packet_sampler;
+	pthread_mutex_t lock; // for the fields below
+	mbim_packet_filters_t filters[MBIM_STATE_MAX_SESSIONS]; // wanted per session: applied again after each connection
+	client_params_t *connecting[MBIM_STATE_MAX_SESSIONS]; // queued: a disconnect overtakes it
+	mbim_connect_timing_t connect_timing[MBIM_STATE_MAX_SESSIONS]; // of the last successful connection
+};
+
+static void proc_generation_init(proc_generation_t *g) {
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->changed, NULL);
+	g->generation = 0;
+}
+
+static void proc_generation_destroy(proc_generation_t *g) {
+	pthread_cond_destroy(&g->changed);
+	pthread_mutex_destroy(&g->lock);
+}
+
+mbim_procs_t *mbim_procs_new() {
+	mbim_procs_t *pr = calloc(1, sizeof(mbim_procs_t));
+	proc_generation_init(&pr->signal_policy);
+	proc_generation_init(&pr->packet_sampler);
+	pthread_mutex_init(&pr->lock, NULL);
+	return pr;
+}
+
+void mbim_procs_free(mbim_procs_t *pr) {
+	if(!pr)
+		return;
+	proc_generation_destroy(&pr->signal_policy);
+	proc_generation_destroy(&pr->packet_sampler);
+	pthread_mutex_destroy(&pr->lock);
+	free(pr);
+}
+
+// consumes the response of a SET DEVICE_SERVICE_SUBSCRIBE_LIST. return 0=success
+static int mbim_set_subscriptions_done(client_params_t *cp, uint64_t cids) {
+	const unsigned char *info;
+	uint32_t len, status;
+	int ret = mbim_get_info_buffer(cp->response, &info, &len, &status);
+	mbim_free_function_message(cp->response); // after having consumed the response
+	cp->response = NULL;
+	if(ret || status!=MBIM_STATUS_SUCCESS)
+		return -1;
+	mbim_set_subscribed(cp->tp_interface, cids);
+	return 0;
+}
+
+typedef struct {
+	client_params_t *cp;
+	mbim_message_t *cmd;
+	int ret; // of send_command
+} burst_command_t;
+
+static void *mbim_burst_client_thread(void *data) {
+	burst_command_t *bc = data;
+	bc->ret = send_command(bc->cmd, bc->cp);
+	return NULL;
+}
+
+// sends the commands together, from one client each: they are all queued before the first answer, the
+// device works on them while the frames of the next ones are written. the responses are left in the clients
+static void mbim_send_burst(thread_params_t *tp, burst_command_t *bc, int count) {
+	for(int i=0;i<count;i++) {
+		bc[i].ret = -1;
+		bc[i].cp->priority = COMMAND_PRIORITY_CONTROL;
+		if(pthread_create(&bc[i].cp->tid, NULL, mbim_burst_client_thread, &bc[i]))
+			bc[i].cp->tid = 0;
+	}
+	for(int i=0;i<count;i++)
+		if(bc[i].cp->tid)
+			pthread_join(bc[i].cp->tid, NULL);
+}
+
+// the first registration after an auto init is reported, and connects the auto connect apn.
+// from the init procedure or from the REGISTER_STATE handler, the first one wins
+static void mbim_autoinit_registered(thread_params_t *tp) {
+	mbim_register_state_t r;
+	uint64_t plugged = __atomic_load_n(&tp->mbim_autoinit_msec, __ATOMIC_SEQ_CST);
+
+	if(!plugged || mbim_state_get(tp->mbim_state, MBIM_CID_REGISTER_STATE, 0, &r, 0))
+		return;
+	if(r.RegisterState!=MBIM_REGISTER_STATE_HOME && r.RegisterState!=MBIM_REGISTER_STATE_ROAMING &&
+		r.RegisterState!=MBIM_REGISTER_STATE_PARTNER)
+		return;
+	if(!__atomic_compare_exchange_n(&tp->mbim_autoinit_msec, &plugged, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		return;
+	tp->mbim_registered_after_msec = get_monotonic_msec()-plugged;
+	DBGT("registered %llu msec after the plug", (unsigned long long)tp->mbim_registered_after_msec)
+	if(tp->mbim_autoconnect_apn)
+		mbim_connect_session(tp, 0, 1, tp->mbim_autoconnect_apn, MBIM_CONTEXT_IP_TYPE_DEFAULT);
+}
+
+// OPEN, then the rest in one burst: capabilities, services, subscriptions and registration for the mirror
 void *mbim_initproc_client_thread(void *data) {
 	client_params_t *cp = data;
-
+	thread_params_t *tp = cp->tp_interface;
+	uint64_t start = get_monotonic_msec(), opened;
+	uint64_t cids;
 	mbim_message_t *cmd;
+	enum { BURST_CAPS, BURST_SERVICES, BURST_SUBSCRIBE, BURST_REGISTER, BURST_COUNT };
+	burst_command_t burst[BURST_COUNT] = {{0}};
+	const unsigned char *info;
+	uint32_t len, status;
 
 	// MBIM OPEN
 	cmd = mbim_format_open();
-	send_command(cmd, cp);
+	if(send_command(cmd, cp)) {
+		mbim_free_message(cmd);
+		DBGC("mbim_open failed")
+		goto end;
+	}
 	mbim_free_message(cmd);
 
 	mbim_function_message_t *msg = cp->response;
@@ -54,36 +173,39 @@ void *mbim_initproc_client_thread(void *data) {
 
 	if(ret!=MBIM_STATUS_SUCCESS)
 		goto end;
+	opened = get_monotonic_msec();
 
-	DBGC()
+	// SET MBIM DEVICE SUBSCRIBE LIST: only what is handled
+	cids = mbim_wanted_subscriptions(tp);
+	burst[BURST_CAPS].cmd = mbim_format_query_device_capabilities();
+	burst[BURST_SERVICES].cmd = mbim_format_query(MBIM_CID_DEVICE_SERVICES, NULL, 0);
+	burst[BURST_SUBSCRIBE].cmd = mbim_format_set_subscription_mask(cids);
+	burst[BURST_REGISTER].cmd = mbim_format_query(MBIM_CID_REGISTER_STATE, NULL, 0);
+	for(int i=0;i<BURST_COUNT;i++)
+		burst[i].cp = new_client_thread(cp->name, tp);
+	mbim_send_burst(tp, burst, BURST_COUNT);
 
-	// MBIM QUERY DEVICE CAPS
-	cmd = mbim_format_query_device_capabilities();
-	send_command(cmd, cp);
-	mbim_free_message(cmd);
-
-	// TODO: extract and check response, extract maxContexts
-	mbim_free_function_message(cp->response); // after having consumed the response
-
-	if(0) // replace with an error in response. this shouldn't fail anyway...
-		// inform caller of insuccess
-		goto end;
-
-	// SET MBIM DEVICE SUBSCRIBE LIST
-	DBGC()
-	cmd = mbim_format_set_all_subscriptions();
-	send_command(cmd, cp);
-	mbim_free_message(cmd);
-
-	// TODO: extract and check response
-	mbim_free_function_message(cp->response); // after having consumed the response
-
-	if(0) // replace with an error in response. this shouldn't fail anyway...
-		// inform caller of insuccess
-		goto end;
+	// MaxSessions and the registration are in the state mirror
+	for(int i=0;i<BURST_COUNT;i++) {
+		client_params_t *bcp = burst[i].cp;
+		mbim_free_message(burst[i].cmd);
+		if(burst[i].ret)
+			DBGC("init command %d failed (status %d)", i, bcp->status)
+		else if(i==BURST_SUBSCRIBE) {
+			if(mbim_set_subscriptions_done(bcp, cids))
+				DBGC("subscribe list refused")
+		} else if(i==BURST_SERVICES) {
+			if(mbim_get_info_buffer(bcp->response, &info, &len, &status)==0 && status==MBIM_STATUS_SUCCESS && len>=8)
+				DBGC("%u device services, %u dss sessions", bin_to_uint32(info, USE_LITTLE_ENDIAN), bin_to_uint32(info+4, USE_LITTLE_ENDIAN))
+		}
+		if(bcp->response)
+			mbim_free_function_message(bcp->response);
+		destroy_client_thread(bcp);
+	}
 
 	// inform caller of success
-	DBGC("init done.")
+	DBGC("init done in %llu msec, open %llu", (unsigned long long)(get_monotonic_msec()-start), (unsigned long long)(opened-start))
+	mbim_autoinit_registered(tp); // unless the indication comes later
 
 end:
 	destroy_client_thread(cp);
@@ -93,10 +215,22 @@ end:
 // return 0=success
 int mbim_initproc(thread_params_t *tp) {
 	client_params_t *cp = new_client_thread("mbim_initproc", tp->tp_mbim);
+	cp->priority = COMMAND_PRIORITY_CONTROL;
 	DBGT("spawn: %s", cp->name)
 	return pthread_create(&cp->tid, NULL, mbim_initproc_client_thread, cp);
 }
 
+// on discovery, from the plug: the init procedure without the tty, and the connection of apn (NULL: none)
+// once registered. return 0=success
+int mbim_autoinit(thread_params_t *tp_mbim, const char *apn) {
+	tp_mbim->mbim_autoconnect_apn = apn;
+	__atomic_store_n(&tp_mbim->mbim_autoinit_msec, get_monotonic_msec(), __ATOMIC_SEQ_CST);
+	client_params_t *cp = new_client_thread("mbim_autoinit", tp_mbim);
+	cp->priority = COMMAND_PRIORITY_CONTROL;
+	DBGC("spawn")
+	return pthread_create(&cp->tid, NULL, mbim_initproc_client_thread, cp);
+}
+
 void *mbim_closeproc_client_thread(void *data) {
 	client_params_t *cp = data;
 
@@ -105,15 +239,18 @@ void *mbim_closeproc_client_thread(void *data) {
 	// SET MBIM DEVICE SUBSCRIBE LIST -> RESET
 	DBGC()
 	cmd = mbim_format_set_subscriptions(0);
-	send_command(cmd, cp);
+	if(send_command(cmd, cp)==0) // the close is sent anyway
+		// TODO: extract and check response
+		mbim_free_function_message(cp->response); // after having consumed the response
 	mbim_free_message(cmd);
 
-	// TODO: extract and check response
-	mbim_free_function_message(cp->response); // after having consumed the response
-
 	// MBIM CLOSE
 	cmd = mbim_format_close();
-	send_command(cmd, cp);
+	if(send_command(cmd, cp)) {
+		mbim_free_message(cmd);
+		DBGC("mbim_close failed")
+		goto end;
+	}
 	mbim_free_message(cmd);
 
 	mbim_function_message_t *msg = cp->response;
@@ -123,6 +260,7 @@ void *mbim_closeproc_client_thread(void *data) {
 
 	DBGC("mbim_close_done with %u", ret)
 
+end:
 	destroy_client_thread(cp);
 	return NULL;
 }
@@ -130,97 +268,802 @@ void *mbim_closeproc_client_thread(void *data) {
 // return 0=success
 int mbim_closeproc(thread_params_t *tp) {
 	client_params_t *cp = new_client_thread("mbim_closeproc", tp->tp_mbim);
+	cp->priority = COMMAND_PRIORITY_CONTROL;
 	DBGT("spawn: %s", cp->name)
 	return pthread_create(&cp->tid, NULL, mbim_closeproc_client_thread, cp);
 }
 
+// from a client thread, the ones set with mbim_set_packet_filters. always: also without filters. return 0=success
+int mbim_apply_packet_filters(client_params_t *cp, uint32_t session_id, int always) {
+	const unsigned char *info;
+	uint32_t len, status;
+	int ret;
+	if(session_id>=MBIM_STATE_MAX_SESSIONS)
+		return -1;
+	mbim_procs_t *pr = cp->tp_interface->mbim_procs;
+	mbim_packet_filters_t *f = malloc(sizeof(mbim_packet_filters_t));
+	pthread_mutex_lock(&pr->lock);
+	*f = pr->filters[session_id];
+	pthread_mutex_unlock(&pr->lock);
+	f->SessionId = session_id;
+	if(!always && !f->PacketFiltersCount) {
+		free(f);
+		return 0;
+	}
+	mbim_message_t *cmd = mbim_format_set_packet_filters(f);
+	ret = send_command(cmd, cp);
+	mbim_free_message(cmd);
+	if(ret)
+		goto end;
+	ret = mbim_get_info_buffer(cp->response, &info, &len, &status);
+	mbim_free_function_message(cp->response); // after having consumed the response
+	cp->response = NULL;
+	if(!ret && status!=MBIM_STATUS_SUCCESS)
+		ret = -1;
+	DBGC("session %u: %u packet filters, status %u", session_id, f->PacketFiltersCount, status)
+end:
+	free(f);
+	return ret;
+}
+
+// from a client thread: the filters active on the device. return 0=success
+int mbim_query_packet_filters(client_params_t *cp, uint32_t session_id, mbim_packet_filters_t *out) {
+	const unsigned char *info;
+	uint32_t len, status;
+	mbim_message_t *cmd = mbim_format_query_packet_filters(session_id);
+	int ret = send_command(cmd, cp);
+	mbim_free_message(cmd);
+	if(ret)
+		return -1;
+	ret = mbim_get_info_buffer(cp->response, &info, &len, &status);
+	if(!ret)
+		ret = status==MBIM_STATUS_SUCCESS ? mbim_decode_packet_filters(info, len, out) : -1;
+	mbim_free_function_message(cp->response); // after having consumed the response
+	cp->response = NULL;
+	return ret;
+}
+
+void *mbim_packet_filters_client_thread(void *data) {
+	client_params_t *cp = data;
+	uint32_t session_id = (uintptr_t)cp->command;
+	cp->command = NULL;
+	if(mbim_apply_packet_filters(cp, session_id, 1))
+		DBGC("kept for the next connection")
+	destroy_client_thread(cp);
+	return NULL;
+}
+
+// stores the filters of f->SessionId and applies them: now if possible, and after each connection
+int mbim_set_packet_filters(thread_params_t *tp, const mbim_packet_filters_t *f) {
+	if(f->SessionId>=MBIM_STATE_MAX_SESSIONS || f->PacketFiltersCount>MBIM_MAX_PACKET_FILTERS)
+		return -1;
+	const mbim_usb_limits_t *limits = &tp->tp_mbim->mbim_limits; // 0: unknown
+	if(limits->NumberFilters && f->PacketFiltersCount>limits->NumberFilters) {
+		DBGT("%u filters, the device takes %u", f->PacketFiltersCount, limits->NumberFilters)
+		return -1;
+	}
+	for(uint32_t i=0;i<f->PacketFiltersCount;i++)
+		if(f->filters[i].FilterSize>MBIM_MAX_FILTER_SIZE || (limits->MaxFilterSize && f->filters[i].FilterSize>limits->MaxFilterSize))
+			return -1;
+	mbim_procs_t *pr = tp->tp_mbim->mbim_procs;
+	pthread_mutex_lock(&pr->lock);
+	pr->filters[f->SessionId] = *f; // of this modem only
+	pthread_mutex_unlock(&pr->lock);
+	client_params_t *cp = new_client_thread("mbim_packet_filters", tp->tp_mbim);
+	cp->priority = COMMAND_PRIORITY_CONTROL;
+	cp->command = (void *)(uintptr_t)f->SessionId;
+	DBGT("spawn: %s", cp->name)
+	return pthread_create(&cp->tid, NULL, mbim_packet_filters_client_thread, cp);
+}
+
+int mbim_clear_packet_filters(thread_params_t *tp, uint32_t session_id) {
+	mbim_packet_filters_t *f = calloc(1, sizeof(mbim_packet_filters_t));
+	f->SessionId = session_id;
+	int ret = mbim_set_packet_filters(tp, f);
+	free(f);
+	return ret;
+}
+
 typedef struct {
+	uint32_t session_id;
 	uint32_t connect;
+	uint32_t ip_type;
 	char apn[101];
+	int reconnect; // attempt of the supervisor
+	unsigned int generation; // of the session slot when asked: a later connect or disconnect makes the result stale
 } connect_op_t;
 
+
+// reconnect supervisor: a session connected once is brought up again when it drops, until disconnected.
+// the slots of all modems share the attempt rate, a network outage drops them all at once
+typedef struct {
+	thread_params_t *tp_mbim; // NULL: free slot
+	int armed; // the session is wanted up
+	unsigned int generation; // bumped by each connect or disconnect asked
+	connect_op_t op;
+	int attempting;
+	int limited; // the pending attempt waits for the rate
+	unsigned int failures; // consecutive, each one doubles the backoff
+	uint64_t due_msec; // of the next attempt
+	uint64_t dropped_msec; // 0: up
+	mbim_reconnect_stats_t stats;
+} reconnect_slot_t;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	int running;
+	unsigned int tokens; // attempts allowed now
+	uint64_t refill_msec;
+	unsigned int seed;
+	reconnect_slot_t slots[MBIM_RECONNECT_MAX_SLOTS];
+} reconnect = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.changed = PTHREAD_COND_INITIALIZER,
+	.tokens = MBIM_RECONNECT_BURST,
+};
+
+static reconnect_slot_t *reconnect_find_nolock(thread_params_t *tp_mbim, uint32_t session_id, int create) {
+	reconnect_slot_t *free_slot = NULL;
+	for(int i=0;i<MBIM_RECONNECT_MAX_SLOTS;i++) {
+		reconnect_slot_t *slot = &reconnect.slots[i];
+		if(slot->tp_mbim==tp_mbim && slot->op.session_id==session_id)
+			return slot;
+		if(!slot->tp_mbim && !free_slot)
+			free_slot = slot;
+	}
+	if(!create || !free_slot)
+		return NULL;
+	memset(free_slot, 0, sizeof(*free_slot));
+	free_slot->tp_mbim = tp_mbim;
+	free_slot->op.session_id = session_id;
+	return free_slot;
+}
+
+// exponential, with half of it random: the modems dropped together do not retry together
+static uint64_t reconnect_backoff_nolock(unsigned int failures) {
+	uint64_t delay = (uint64_t)MBIM_RECONNECT_BASE_MSEC << (failures<16 ? failures : 16);
+	if(delay>MBIM_RECONNECT_MAX_MSEC)
+		delay = MBIM_RECONNECT_MAX_MSEC;
+	return delay/2 + rand_r(&reconnect.seed)%(delay/2+1);
+}
+
+static void reconnect_up_nolock(reconnect_slot_t *slot, uint64_t now) {
+	if(slot->dropped_msec) {
+		uint64_t latency = now-slot->dropped_msec;
+		if(!slot->stats.reconnects || latency<slot->stats.latency_min_msec)
+			slot->stats.latency_min_msec = latency;
+		if(latency>slot->stats.latency_max_msec)
+			slot->stats.latency_max_msec = latency;
+		slot->stats.latency_total_msec += latency;
+		slot->stats.reconnects++;
+		DBG("session %u: reconnected %llu msec after the drop", slot->op.session_id, (unsigned long long)latency)
+	}
+	slot->dropped_msec = 0;
+	slot->failures = 0;
+}
+
+// end of a connect procedure. a successful one arms the supervision of the session,
+// unless a connect or a disconnect was asked since (eg: a disconnect while the connect was in flight)
+static void reconnect_result(thread_params_t *tp_mbim, const connect_op_t *op, int connected) {
+	uint64_t now = get_monotonic_msec();
+	pthread_mutex_lock(&reconnect.lock);
+	reconnect_slot_t *slot = reconnect_find_nolock(tp_mbim, op->session_id, 0);
+	if(!slot || op->generation!=slot->generation || (op->reconnect && !slot->attempting))
+		goto end; // disconnected or asked again meanwhile
+	if(!op->reconnect) {
+		slot->op = *op;
+		slot->armed = 1;
+	}
+	slot->attempting = 0;
+	if(connected) {
+		reconnect_up_nolock(slot, now);
+	} else if(slot->armed) {
+		slot->stats.failures++;
+		slot->due_msec = now+reconnect_backoff_nolock(slot->failures++);
+		DBG("session %u: reconnect failed, next in %llu msec", op->session_id, (unsigned long long)(slot->due_msec-now))
+	}
+	pthread_cond_broadcast(&reconnect.changed);
+end:
+	pthread_mutex_unlock(&reconnect.lock);
+}
+
+// phases done from the state mirror take no time
+static uint64_t connect_phase(uint64_t *since) {
+	uint64_t now = get_monotonic_msec();
+	uint64_t elapsed = now-*since;
+	*since = now;
+	return elapsed;
+}
+
+// the ip parameters of a session on its net device, in one rtnetlink batch. NULL removes them and sets
+// the link down. session 0 is the net device itself, the others its vlan <netdev>.<session> (cdc_mbim).
+// dns servers have no kernel configuration, they are left to the resolver setup. return 0=success
+int mbim_apply_ip_config(const char *netdev, uint32_t session_id, const mbim_ip_config_t *ip) {
+	char ifname[THREAD_MBIM_NETDEV_LEN+12];
+	rtnl_batch_t *b = malloc(sizeof(rtnl_batch_t));
+	rtnl_addr_t keep4[MBIM_MAX_IP_ELEMENTS], keep6[MBIM_MAX_IP_ELEMENTS];
+	uint32_t mtu = 0, n4 = 0, n6 = 0;
+	int ret, ifindex;
+
+	if(!b)
+		return -1;
+	if(session_id)
+		snprintf(ifname, sizeof(ifname), "%s.%u", netdev, session_id);
+	else
+		snprintf(ifname, sizeof(ifname), "%s", netdev);
+	ifindex = if_nametoindex(ifname);
+	if(!ifindex) {
+		DBG("%s: no such net device", ifname)
+		free(b);
+		return -1;
+	}
+	if((ret = rtnl_batch_open(b)))
+		goto end;
+	if(ip) {
+		n4 = ip->IPv4AddressCount<MBIM_MAX_IP_ELEMENTS ? ip->IPv4AddressCount : MBIM_MAX_IP_ELEMENTS;
+		n6 = ip->IPv6AddressCount<MBIM_MAX_IP_ELEMENTS ? ip->IPv6AddressCount : MBIM_MAX_IP_ELEMENTS;
+	}
+	for(uint32_t i=0;i<n4;i++)
+		keep4[i] = (rtnl_addr_t){ ip->IPv4Address[i].IPv4Address, ip->IPv4Address[i].OnLinkPrefixLength };
+	for(uint32_t i=0;i<n6;i++)
+		keep6[i] = (rtnl_addr_t){ ip->IPv6Address[i].IPv6Address, ip->IPv6Address[i].OnLinkPrefixLength };
+	// only what the new configuration lacks is deleted: the rest is replaced in place, the link keeps its
+	// addresses and default routes through a reconnection to the same ones
+	if((!n4 && (ret = rtnl_flush_default_routes(b, ifindex, AF_INET))) || (!n6 && (ret = rtnl_flush_default_routes(b, ifindex, AF_INET6))) ||
+		(ret = rtnl_flush_addresses(b, ifindex, AF_INET, keep4, n4)) || (ret = rtnl_flush_addresses(b, ifindex, AF_INET6, keep6, n6)))
+		goto end;
+	if(ip && (ip->IPv4ConfigurationAvailable & 8))
+		mtu = ip->IPv4Mtu;
+	if(ip && (ip->IPv6ConfigurationAvailable & 8) && (!mtu || ip->IPv6Mtu<mtu))
+		mtu = ip->IPv6Mtu;
+	if((ret = rtnl_set_link(b, ifindex, mtu, ip!=NULL)))
+		goto end;
+	if(ip) {
+		for(uint32_t i=0;i<n4 && !ret;i++)
+			ret = rtnl_add_address(b, ifindex, AF_INET, keep4[i].addr, keep4[i].prefix_len);
+		for(uint32_t i=0;i<n6 && !ret;i++)
+			ret = rtnl_add_address(b, ifindex, AF_INET6, keep6[i].addr, keep6[i].prefix_len);
+		if(!ret && n4)
+			ret = rtnl_add_default_route(b, ifindex, AF_INET, (ip->IPv4ConfigurationAvailable & 2) ? ip->IPv4Gateway : NULL);
+		if(!ret && n6)
+			ret = rtnl_add_default_route(b, ifindex, AF_INET6, (ip->IPv6ConfigurationAvailable & 2) ? ip->IPv6Gateway : NULL);
+		if(ret)
+			goto end;
+	}
+	ret = rtnl_batch_commit(b);
+end:
+	if(ret)
+		DBG("%s: configuration failed (%d)", ifname, ret)
+	else
+		DBG("%s: %s, %u ipv4 and %u ipv6 addresses, mtu %u", ifname, ip ? "up" : "down",
+			ip ? ip->IPv4AddressCount : 0, ip ? ip->IPv6AddressCount : 0, mtu)
+	rtnl_batch_close(b);
+	free(b);
+	return ret ? -1 : 0;
+}
+
+// one per session, the sessions run concurrently on the same port.
+// the steps already known from the indications are skipped
 void* mbim_connect_client_thread(void *data) {
 	client_params_t *cp = data;
 	connect_op_t *op = cp->command;
+	mbim_procs_t *pr = cp->tp_interface->mbim_procs;
+	mbim_connect_timing_t timing = {0};
+	mbim_subscriber_ready_t ready;
+	mbim_connect_state_t state;
+	mbim_ip_config_t ip;
+	char netdev[THREAD_MBIM_NETDEV_LEN];
+	const unsigned char *info;
+	uint32_t len, res;
+	uint64_t start = get_monotonic_msec(), since = start;
+	int connected = 0, ret;
 	cp->command=NULL;
 
-	DBG("%u, %s", op->connect, op->apn)
+	DBG("session %u: %u, %s", op->session_id, op->connect, op->apn)
 
-	mbim_message_t *cmd = mbim_format_suscriber_ready_status();
-	send_command(cmd, cp);
-	mbim_free_message(cmd);
-	mbim_free_function_message(cp->response); // normally after having consumed the response
+	ret = mbim_state_query(cp, MBIM_CID_SUBSCRIBER_READY_STATUS, 0, &ready, MBIM_CONNECT_READY_MAX_AGE_MSEC);
+	if(ret<0 && cp->status!=COMMAND_STATE_DONE)
+		goto end; // not answered. an answer without the state does not stop the connect
+	timing.ready_from_mirror = ret==0;
+	timing.ready_msec = connect_phase(&since);
 
-	cmd = mbim_format_set_connect(
-		0, // session_id hardcoded here
+	mbim_message_t *cmd = mbim_format_set_connect(
+		op->session_id,
 		op->connect,
 		op->apn,
 		0, // no authentication
 		NULL,
 		NULL,
 		0, // no compression
-		1, // IPv4
+		op->ip_type,
 		MBIMContextTypeInternet);
 /*
 	cmd = mbim_format_set_connect(
-		0, // session_id hardcoded here
+		op->session_id,
 		op->connect,
 		op->apn,
 		2, // chap
 		"vf",
 		"vf",
 		0, // no compression
-		1, // IPv4
+		op->ip_type,
 		MBIMContextTypeInternet);
 */
-	send_command(cmd, cp);
+	// a disconnect overtakes a connect still in progress on the same session of the same modem
+	if(!op->connect) {
+		pthread_mutex_lock(&pr->lock);
+		if(pr->connecting[op->session_id] && cancel_command(pr->connecting[op->session_id])==0)
+			DBGC("pending connect cancelled")
+		pthread_mutex_unlock(&pr->lock);
+	}
+	// the connect is published only while queued: before, cp->status is the one of the previous command
+	ret = submit_command(cmd, cp);
+	if(!ret && op->connect) {
+		pthread_mutex_lock(&pr->lock);
+		pr->connecting[op->session_id] = cp;
+		pthread_mutex_unlock(&pr->lock);
+	}
+	if(!ret)
+		ret = wait_command(cp);
+	if(op->connect) {
+		pthread_mutex_lock(&pr->lock);
+		pr->connecting[op->session_id] = NULL;
+		pthread_mutex_unlock(&pr->lock);
+	}
 	mbim_free_message(cmd);
+	if(ret) {
+		DBGC("CONNECT failed (status %d)", cp->status);
+		goto end;
+	}
 
-	mbim_function_message_t* msg = cp->response;
-	uint32_t res = bin_to_uint32(msg->bin_buf+UUID_LEN+sizeof(uint32_t), USE_LITTLE_ENDIAN);
+	ret = mbim_get_info_buffer(cp->response, &info, &len, &res);
+	if(!ret && res==MBIM_STATUS_SUCCESS)
+		ret = mbim_decode_connect(info, len, &state);
 	mbim_free_function_message(cp->response); // after having consumed the response
+	cp->response = NULL;
+	timing.connect_msec = connect_phase(&since);
 
-	DBGC("CONNECT result=%u", res); // 0==MBIM_STATUS_SUCCESS
+	DBGC("session %u: CONNECT result=%u", op->session_id, res); // 0==MBIM_STATUS_SUCCESS
 
-	if(res!=MBIM_STATUS_SUCCESS || op->connect==0)
+	if(!ret && res==MBIM_STATUS_SUCCESS && op->connect==0 && mbim_get_netdev(cp->tp_interface, netdev)==0)
+		mbim_apply_ip_config(netdev, op->session_id, NULL);
+	if(ret || res!=MBIM_STATUS_SUCCESS || op->connect==0 || state.ActivationState!=MBIM_ACTIVATION_STATE_ACTIVATED)
 		goto end;
 
-	cmd = mbim_format_query_ip_configuration(0);  // session_id hardcoded here
-	send_command(cmd, cp);
-	mbim_free_message(cmd);
+	// the ip configuration is queried right after the activation, unless an indication brought it meanwhile
+	ret = mbim_state_query(cp, MBIM_CID_IP_CONFIGURATION, op->session_id, &ip, since-start+1);
+	if(ret<0 && cp->status!=COMMAND_STATE_DONE)
+		goto end;
+	timing.ip_from_mirror = ret==0;
+	timing.ip_msec = connect_phase(&since);
 
-	msg = cp->response;
-	// extract IP parameters
-	mbim_free_function_message(cp->response); // after having consumed the response
+	// without mtu from the network, the one of the USB function
+	if(ret>=0 && mbim_get_netdev(cp->tp_interface, netdev)==0) {
+		if(!((ip.IPv4ConfigurationAvailable | ip.IPv6ConfigurationAvailable) & 8) && cp->tp_interface->mbim_limits.MTU) {
+			ip.IPv4ConfigurationAvailable |= 8;
+			ip.IPv4Mtu = cp->tp_interface->mbim_limits.MTU;
+		}
+		if(mbim_apply_ip_config(netdev, op->session_id, &ip)==0)
+			timing.net_configured = 1;
+	}
+	timing.net_msec = connect_phase(&since);
+	timing.total_msec = since-start; // time to data
+
+	if(mbim_apply_packet_filters(cp, op->session_id, 0)) // after the data path is up
+		DBGC("packet filters not applied")
+
+	DBGC("session %u: connected in %llu msec: ready %llu%s, connect %llu, ip %llu%s, net %llu%s", op->session_id,
+		(unsigned long long)timing.total_msec, (unsigned long long)timing.ready_msec, timing.ready_from_mirror ? " (known)" : "",
+		(unsigned long long)timing.connect_msec, (unsigned long long)timing.ip_msec, timing.ip_from_mirror ? " (known)" : "",
+		(unsigned long long)timing.net_msec, timing.net_configured ? "" : " (not configured)")
+	pthread_mutex_lock(&pr->lock);
+	pr->connect_timing[op->session_id] = timing;
+	pthread_mutex_unlock(&pr->lock);
+	connected = 1;
 
 end:
+	if(op->connect)
+		reconnect_result(cp->tp_interface, op, connected);
 	free(op);
 	destroy_client_thread(cp);
 	return NULL;
 }
 
+// of the last successful connection of the session. return 0=success
+int mbim_get_connect_timing(thread_params_t *tp, uint32_t session_id, mbim_connect_timing_t *out) {
+	mbim_procs_t *pr = tp->tp_mbim->mbim_procs;
+	if(session_id>=MBIM_STATE_MAX_SESSIONS)
+		return -1;
+	pthread_mutex_lock(&pr->lock);
+	*out = pr->connect_timing[session_id];
+	pthread_mutex_unlock(&pr->lock);
+	return out->total_msec ? 0 : -1;
+}
+
+static int mbim_spawn_connect(thread_params_t *tp_mbim, const connect_op_t *op) {
+	char name[64];
+	snprintf(name, sizeof(name), "mbim_%s-%u", op->reconnect ? "reconnect" : "connect", op->session_id);
+	client_params_t *cp = new_client_thread(name, tp_mbim);
+	cp->priority = COMMAND_PRIORITY_CONTROL;
+	DBGC("spawn")
+	connect_op_t *copy = malloc(sizeof(connect_op_t));
+	*copy = *op;
+	cp->command = copy;
+	if(pthread_create(&cp->tid, NULL, mbim_connect_client_thread, cp)) {
+		free(copy);
+		destroy_client_thread(cp);
+		return -1;
+	}
+	return 0;
+}
+
+// unknown: the attempt tells
+static int reconnect_registered(thread_params_t *tp_mbim) {
+	mbim_register_state_t reg;
+	if(mbim_state_get(tp_mbim->mbim_state, MBIM_CID_REGISTER_STATE, 0, &reg, 0))
+		return 1;
+	return reg.RegisterState==MBIM_REGISTER_STATE_HOME || reg.RegisterState==MBIM_REGISTER_STATE_ROAMING ||
+		reg.RegisterState==MBIM_REGISTER_STATE_PARTNER;
+}
+
+// one for all modems. the attempts are connect procedures on their own threads, their result reschedules
+void *reconnect_supervisor_thread(void *data) {
+	pthread_mutex_lock(&reconnect.lock);
+	for(;;) {
+		uint64_t now = get_monotonic_msec(), wake = 0;
+		if(reconnect.tokens<MBIM_RECONNECT_BURST) {
+			uint64_t periods = (now-reconnect.refill_msec)/MBIM_RECONNECT_RATE_MSEC;
+			reconnect.tokens = periods>=MBIM_RECONNECT_BURST-reconnect.tokens ? MBIM_RECONNECT_BURST : reconnect.tokens+periods;
+			reconnect.refill_msec += periods*MBIM_RECONNECT_RATE_MSEC;
+		}
+		if(reconnect.tokens==MBIM_RECONNECT_BURST)
+			reconnect.refill_msec = now;
+		for(int i=0;i<MBIM_RECONNECT_MAX_SLOTS;i++) {
+			reconnect_slot_t *slot = &reconnect.slots[i];
+			uint64_t due = slot->due_msec;
+			if(!slot->tp_mbim || !slot->armed || !slot->dropped_msec || slot->attempting)
+				continue;
+			if(!reconnect_registered(slot->tp_mbim))
+				continue; // the registration indication wakes up
+			if(due<=now && !reconnect.tokens) {
+				if(!slot->limited)
+					slot->stats.rate_limited++;
+				slot->limited = 1;
+				due = reconnect.refill_msec+MBIM_RECONNECT_RATE_MSEC;
+			}
+			if(due>now) {
+				if(!wake || due<wake)
+					wake = due;
+				continue;
+			}
+			reconnect.tokens--;
+			slot->limited = 0;
+			slot->attempting = 1;
+			slot->stats.attempts++;
+			slot->op.connect = 1;
+			slot->op.reconnect = 1;
+			if(mbim_spawn_connect(slot->tp_mbim, &slot->op)) {
+				slot->attempting = 0;
+				slot->due_msec = now+reconnect_backoff_nolock(slot->failures++);
+			}
+		}
+		if(wake) {
+			struct timespec deadline;
+			get_timeout_abstime(&deadline, wake-now);
+			pthread_cond_timedwait(&reconnect.changed, &reconnect.lock, &deadline);
+		} else
+			pthread_cond_wait(&reconnect.changed, &reconnect.lock);
+	}
+	pthread_mutex_unlock(&reconnect.lock);
+	return NULL;
+}
+
+// session_id below MaxSessions of the device. a disconnect ends the supervision of the session. return 0=success
+int mbim_connect_session(thread_params_t *tp, uint32_t session_id, uint32_t connect, const char *apn, uint32_t ip_type) {
+	mbim_device_caps_t caps;
+	connect_op_t op = { .session_id = session_id, .connect = connect, .ip_type = ip_type };
+	if(session_id>=MBIM_STATE_MAX_SESSIONS ||
+		(mbim_state_get(tp->mbim_state, MBIM_CID_DEVICE_CAPS, 0, &caps, 0)==0 && session_id>=caps.MaxSessions)) {
+		DBGT("session %u not supported", session_id)
+		return -1;
+	}
+	strncpy(op.apn, apn, sizeof(op.apn)-1);
+	pthread_mutex_lock(&reconnect.lock);
+	reconnect_slot_t *slot = reconnect_find_nolock(tp, session_id, connect);
+	if(slot) {
+		slot->armed = 0; // the result of this connect arms it again
+		slot->attempting = 0;
+		op.generation = ++slot->generation; // the connects still in flight are stale
+	}
+	if(connect && !reconnect.running) {
+		pthread_t tid;
+		reconnect.seed = (unsigned int)get_monotonic_msec();
+		if(pthread_create(&tid, NULL, reconnect_supervisor_thread, NULL)==0) {
+			pthread_detach(tid);
+			reconnect.running = 1;
+		}
+	}
+	pthread_mutex_unlock(&reconnect.lock);
+	return mbim_spawn_connect(tp, &op);
+}
+
+// from the tty
+int mbim_connect(thread_params_t *tp, uint32_t session_id, uint32_t connect, const char *apn, uint32_t ip_type) {
+	return mbim_connect_session(tp->tp_mbim, session_id, connect, apn, ip_type);
+}
+
 // return 0=success
-int mbim_connect(thread_params_t *tp, uint32_t connect, const char *apn) {
-	client_params_t *cp = new_client_thread("mbim_connect", tp->tp_mbim);
-	DBGT("spawn: %s", cp->name)
-	connect_op_t *op = calloc(1, sizeof(connect_op_t));
-	op->connect = connect;
-	strncpy(op->apn, apn, sizeof(op->apn));
+int mbim_get_reconnect_stats(thread_params_t *tp, uint32_t session_id, mbim_reconnect_stats_t *out) {
+	int ret = -1;
+	pthread_mutex_lock(&reconnect.lock);
+	reconnect_slot_t *slot = reconnect_find_nolock(tp->tp_mbim, session_id, 0);
+	if(slot) {
+		*out = slot->stats;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&reconnect.lock);
+	return ret;
+}
+
+// from the exiting mbim thread
+void mbim_reconnect_forget(thread_params_t *tp_mbim) {
+	pthread_mutex_lock(&reconnect.lock);
+	for(int i=0;i<MBIM_RECONNECT_MAX_SLOTS;i++)
+		if(reconnect.slots[i].tp_mbim==tp_mbim)
+			reconnect.slots[i].tp_mbim = NULL;
+	pthread_mutex_unlock(&reconnect.lock);
+}
+
+static unsigned int proc_generation_next(proc_generation_t *g) {
+	pthread_mutex_lock(&g->lock);
+	unsigned int generation = ++g->generation;
+	pthread_cond_broadcast(&g->changed);
+	pthread_mutex_unlock(&g->lock);
+	return generation;
+}
+
+// sleeps up to msec. return 1 if the procedure of this generation was replaced
+static int proc_generation_wait(proc_generation_t *g, unsigned int generation, long msec) {
+	struct timespec deadline;
+	get_timeout_abstime(&deadline, msec);
+	pthread_mutex_lock(&g->lock);
+	while(g->generation==generation && pthread_cond_timedwait(&g->changed, &g->lock, &deadline)==0)
+		;
+	int replaced = g->generation!=generation;
+	pthread_mutex_unlock(&g->lock);
+	return replaced;
+}
+
+typedef struct {
+	mbim_signal_policy_t policy;
+	unsigned int generation;
+} signal_policy_op_t;
+
+// return 0=success
+static int mbim_apply_signal_reporting(client_params_t *cp, uint32_t interval_sec, const mbim_signal_policy_t *policy) {
+	const unsigned char *info;
+	uint32_t len, status;
+	mbim_message_t *cmd = mbim_format_set_signal_state(interval_sec, policy->rssi_threshold, policy->error_rate_threshold);
+	int ret = send_command(cmd, cp);
+	mbim_free_message(cmd);
+	if(ret)
+		return -1;
+	ret = mbim_get_info_buffer(cp->response, &info, &len, &status);
+	mbim_free_function_message(cp->response); // the answer updates the mirror anyway
+	cp->response = NULL;
+	if(ret || status!=MBIM_STATUS_SUCCESS)
+		return -1;
+	DBGC("signal reporting every %u sec, thresholds %u %u", interval_sec, policy->rssi_threshold, policy->error_rate_threshold)
+	return 0;
+}
+
+void *mbim_signal_policy_client_thread(void *data) {
+	client_params_t *cp = data;
+	signal_policy_op_t *op = cp->command;
+	mbim_signal_policy_t *policy = &op->policy;
+	unsigned int generation = op->generation;
+	mbim_state_t *st = cp->tp_interface->mbim_state;
+	uint32_t interval = policy->interval_sec;
+	int applied;
+	cp->command = NULL;
+
+	applied = mbim_apply_signal_reporting(cp, interval, policy)==0;
+	if(!policy->adaptive)
+		goto end;
+	unsigned long reads = mbim_state_reads(st, MBIM_CID_SIGNAL_STATE, 0);
+	while(!proc_generation_wait(&cp->tp_interface->mbim_procs->signal_policy, generation, policy->adapt_period_msec)) {
+
+		// about one report per read, within the bounds; changed by a factor of 2 at least
+		unsigned long now_reads = mbim_state_reads(st, MBIM_CID_SIGNAL_STATE, 0);
+		unsigned long period_sec = policy->adapt_period_msec/1000;
+		uint32_t want = now_reads>reads ? period_sec/(now_reads-reads) : policy->max_interval_sec;
+		reads = now_reads;
+		if(want<policy->min_interval_sec)
+			want = policy->min_interval_sec;
+		if(want>policy->max_interval_sec)
+			want = policy->max_interval_sec;
+		if(applied && want<interval*2 && want*2>interval)
+			continue;
+		interval = want;
+		applied = mbim_apply_signal_reporting(cp, interval, policy)==0; // retried next period if the device is closed
+	}
+end:
+	free(op);
+	destroy_client_thread(cp);
+	return NULL;
+}
+
+int mbim_set_signal_policy(thread_params_t *tp, const mbim_signal_policy_t *policy) {
+	client_params_t *cp = new_client_thread("mbim_signal_policy", tp->tp_mbim);
+	cp->priority = COMMAND_PRIORITY_CONTROL;
+	signal_policy_op_t *op = calloc(1, sizeof(signal_policy_op_t));
+	op->policy = *policy;
+	if(op->policy.adapt_period_msec<1000)
+		op->policy.adapt_period_msec = 1000;
+	if(op->policy.max_interval_sec<op->policy.min_interval_sec)
+		op->policy.max_interval_sec = op->policy.min_interval_sec;
 	cp->command = op;
-	return pthread_create(&cp->tid, NULL, mbim_connect_client_thread, cp);
+	op->generation = proc_generation_next(&tp->tp_mbim->mbim_procs->signal_policy); // of this modem only
+	DBGT("spawn: %s", cp->name)
+	return pthread_create(&cp->tid, NULL, mbim_signal_policy_client_thread, cp);
 }
 
-void *mbim_event_connect(void *data) {
+typedef struct {
+	long interval_msec;
+	unsigned int generation;
+} packet_sampler_op_t;
+
+// the answers go to the state mirror, that computes the deltas and the rates
+void *mbim_packet_sampler_client_thread(void *data) {
 	client_params_t *cp = data;
-	mbim_function_message_t* msg = cp->response; // msg->bin_buf = {uuid, cid, info_buf_len, info_buf={session_id, activation_state, ...}}
+	packet_sampler_op_t op = *(packet_sampler_op_t *)cp->command;
+	free(cp->command);
+	cp->command = NULL;
+	mbim_message_t *query = mbim_format_query(MBIM_CID_PACKET_STATISTICS, NULL, 0); // encoded once for all the samples
+
+	do {
+		if(send_command(query, cp)==0) {
+			mbim_free_function_message(cp->response);
+			cp->response = NULL;
+		}
+	} while(!proc_generation_wait(&cp->tp_interface->mbim_procs->packet_sampler, op.generation, op.interval_msec));
+
+	mbim_free_message(query);
+	destroy_client_thread(cp);
+	return NULL;
+}
 
-	uint32_t session_id = bin_to_uint32(msg->bin_buf+UUID_LEN+sizeof(uint32_t)*2, USE_LITTLE_ENDIAN);
-	uint32_t activation_state = bin_to_uint32(msg->bin_buf+UUID_LEN+sizeof(uint32_t)*3, USE_LITTLE_ENDIAN);
+// device wide counters every interval_msec, read with mbim_state_get(MBIM_CID_PACKET_STATISTICS). 0 stops
+int mbim_start_packet_sampler(thread_params_t *tp, long interval_msec) {
+	unsigned int generation = proc_generation_next(&tp->tp_mbim->mbim_procs->packet_sampler); // of this modem only
+	if(interval_msec<=0)
+		return 0;
+	client_params_t *cp = new_client_thread("mbim_packet_sampler", tp->tp_mbim);
+	cp->priority = COMMAND_PRIORITY_BULK;
+	cp->timeout_msec = interval_msec>1000 ? interval_msec : 1000; // a late answer is not a sample any more
+	packet_sampler_op_t *op = malloc(sizeof(packet_sampler_op_t));
+	op->interval_msec = interval_msec;
+	op->generation = generation;
+	cp->command = op;
+	DBGT("spawn: %s", cp->name)
+	return pthread_create(&cp->tid, NULL, mbim_packet_sampler_client_thread, cp);
+}
 
-	mbim_free_function_message(msg);
+// inline on the mbim thread
+void mbim_event_connect(thread_params_t *tp, const void *event) {
+	const unsigned char *info;
+	uint32_t len, status;
+	mbim_connect_state_t c;
 
-	DBG(REDCOLOR"context: %d - state: %s"NOCOLOR, session_id, get_activation_state_string(activation_state));
+	if(mbim_get_info_buffer(event, &info, &len, &status) || mbim_decode_connect(info, len, &c))
+		return;
+	DBG(REDCOLOR"context: %d - state: %s"NOCOLOR, c.SessionId, get_activation_state_string(c.ActivationState));
 
+	uint64_t now = get_monotonic_msec();
+	pthread_mutex_lock(&reconnect.lock);
+	reconnect_slot_t *slot = reconnect_find_nolock(tp, c.SessionId, 0);
+	if(!slot || !slot->armed || slot->attempting) // an attempt ends with its own result
+		goto end;
+	if(c.ActivationState==MBIM_ACTIVATION_STATE_ACTIVATED) {
+		reconnect_up_nolock(slot, now); // brought up by the device itself
+	} else if(c.ActivationState==MBIM_ACTIVATION_STATE_DEACTIVATED && !slot->dropped_msec) {
+		slot->dropped_msec = now;
+		slot->stats.drops++;
+		slot->due_msec = now+reconnect_backoff_nolock(0);
+		pthread_cond_broadcast(&reconnect.changed);
+	}
+end:
+	pthread_mutex_unlock(&reconnect.lock);
+}
+
+// the dropped sessions of a modem registered again are retried without waiting for their backoff
+void mbim_event_register_state(thread_params_t *tp, const void *event) {
+	const unsigned char *info;
+	uint32_t len, status;
+	mbim_register_state_t r;
+
+	if(mbim_get_info_buffer(event, &info, &len, &status) || mbim_decode_register_state(info, len, &r))
+		return;
+	if(r.RegisterState!=MBIM_REGISTER_STATE_HOME && r.RegisterState!=MBIM_REGISTER_STATE_ROAMING &&
+		r.RegisterState!=MBIM_REGISTER_STATE_PARTNER)
+		return;
+	mbim_autoinit_registered(tp);
+	uint64_t now = get_monotonic_msec();
+	pthread_mutex_lock(&reconnect.lock);
+	for(int i=0;i<MBIM_RECONNECT_MAX_SLOTS;i++) {
+		reconnect_slot_t *slot = &reconnect.slots[i];
+		if(slot->tp_mbim==tp && slot->armed && slot->dropped_msec && !slot->attempting) {
+			slot->failures = 0;
+			slot->due_msec = now+reconnect_backoff_nolock(0);
+		}
+	}
+	pthread_cond_broadcast(&reconnect.changed);
+	pthread_mutex_unlock(&reconnect.lock);
+}
+
+void *mbim_resubscribe_client_thread(void *data) {
+	client_params_t *cp = data;
+	thread_params_t *tp = cp->tp_interface;
+	mbim_message_t *cmd;
+	uint64_t cids;
+
+	pthread_mutex_lock(&tp->eq.lock);
+	cids = mbim_wanted_subscriptions_nolock(tp);
+	pthread_mutex_unlock(&tp->eq.lock);
+	DBGC("subscriptions %016llX", (unsigned long long)cids)
+	cmd = mbim_format_set_subscription_mask(cids);
+	int ret = send_command(cmd, cp);
+	mbim_free_message(cmd);
+
+	pthread_mutex_lock(&tp->eq.lock);
+	tp->mbim_resubscribing = 0;
+	pthread_mutex_unlock(&tp->eq.lock);
+	if(ret==0) // the changes during the command are pushed by another thread
+		mbim_set_subscriptions_done(cp, cids);
 	destroy_client_thread(cp);
 	return NULL;
 }
+
+// from the mbim thread, with eq.lock, when the handlers do not match the subscriptions any more. return 0=success
+int mbim_resubscribe(thread_params_t *tp) {
+	client_params_t *cp = new_client_thread("mbim_resubscribe", tp);
+	cp->priority = COMMAND_PRIORITY_CONTROL;
+	DBGT("spawn: %s", cp->name)
+	if(pthread_create(&cp->tid, NULL, mbim_resubscribe_client_thread, cp)) {
+		destroy_client_thread(cp);
+		return -1;
+	}
+	return 0;
+}
+
+// from a client thread. the mirror answers if it is recent enough, otherwise the device is queried
+// (its answer updates the mirror). return 0 if answered by the mirror, 1 by the device, -1 on error:
+// then cp->status is COMMAND_STATE_DONE if the device answered without a value for the mirror
+int mbim_state_query(client_params_t *cp, enum mbim_command_code cc, uint32_t session_id, void *out, long max_age_msec) {
+	mbim_state_t *st = cp->tp_interface->mbim_state;
+	unsigned char info[60] = {0}; // session id and zeros, for CONNECT and IP_CONFIGURATION
+	uint32_t len = 0;
+	mbim_message_t *cmd;
+	int ret;
+
+	if(mbim_state_get(st, cc, session_id, out, max_age_msec)==0)
+		return 0;
+	if(!mbim_state_is_mirrored(cc))
+		return -1;
+	if(cc==MBIM_CID_CONNECT || cc==MBIM_CID_IP_CONFIGURATION) {
+		info[0] = session_id & 0xFF; // little endian
+		info[1] = (session_id>>8) & 0xFF;
+		info[2] = (session_id>>16) & 0xFF;
+		info[3] = (session_id>>24) & 0xFF;
+		len = cc==MBIM_CID_CONNECT ? 4*sizeof(uint32_t)+UUID_LEN+sizeof(uint32_t) : sizeof(info);
+	}
+	cmd = mbim_format_query(cc, info, len);
+	ret = send_command(cmd, cp);
+	mbim_free_message(cmd);
+	if(ret)
+		return -1;
+	mbim_free_function_message(cp->response);
+	cp->response = NULL;
+	return mbim_state_get(st, cc, session_id, out, 0)==0 ? 1 : -1;
+}
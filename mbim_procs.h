@@ -34,12 +34,75 @@ either expressed or implied, of the <project name> project.
 #define __MBIM_PROCS_H__
 
 #include "thread.h"
+#include "mbim_lib.h"
+
+// signal reporting of the device. the adaptive interval follows the readers of the state mirror
+typedef struct {
+	uint32_t interval_sec; // SignalStrengthInterval, MBIM_SIGNAL_DEFAULT: device default. initial one if adaptive
+	uint32_t rssi_threshold; // 2 dBm steps, or MBIM_SIGNAL_DEFAULT, MBIM_SIGNAL_THRESHOLD_DISABLED
+	uint32_t error_rate_threshold;
+	int adaptive;
+	uint32_t min_interval_sec; // adaptive bounds
+	uint32_t max_interval_sec;
+	long adapt_period_msec; // reads are counted over this period
+} mbim_signal_policy_t;
+
+// time to data of a connection, per phase
+typedef struct {
+	uint64_t ready_msec; // subscriber ready
+	uint64_t connect_msec; // SET CONNECT
+	uint64_t ip_msec; // ip configuration
+	uint64_t net_msec; // net device configuration
+	uint64_t total_msec;
+	int ready_from_mirror; // known from the indications, without a query
+	int ip_from_mirror;
+	int net_configured;
+} mbim_connect_timing_t;
+
+// reconnect supervision of a session, since its first connection
+typedef struct {
+	unsigned int drops; // deactivations indicated
+	unsigned int attempts;
+	unsigned int failures;
+	unsigned int reconnects;
+	unsigned int rate_limited; // attempts delayed by the rate of all modems
+	uint64_t latency_min_msec; // from the drop to data again
+	uint64_t latency_max_msec;
+	uint64_t latency_total_msec;
+} mbim_reconnect_stats_t;
+
+#define MBIM_RECONNECT_BASE_MSEC	(1000) // doubled per failed attempt
+#define MBIM_RECONNECT_MAX_MSEC		(300000)
+#define MBIM_RECONNECT_RATE_MSEC	(500) // one attempt per period, all modems together
+#define MBIM_RECONNECT_BURST		(4)
+#define MBIM_RECONNECT_MAX_SLOTS	(32) // supervised sessions, all modems together
+
+#define MBIM_CONNECT_READY_MAX_AGE_MSEC	(60000) // the ready state is indicated on change anyway
+
+typedef struct mbim_procs_t mbim_procs_t;
+mbim_procs_t *mbim_procs_new(); // for create_mbim_thread
+void mbim_procs_free(mbim_procs_t *pr);
 
 // mbim_client
 int mbim_initproc(thread_params_t *tp);
+int mbim_autoinit(thread_params_t *tp_mbim, const char *apn); // apn NULL: no auto connect
 int mbim_closeproc(thread_params_t *tp);
-int mbim_connect(thread_params_t *tp, uint32_t connect, const char *apn);
+int mbim_connect(thread_params_t *tp, uint32_t session_id, uint32_t connect, const char *apn, uint32_t ip_type);
+int mbim_connect_session(thread_params_t *tp_mbim, uint32_t session_id, uint32_t connect, const char *apn, uint32_t ip_type);
+int mbim_resubscribe(thread_params_t *tp);
+int mbim_set_packet_filters(thread_params_t *tp, const mbim_packet_filters_t *f); // per session, kept across connections
+int mbim_clear_packet_filters(thread_params_t *tp, uint32_t session_id);
+int mbim_apply_packet_filters(client_params_t *cp, uint32_t session_id, int always); // from a client thread
+int mbim_query_packet_filters(client_params_t *cp, uint32_t session_id, mbim_packet_filters_t *out);
+int mbim_start_packet_sampler(thread_params_t *tp, long interval_msec); // 0 stops
+int mbim_set_signal_policy(thread_params_t *tp, const mbim_signal_policy_t *policy); // replaces the previous one
+int mbim_get_connect_timing(thread_params_t *tp, uint32_t session_id, mbim_connect_timing_t *out);
+int mbim_get_reconnect_stats(thread_params_t *tp, uint32_t session_id, mbim_reconnect_stats_t *out);
+void mbim_reconnect_forget(thread_params_t *tp_mbim);
+int mbim_apply_ip_config(const char *netdev, uint32_t session_id, const mbim_ip_config_t *ip);
+int mbim_state_query(client_params_t *cp, enum mbim_command_code cc, uint32_t session_id, void *out, long max_age_msec); // 0: from the mirror, 1: from the device
 
-void *mbim_event_connect(void *data);
+void mbim_event_connect(thread_params_t *tp, const void *event); // inline handlers
+void mbim_event_register_state(thread_params_t *tp, const void *event);
 
 #endif /* __MBIM_PROCS_H__ */
@@ -0,0 +1,317 @@
+/*******************************************************************************
+// software distributed under freeBSD license as follow
+
+Copyright (c) 2018, Gemalto M2M
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the <project name> project.
+
+*******************************************************************************/
+
+#include "mbim_state.h"
+#include "common.h"
+#include <stdlib.h>
+#include <string.h>
+
+mbim_state_t *mbim_state_new() {
+	mbim_state_t *st = calloc(1, sizeof(mbim_state_t));
+	pthread_mutex_init(&st->lock, NULL);
+	return st;
+}
+
+void mbim_state_free(mbim_state_t *st) {
+	if(!st)
+		return;
+	pthread_mutex_destroy(&st->lock);
+	free(st);
+}
+
+// value and stamp of a mirrored cid. NULL if not mirrored. a new cid goes in mbim_state_mirrored as well
+static void *mbim_state_field(mbim_state_t *st, enum mbim_command_code cc, uint32_t session_id, size_t *size, mbim_state_stamp_t **stamp) {
+	switch(cc) {
+	case MBIM_CID_DEVICE_CAPS:
+		*size = sizeof(st->caps);
+		*stamp = &st->caps_stamp;
+		return &st->caps;
+	case MBIM_CID_SUBSCRIBER_READY_STATUS:
+		*size = sizeof(st->subscriber);
+		*stamp = &st->subscriber_stamp;
+		return &st->subscriber;
+	case MBIM_CID_RADIO_STATE:
+		*size = sizeof(st->radio);
+		*stamp = &st->radio_stamp;
+		return &st->radio;
+	case MBIM_CID_REGISTER_STATE:
+		*size = sizeof(st->reg);
+		*stamp = &st->reg_stamp;
+		return &st->reg;
+	case MBIM_CID_PACKET_SERVICE:
+		*size = sizeof(st->packet_service);
+		*stamp = &st->packet_service_stamp;
+		return &st->packet_service;
+	case MBIM_CID_SIGNAL_STATE:
+		*size = sizeof(st->signal);
+		*stamp = &st->signal_stamp;
+		return &st->signal;
+	case MBIM_CID_PACKET_STATISTICS:
+		*size = sizeof(st->packets);
+		*stamp = &st->packets_stamp;
+		return &st->packets;
+	case MBIM_CID_CONNECT:
+		if(session_id>=MBIM_STATE_MAX_SESSIONS)
+			return NULL;
+		*size = sizeof(st->connect[0]);
+		*stamp = &st->connect_stamp[session_id];
+		return &st->connect[session_id];
+	case MBIM_CID_IP_CONFIGURATION:
+		if(session_id>=MBIM_STATE_MAX_SESSIONS)
+			return NULL;
+		*size = sizeof(st->ip[0]);
+		*stamp = &st->ip_stamp[session_id];
+		return &st->ip[session_id];
+	default:
+		return NULL;
+	}
+}
+
+// the cids of mbim_state_field
+static const unsigned char mbim_state_mirrored[MBIM_INVALID] = {
+	[MBIM_CID_DEVICE_CAPS] = 1,
+	[MBIM_CID_SUBSCRIBER_READY_STATUS] = 1,
+	[MBIM_CID_RADIO_STATE] = 1,
+	[MBIM_CID_REGISTER_STATE] = 1,
+	[MBIM_CID_PACKET_SERVICE] = 1,
+	[MBIM_CID_SIGNAL_STATE] = 1,
+	[MBIM_CID_PACKET_STATISTICS] = 1,
+	[MBIM_CID_CONNECT] = 1,
+	[MBIM_CID_IP_CONFIGURATION] = 1,
+};
+
+int mbim_state_is_mirrored(enum mbim_command_code cc) {
+	return (unsigned)cc<MBIM_INVALID && mbim_state_mirrored[cc];
+}
+
+uint64_t mbim_state_subscriptions() {
+	uint64_t cids = 0;
+	for(enum mbim_command_code cc = 0;cc<MBIM_INVALID;cc++)
+		if(mbim_state_is_mirrored(cc))
+			cids |= MBIM_CID_BIT(cc);
+	return cids & MBIM_NOTIFICATION_CIDS;
+}
+
+static void mbim_state_stamp(mbim_state_stamp_t *stamp, uint64_t now) {
+	stamp->valid = 1;
+	stamp->updated_msec = now;
+}
+
+// a counter lower than before: the device restarted counting
+static uint64_t counter_delta(uint64_t now, uint64_t before) {
+	return now>=before ? now-before : now;
+}
+
+static uint64_t per_sec(uint64_t delta, uint64_t msec) {
+	return msec ? delta*1000/msec : 0;
+}
+
+// with st->lock. interval_msec 0 for the first sample
+static void mbim_state_packet_sample(mbim_packet_sample_t *p, const mbim_packet_statistics_t *s, uint64_t interval_msec) {
+	mbim_packet_statistics_t *d = &p->delta;
+	if(interval_msec) {
+		d->InDiscards = counter_delta(s->InDiscards, p->total.InDiscards);
+		d->InErrors = counter_delta(s->InErrors, p->total.InErrors);
+		d->InOctets = counter_delta(s->InOctets, p->total.InOctets);
+		d->InPackets = counter_delta(s->InPackets, p->total.InPackets);
+		d->OutOctets = counter_delta(s->OutOctets, p->total.OutOctets);
+		d->OutPackets = counter_delta(s->OutPackets, p->total.OutPackets);
+		d->OutErrors = counter_delta(s->OutErrors, p->total.OutErrors);
+		d->OutDiscards = counter_delta(s->OutDiscards, p->total.OutDiscards);
+	} else
+		memset(d, 0, sizeof(*d));
+	p->total = *s;
+	p->interval_msec = interval_msec;
+	p->in_bytes_per_sec = per_sec(d->InOctets, interval_msec);
+	p->out_bytes_per_sec = per_sec(d->OutOctets, interval_msec);
+	p->in_packets_per_sec = per_sec(d->InPackets, interval_msec);
+	p->out_packets_per_sec = per_sec(d->OutPackets, interval_msec);
+}
+
+void mbim_state_update(mbim_state_t *st, mbim_function_message_t *msg) {
+	const unsigned char *info;
+	uint32_t len, status = MBIM_STATUS_SUCCESS;
+	union {
+		mbim_device_caps_t caps;
+		mbim_subscriber_ready_t subscriber;
+		mbim_radio_state_t radio;
+		mbim_register_state_t reg;
+		mbim_packet_service_t packet_service;
+		mbim_signal_state_t signal;
+		mbim_connect_state_t connect;
+		mbim_ip_config_t ip;
+		mbim_packet_statistics_t packets;
+	} v;
+	int ret = -1;
+	uint32_t session_id = 0;
+	size_t size;
+	mbim_state_stamp_t *stamp;
+	void *field;
+
+	if(mbim_get_info_buffer(msg, &info, &len, &status) || status!=MBIM_STATUS_SUCCESS || !len)
+		return;
+	enum mbim_command_code cc = mbim_get_msg_cmd_code(msg);
+	switch(cc) { // decoded outside of the lock
+	case MBIM_CID_DEVICE_CAPS:
+		ret = mbim_decode_device_caps(info, len, &v.caps);
+		break;
+	case MBIM_CID_SUBSCRIBER_READY_STATUS:
+		ret = mbim_decode_subscriber_ready(info, len, &v.subscriber);
+		break;
+	case MBIM_CID_RADIO_STATE:
+		ret = mbim_decode_radio_state(info, len, &v.radio);
+		break;
+	case MBIM_CID_REGISTER_STATE:
+		ret = mbim_decode_register_state(info, len, &v.reg);
+		break;
+	case MBIM_CID_PACKET_SERVICE:
+		ret = mbim_decode_packet_service(info, len, &v.packet_service);
+		break;
+	case MBIM_CID_SIGNAL_STATE:
+		ret = mbim_decode_signal_state(info, len, &v.signal);
+		break;
+	case MBIM_CID_CONNECT:
+		ret = mbim_decode_connect(info, len, &v.connect);
+		session_id = v.connect.SessionId;
+		break;
+	case MBIM_CID_IP_CONFIGURATION:
+		ret = mbim_decode_ip_configuration(info, len, &v.ip);
+		session_id = v.ip.SessionId;
+		break;
+	case MBIM_CID_PACKET_STATISTICS:
+		ret = mbim_decode_packet_statistics(info, len, &v.packets);
+		break;
+	default:
+		return;
+	}
+	if(ret)
+		return;
+	field = mbim_state_field(st, cc, session_id, &size, &stamp);
+	if(!field)
+		return;
+	uint64_t now = get_monotonic_msec();
+	pthread_mutex_lock(&st->lock);
+	if(cc==MBIM_CID_PACKET_STATISTICS)
+		mbim_state_packet_sample(&st->packets, &v.packets, stamp->valid ? now-stamp->updated_msec : 0);
+	else
+		memcpy(field, &v, size);
+	mbim_state_stamp(stamp, now);
+	if(cc==MBIM_CID_CONNECT && v.connect.ActivationState==MBIM_ACTIVATION_STATE_DEACTIVATED)
+		st->ip_stamp[session_id].valid = 0; // the addresses are gone with the context
+	pthread_mutex_unlock(&st->lock);
+}
+
+void mbim_state_invalidate(mbim_state_t *st) {
+	pthread_mutex_lock(&st->lock);
+	st->caps_stamp.valid = 0;
+	st->subscriber_stamp.valid = 0;
+	st->radio_stamp.valid = 0;
+	st->reg_stamp.valid = 0;
+	st->packet_service_stamp.valid = 0;
+	st->signal_stamp.valid = 0;
+	st->packets_stamp.valid = 0;
+	for(int i=0;i<MBIM_STATE_MAX_SESSIONS;i++) {
+		st->connect_stamp[i].valid = 0;
+		st->ip_stamp[i].valid = 0;
+	}
+	pthread_mutex_unlock(&st->lock);
+}
+
+int mbim_state_get(mbim_state_t *st, enum mbim_command_code cc, uint32_t session_id, void *out, long max_age_msec) {
+	size_t size;
+	mbim_state_stamp_t *stamp;
+	int ret = -1;
+	void *field = mbim_state_field(st, cc, session_id, &size, &stamp);
+	if(!field)
+		return -1;
+	uint64_t now = get_monotonic_msec();
+	pthread_mutex_lock(&st->lock);
+	stamp->reads++; // a miss too: the reader wanted it
+	if(stamp->valid && (!max_age_msec || now-stamp->updated_msec<=(uint64_t)max_age_msec)) {
+		memcpy(out, field, size);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&st->lock);
+	return ret;
+}
+
+unsigned long mbim_state_reads(mbim_state_t *st, enum mbim_command_code cc, uint32_t session_id) {
+	size_t size;
+	mbim_state_stamp_t *stamp;
+	unsigned long reads = 0;
+	if(!mbim_state_field(st, cc, session_id, &size, &stamp))
+		return 0;
+	pthread_mutex_lock(&st->lock);
+	reads = stamp->reads;
+	pthread_mutex_unlock(&st->lock);
+	return reads;
+}
+
+// age in msec, -1 if not valid
+static long mbim_state_age(mbim_state_stamp_t *stamp, uint64_t now) {
+	return stamp->valid ? (long)(now-stamp->updated_msec) : -1;
+}
+
+void mbim_state_print(mbim_state_t *st) {
+	uint64_t now = get_monotonic_msec();
+	pthread_mutex_lock(&st->lock);
+	if(st->caps_stamp.valid)
+		DBG("device: %s, firmware %s, hardware %s, max sessions %u", st->caps.DeviceId, st->caps.FirmwareInfo,
+			st->caps.HardwareInfo, st->caps.MaxSessions)
+	DBG("subscriber: ready %u, id '%s', iccid '%s' (age %ld)", st->subscriber.ReadyState, st->subscriber.SubscriberId,
+		st->subscriber.SimIccId, mbim_state_age(&st->subscriber_stamp, now))
+	DBG("radio: hw %u, sw %u (age %ld)", st->radio.HwRadioState, st->radio.SwRadioState, mbim_state_age(&st->radio_stamp, now))
+	DBG("register: state %u, mode %u, provider %s '%s', classes 0x%X (age %ld)", st->reg.RegisterState, st->reg.RegisterMode,
+		st->reg.ProviderId, st->reg.ProviderName, st->reg.AvailableDataClasses, mbim_state_age(&st->reg_stamp, now))
+	DBG("packet service: state %u, class 0x%X, up %lu, down %lu (age %ld)", st->packet_service.PacketServiceState,
+		st->packet_service.HighestAvailableDataClass, (unsigned long)st->packet_service.UplinkSpeed,
+		(unsigned long)st->packet_service.DownlinkSpeed, mbim_state_age(&st->packet_service_stamp, now))
+	DBG("signal: rssi %u, error rate %u (age %ld)", st->signal.Rssi, st->signal.ErrorRate, mbim_state_age(&st->signal_stamp, now))
+	if(st->packets_stamp.valid)
+		DBG("packets: in %llu bytes %llu packets (%llu B/s), out %llu bytes %llu packets (%llu B/s), errors %u/%u, discards %u/%u (age %ld)",
+			(unsigned long long)st->packets.total.InOctets, (unsigned long long)st->packets.total.InPackets,
+			(unsigned long long)st->packets.in_bytes_per_sec, (unsigned long long)st->packets.total.OutOctets,
+			(unsigned long long)st->packets.total.OutPackets, (unsigned long long)st->packets.out_bytes_per_sec,
+			st->packets.total.InErrors, st->packets.total.OutErrors, st->packets.total.InDiscards,
+			st->packets.total.OutDiscards, mbim_state_age(&st->packets_stamp, now))
+	for(int i=0;i<MBIM_STATE_MAX_SESSIONS;i++) {
+		if(st->connect_stamp[i].valid)
+			DBG("session %d: %s, ip type %u (age %ld)", i, get_activation_state_string(st->connect[i].ActivationState),
+				st->connect[i].IPType, mbim_state_age(&st->connect_stamp[i], now))
+		if(st->ip_stamp[i].valid && st->ip[i].IPv4AddressCount) {
+			unsigned char *a = st->ip[i].IPv4Address[0].IPv4Address;
+			DBG("session %d: %u.%u.%u.%u/%u, mtu %u (age %ld)", i, a[0], a[1], a[2], a[3],
+				st->ip[i].IPv4Address[0].OnLinkPrefixLength, st->ip[i].IPv4Mtu, mbim_state_age(&st->ip_stamp[i], now))
+		}
+	}
+	pthread_mutex_unlock(&st->lock);
+}
@@ -0,0 +1,100 @@
+/*******************************************************************************
+// software distributed under freeBSD license as follow
+
+Copyright (c) 2018, Gemalto M2M
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the <project name> project.
+
+*******************************************************************************/
+
+#ifndef __MBIM_STATE_H__
+#define __MBIM_STATE_H__
+
+#include "mbim_lib.h"
+#include <pthread.h>
+
+/* modem state mirror, kept current by the MBIM thread from indications and command responses.
+ * readers get a copy in microseconds, without a device round-trip, if it is not older than their bound */
+
+#define MBIM_STATE_MAX_SESSIONS		(8) // sessions with a higher id are not mirrored
+
+typedef struct {
+	int valid;
+	uint64_t updated_msec; // monotonic
+	unsigned long reads; // served by mbim_state_get, for the reporting policies
+} mbim_state_stamp_t;
+
+// derived from the last two PACKET_STATISTICS answers
+typedef struct {
+	mbim_packet_statistics_t total;
+	mbim_packet_statistics_t delta; // since the previous sample, all zero for the first one
+	uint64_t interval_msec; // between the two samples
+	uint64_t in_bytes_per_sec;
+	uint64_t out_bytes_per_sec;
+	uint64_t in_packets_per_sec;
+	uint64_t out_packets_per_sec;
+} mbim_packet_sample_t;
+
+typedef struct mbim_state_t mbim_state_t;
+struct mbim_state_t {
+	pthread_mutex_t lock;
+	mbim_device_caps_t caps;
+	mbim_state_stamp_t caps_stamp;
+	mbim_subscriber_ready_t subscriber;
+	mbim_state_stamp_t subscriber_stamp;
+	mbim_radio_state_t radio;
+	mbim_state_stamp_t radio_stamp;
+	mbim_register_state_t reg;
+	mbim_state_stamp_t reg_stamp;
+	mbim_packet_service_t packet_service;
+	mbim_state_stamp_t packet_service_stamp;
+	mbim_signal_state_t signal;
+	mbim_state_stamp_t signal_stamp;
+	mbim_connect_state_t connect[MBIM_STATE_MAX_SESSIONS];
+	mbim_state_stamp_t connect_stamp[MBIM_STATE_MAX_SESSIONS];
+	mbim_ip_config_t ip[MBIM_STATE_MAX_SESSIONS];
+	mbim_state_stamp_t ip_stamp[MBIM_STATE_MAX_SESSIONS];
+	mbim_packet_sample_t packets;
+	mbim_state_stamp_t packets_stamp;
+};
+
+mbim_state_t *mbim_state_new();
+void mbim_state_free(mbim_state_t *st);
+
+// from the MBIM thread: indications and successful command responses of the mirrored CIDs
+void mbim_state_update(mbim_state_t *st, mbim_function_message_t *msg);
+void mbim_state_invalidate(mbim_state_t *st); // eg: on close
+
+// copies the mirrored value of cc (session_id only for CONNECT and IP_CONFIGURATION) into out.
+// 0=success, -1 if never received, invalidated or older than max_age_msec (0: any age)
+int mbim_state_get(mbim_state_t *st, enum mbim_command_code cc, uint32_t session_id, void *out, long max_age_msec);
+int mbim_state_is_mirrored(enum mbim_command_code cc);
+uint64_t mbim_state_subscriptions(); // MBIM_CID_BIT set of the mirrored cids, kept current by indications
+unsigned long mbim_state_reads(mbim_state_t *st, enum mbim_command_code cc, uint32_t session_id); // served by mbim_state_get, for the reporting policies
+
+void mbim_state_print(mbim_state_t *st);
+
+#endif /* __MBIM_STATE_H__ */
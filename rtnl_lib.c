@@ -0,0 +1,285 @@
+/*******************************************************************************
+// software distributed under freeBSD license as follow
+
+Copyright (c) 2018, Gemalto M2M
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the <project name> project.
+
+*******************************************************************************/
+
+#include "rtnl_lib.h"
+#include "common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if.h>
+#include <linux/if_addr.h>
+
+#define RTNL_ADDR_LEN(family)	((family)==AF_INET6 ? 16 : 4)
+
+int rtnl_batch_open(rtnl_batch_t *b) {
+	struct sockaddr_nl local = { .nl_family = AF_NETLINK };
+	memset(b, 0, sizeof(rtnl_batch_t));
+	b->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if(b->fd<0)
+		return -errno;
+	if(bind(b->fd, (struct sockaddr *)&local, sizeof(local))) {
+		int ret = -errno;
+		close(b->fd);
+		b->fd = -1;
+		return ret;
+	}
+	b->seq = (uint32_t)get_monotonic_msec();
+	b->seq_first = b->seq+1;
+	return 0;
+}
+
+void rtnl_batch_close(rtnl_batch_t *b) {
+	if(b->fd>=0)
+		close(b->fd);
+	b->fd = -1;
+}
+
+// a request with its fixed header, zeroed. NULL if the batch is full
+static struct nlmsghdr *rtnl_request(rtnl_batch_t *b, uint16_t type, uint16_t flags, size_t header_len) {
+	size_t len = NLMSG_LENGTH(header_len);
+	if(b->len+NLMSG_ALIGN(len)>sizeof(b->buf))
+		return NULL;
+	struct nlmsghdr *nlh = (struct nlmsghdr *)(b->buf+b->len);
+	memset(nlh, 0, NLMSG_ALIGN(len));
+	nlh->nlmsg_len = len;
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	nlh->nlmsg_seq = ++b->seq;
+	return nlh;
+}
+
+// the request is queued once all its attributes are added
+static void rtnl_queue(rtnl_batch_t *b, struct nlmsghdr *nlh) {
+	b->len += NLMSG_ALIGN(nlh->nlmsg_len);
+	b->count++;
+}
+
+static int rtnl_attr(rtnl_batch_t *b, struct nlmsghdr *nlh, uint16_t type, const void *data, size_t len) {
+	size_t attr_len = RTA_LENGTH(len);
+	if(b->len+NLMSG_ALIGN(nlh->nlmsg_len)+RTA_ALIGN(attr_len)>sizeof(b->buf))
+		return -1;
+	struct rtattr *rta = (struct rtattr *)((unsigned char *)nlh+NLMSG_ALIGN(nlh->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = attr_len;
+	memcpy(RTA_DATA(rta), data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len)+RTA_ALIGN(attr_len);
+	return 0;
+}
+
+// what a flush deletes
+typedef struct {
+	int ifindex;
+	const rtnl_addr_t *keep;
+	unsigned int keep_count;
+} rtnl_match_t;
+
+static int rtnl_address_matches(const struct nlmsghdr *nlh, const rtnl_match_t *m) {
+	const struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+	const void *addr = NULL;
+	int len = IFA_PAYLOAD(nlh);
+	if(nlh->nlmsg_type!=RTM_NEWADDR || (int)ifa->ifa_index!=m->ifindex || ifa->ifa_scope!=RT_SCOPE_UNIVERSE)
+		return 0;
+	for(const struct rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		if(rta->rta_type==IFA_LOCAL || (rta->rta_type==IFA_ADDRESS && !addr)) // ipv6 has no IFA_LOCAL
+			addr = RTA_DATA(rta);
+	for(unsigned int i=0;addr && i<m->keep_count;i++)
+		if(m->keep[i].prefix_len==ifa->ifa_prefixlen && memcmp(m->keep[i].addr, addr, RTNL_ADDR_LEN(ifa->ifa_family))==0)
+			return 0; // replaced in place by rtnl_add_address
+	return 1;
+}
+
+// the routes added by rtnl_add_default_route
+static int rtnl_route_matches(const struct nlmsghdr *nlh, const rtnl_match_t *m) {
+	const struct rtmsg *rtm = NLMSG_DATA(nlh);
+	int len = RTM_PAYLOAD(nlh);
+	if(nlh->nlmsg_type!=RTM_NEWROUTE || rtm->rtm_table!=RT_TABLE_MAIN || rtm->rtm_protocol!=RTPROT_STATIC || rtm->rtm_dst_len)
+		return 0;
+	for(const struct rtattr *rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		if(rta->rta_type==RTA_OIF)
+			return *(const uint32_t *)RTA_DATA(rta)==(uint32_t)m->ifindex;
+	return 0;
+}
+
+// reads the objects now, the matching ones are queued for deletion as dumped
+static int rtnl_dump_to_delete(rtnl_batch_t *b, uint16_t get, uint16_t del, size_t header_len, int family,
+	int (*matches)(const struct nlmsghdr *nlh, const rtnl_match_t *m), const rtnl_match_t *m) {
+	struct {
+		struct nlmsghdr nlh;
+		struct rtmsg rtm; // the largest header, the family comes first in all of them
+	} req = {
+		.nlh = { .nlmsg_len = NLMSG_LENGTH(header_len), .nlmsg_type = get, .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP, .nlmsg_seq = ++b->seq },
+		.rtm = { .rtm_family = family },
+	};
+	unsigned char buf[8192];
+	int ret = -1, done = 0;
+	uint32_t dump_seq = req.nlh.nlmsg_seq;
+
+	b->seq_first = b->count ? b->seq_first : b->seq+1; // the dump is not part of the batch
+	if(send(b->fd, &req, req.nlh.nlmsg_len, 0)<0)
+		return -errno;
+	while(!done) {
+		ssize_t n = recv(b->fd, buf, sizeof(buf), 0);
+		if(n<0) {
+			if(errno==EINTR)
+				continue;
+			return -errno;
+		}
+		for(struct nlmsghdr *nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, n); nlh = NLMSG_NEXT(nlh, n)) {
+			if(nlh->nlmsg_seq!=dump_seq)
+				continue;
+			if(nlh->nlmsg_type==NLMSG_DONE) {
+				done = 1;
+				ret = 0;
+				break;
+			}
+			if(nlh->nlmsg_type==NLMSG_ERROR) {
+				done = 1;
+				ret = ((struct nlmsgerr *)NLMSG_DATA(nlh))->error;
+				break;
+			}
+			if(!matches(nlh, m))
+				continue;
+			// the object as dumped is its own deletion request
+			struct nlmsghdr *req_del = rtnl_request(b, del, 0, 0);
+			if(!req_del || b->len+NLMSG_ALIGN(nlh->nlmsg_len)>sizeof(b->buf))
+				return -1;
+			uint32_t seq = req_del->nlmsg_seq;
+			memcpy(req_del, nlh, nlh->nlmsg_len);
+			req_del->nlmsg_type = del;
+			req_del->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+			req_del->nlmsg_seq = seq;
+			req_del->nlmsg_pid = 0;
+			rtnl_queue(b, req_del);
+		}
+	}
+	return ret;
+}
+
+int rtnl_flush_addresses(rtnl_batch_t *b, int ifindex, int family, const rtnl_addr_t *keep, unsigned int keep_count) {
+	rtnl_match_t m = { .ifindex = ifindex, .keep = keep, .keep_count = keep_count };
+	return rtnl_dump_to_delete(b, RTM_GETADDR, RTM_DELADDR, sizeof(struct ifaddrmsg), family, rtnl_address_matches, &m);
+}
+
+int rtnl_flush_default_routes(rtnl_batch_t *b, int ifindex, int family) {
+	rtnl_match_t m = { .ifindex = ifindex };
+	return rtnl_dump_to_delete(b, RTM_GETROUTE, RTM_DELROUTE, sizeof(struct rtmsg), family, rtnl_route_matches, &m);
+}
+
+int rtnl_set_link(rtnl_batch_t *b, int ifindex, uint32_t mtu, int up) {
+	struct nlmsghdr *nlh = rtnl_request(b, RTM_NEWLINK, 0, sizeof(struct ifinfomsg));
+	if(!nlh)
+		return -1;
+	struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+	ifi->ifi_family = AF_UNSPEC;
+	ifi->ifi_index = ifindex;
+	ifi->ifi_change = IFF_UP;
+	ifi->ifi_flags = up ? IFF_UP : 0;
+	if(mtu && rtnl_attr(b, nlh, IFLA_MTU, &mtu, sizeof(mtu)))
+		return -1;
+	rtnl_queue(b, nlh);
+	return 0;
+}
+
+int rtnl_add_address(rtnl_batch_t *b, int ifindex, int family, const void *addr, unsigned int prefix_len) {
+	struct nlmsghdr *nlh = rtnl_request(b, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, sizeof(struct ifaddrmsg));
+	if(!nlh)
+		return -1;
+	struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
+	uint32_t flags = family==AF_INET6 ? IFA_F_NODAD : 0; // the network assigned it, no duplicate to detect
+	ifa->ifa_family = family;
+	ifa->ifa_prefixlen = prefix_len;
+	ifa->ifa_scope = RT_SCOPE_UNIVERSE;
+	ifa->ifa_index = ifindex;
+	ifa->ifa_flags = flags;
+	if(rtnl_attr(b, nlh, IFA_LOCAL, addr, RTNL_ADDR_LEN(family)) ||
+		rtnl_attr(b, nlh, IFA_ADDRESS, addr, RTNL_ADDR_LEN(family)) ||
+		rtnl_attr(b, nlh, IFA_FLAGS, &flags, sizeof(flags)))
+		return -1;
+	rtnl_queue(b, nlh);
+	return 0;
+}
+
+int rtnl_add_default_route(rtnl_batch_t *b, int ifindex, int family, const void *gateway) {
+	struct nlmsghdr *nlh = rtnl_request(b, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE, sizeof(struct rtmsg));
+	if(!nlh)
+		return -1;
+	struct rtmsg *rtm = NLMSG_DATA(nlh);
+	uint32_t oif = ifindex;
+	rtm->rtm_family = family;
+	rtm->rtm_table = RT_TABLE_MAIN;
+	rtm->rtm_protocol = RTPROT_STATIC;
+	rtm->rtm_type = RTN_UNICAST;
+	rtm->rtm_scope = gateway ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+	rtm->rtm_flags = gateway ? RTNH_F_ONLINK : 0; // the gateway may be outside of the assigned prefix
+	if(rtnl_attr(b, nlh, RTA_OIF, &oif, sizeof(oif)) ||
+		(gateway && rtnl_attr(b, nlh, RTA_GATEWAY, gateway, RTNL_ADDR_LEN(family))))
+		return -1;
+	rtnl_queue(b, nlh);
+	return 0;
+}
+
+int rtnl_batch_commit(rtnl_batch_t *b) {
+	struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+	unsigned char buf[8192];
+	unsigned int acked = 0;
+	int ret = 0;
+
+	if(!b->count)
+		return 0;
+	if(sendto(b->fd, b->buf, b->len, 0, (struct sockaddr *)&kernel, sizeof(kernel))<0)
+		return -errno;
+	while(acked<b->count) {
+		ssize_t n = recv(b->fd, buf, sizeof(buf), 0);
+		if(n<0) {
+			if(errno==EINTR)
+				continue;
+			ret = -errno;
+			break;
+		}
+		for(struct nlmsghdr *nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, n); nlh = NLMSG_NEXT(nlh, n)) {
+			if(nlh->nlmsg_type!=NLMSG_ERROR || nlh->nlmsg_seq-b->seq_first>b->seq-b->seq_first)
+				continue;
+			int error = ((struct nlmsgerr *)NLMSG_DATA(nlh))->error;
+			if(error && !ret)
+				ret = error;
+			acked++;
+		}
+	}
+	b->len = 0;
+	b->count = 0;
+	b->seq_first = b->seq+1;
+	return ret;
+}
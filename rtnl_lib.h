@@ -0,0 +1,69 @@
+/*******************************************************************************
+// software distributed under freeBSD license as follow
+
+Copyright (c) 2018, Gemalto M2M
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the <project name> project.
+
+*******************************************************************************/
+
+#ifndef __RTNL_LIB_H__
+#define __RTNL_LIB_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* network device configuration through rtnetlink, without external tools.
+ * the requests are queued in a batch and sent in a single message, the kernel applies them in order
+ * and acknowledges each one: a link is configured in one round-trip */
+
+#define RTNL_BATCH_SIZE		(8192)
+
+typedef struct {
+	int fd;
+	uint32_t seq; // of the last queued request
+	uint32_t seq_first;
+	unsigned int count; // queued requests
+	size_t len;
+	unsigned char buf[RTNL_BATCH_SIZE];
+} rtnl_batch_t;
+
+typedef struct {
+	const void *addr; // 4 or 16 bytes, as the family
+	unsigned int prefix_len;
+} rtnl_addr_t;
+
+// all return 0=success, -1 or -errno
+int rtnl_batch_open(rtnl_batch_t *b);
+void rtnl_batch_close(rtnl_batch_t *b);
+int rtnl_flush_addresses(rtnl_batch_t *b, int ifindex, int family, const rtnl_addr_t *keep, unsigned int keep_count); // global scope ones but keep, read now and deleted by the batch
+int rtnl_flush_default_routes(rtnl_batch_t *b, int ifindex, int family); // the ones of rtnl_add_default_route
+int rtnl_set_link(rtnl_batch_t *b, int ifindex, uint32_t mtu, int up); // mtu 0: unchanged
+int rtnl_add_address(rtnl_batch_t *b, int ifindex, int family, const void *addr, unsigned int prefix_len);
+int rtnl_add_default_route(rtnl_batch_t *b, int ifindex, int family, const void *gateway); // NULL gateway: on the link
+int rtnl_batch_commit(rtnl_batch_t *b); // sends the batch, the first error of its requests
+
+#endif /* __RTNL_LIB_H__ */
@@ -35,6 +35,8 @@ either expressed or implied, of the <project name> project.
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <sys/eventfd.h>
 
 int loop_thread_process_idle(thread_params_t *tp) {
 	int ret = IDLE_CONTINUE_PROC;
@@ -59,30 +61,44 @@ void* thread_loop(void *v) {
 	thread_params_t *tp = v;
 	init_queue(&tp->sq);
 	init_queue(&tp->eq);
+	init_timing_wheel(&tp->timers, THREAD_TIMER_TICK_MSEC);
+	pthread_cond_init(&tp->sq_room, NULL);
 	int port = tp->fd;
 	unsigned char buf[THREAD_RECEIVE_BUFSIZE];
 	size_t offset=0;
 	size_t total=0;
-	struct pollfd fds[1];
+	struct pollfd fds[2];
 
 	if(tp->thread_created_notify)
 		tp->thread_created_notify(tp);
 
 	fds[0].fd = port;
 	fds[0].events = POLLIN | POLLERR | POLLHUP | POLLNVAL;
+	fds[1].fd = tp->wake_fd;
+	fds[1].events = POLLIN;
+	fds[1].revents = 0;
 	for(;;) {
-		int pollret = poll(fds, 1, tp->timeout_msec);
-		if(pollret>0) {
+		fds[0].fd = __atomic_load_n(&tp->input_paused, __ATOMIC_SEQ_CST) ? -1 : port; // poll ignores negative fds
+		int pollret = poll(fds, tp->wake_fd>=0 ? 2 : 1, tp->timeout_msec);
+		if(pollret>0 && (fds[1].revents & POLLIN)) { // commands waiting: as on a timeout, before the input if any
+			uint64_t count = 0;
+			if(read(tp->wake_fd, &count, sizeof(count))<0 && errno!=EAGAIN)
+				goto error;
+			for(uint64_t i=0;tp->thread_process_idle && i<count && i<THREAD_WAKE_MAX_IDLE;i++) // one cycle per submission
+				if(tp->thread_process_idle(tp)==IDLE_TERMINATE)
+					goto quit;
+		}
+		if(pollret>0 && fds[0].revents) {
 			if(fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
 				goto error;
 			else if(tp->notifyonly) {
 				tp->thread_process_input(tp, NULL, 0);
 			} else {
 				int ret;
-				ret=read(port, buf+offset, THREAD_RECEIVE_BUFSIZE-offset);
+				ret=read(port, buf+offset, THREAD_RECEIVE_BUFSIZE-offset-1); // keep room for the terminator
 				if(ret>0) {
 					total+=ret; // port statistics
-					buf[offset+ret]=0; // for text interfaces
+					buf[offset+ret]=0; // for text interfaces, binary interfaces use the size
 					if(tp->thread_process_input) {
 						size_t consumed = tp->thread_process_input(tp, buf, offset+ret);
 						offset = offset+ret-consumed;
@@ -98,8 +114,14 @@ void* thread_loop(void *v) {
 				ret = tp->thread_process_idle(tp);
 			if(ret==IDLE_TERMINATE)
 				goto quit;
-		} else
+		} else if(pollret<0)
 			goto error;
+		// expired commands are completed here, so that the next one can be sent without waiting for the poll timeout
+		pthread_mutex_lock(&tp->sq.lock);
+		int expired = run_timers(&tp->timers);
+		pthread_mutex_unlock(&tp->sq.lock);
+		if(expired && tp->thread_process_idle && tp->thread_process_idle(tp)==IDLE_TERMINATE)
+			goto quit;
 	}
 quit:
 	DBGT("regular exit. total bytes received: %lu", total)
@@ -113,6 +135,7 @@ error:
 end:
 	destroy_queue(&tp->sq);
 	destroy_queue(&tp->eq);
+	pthread_cond_destroy(&tp->sq_room);
 	if(tp->thread_exiting_notify)
 		tp->thread_exiting_notify(tp);
 	pthread_exit(&tp->retval);
@@ -121,7 +144,22 @@ end:
 
 int create_loop_thread(thread_params_t *tp) {
 	memset(&tp->tid, 0, sizeof(pthread_t));
-	return pthread_create(&tp->tid, NULL, thread_loop, tp);
+	tp->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); // kept for the life of tp: the clients may still write
+	if(pthread_create(&tp->tid, NULL, thread_loop, tp)) {
+		if(tp->wake_fd>=0)
+			close(tp->wake_fd);
+		tp->wake_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+void wake_loop_thread(thread_params_t *tp) {
+	uint64_t one = 1;
+	if(tp->wake_fd>=0) {
+		ssize_t ret = write(tp->wake_fd, &one, sizeof(one));
+		(void)ret; // EAGAIN: the counter is full, the loop is awake anyway
+	}
 }
 
 void loop_thread_created(thread_params_t *tp) {
@@ -133,6 +171,16 @@ void loop_thread_exiting(thread_params_t *tp) {
 	closeport(tp->fd, &tp->oldt);
 }
 
+// runs in the loop thread, with sq.lock
+static void command_timer_expired(timer_node_t *t, void *data) {
+	client_params_t *cp = data;
+	thread_params_t *tp = cp->tp_interface;
+	DBGC("command timeout")
+	if(cp->status==COMMAND_STATE_WAIT_ANSWER && tp->thread_cancel_notify)
+		tp->thread_cancel_notify(tp, cp); // as for a cancel: the late answer must not go to the next command
+	complete_command(tp, cp, COMMAND_STATE_TIMEOUT);
+}
+
 client_params_t *new_client_thread(const char *name, thread_params_t *interface) {
 	client_params_t *cp = calloc(1, sizeof(client_params_t));
 	pthread_cond_init(&cp->waitcond, NULL); // initialize waiting condition
@@ -140,16 +188,127 @@ client_params_t *new_client_thread(const char *name, thread_params_t *interface)
 	strncpy(cp->name, name, sizeof(cp->name));
 	cp->tp_interface = interface;
 	memset(&cp->tid, 0, sizeof(pthread_t));
+	cp->timeout_msec = COMMAND_DEFAULT_TIMEOUT_MSEC;
+	cp->timer.expired = command_timer_expired;
+	cp->timer.data = cp;
+	cp->priority = COMMAND_PRIORITY_INTERACTIVE;
 	return cp;
 }
 
-void send_command(void *cmd, client_params_t *cp) {
+static const void *command_flow(client_params_t *cp) {
+	return cp->flow ? cp->flow : cp;
+}
+
+static size_t flow_count(thread_params_t *tp, const void *flow) {
+	size_t count = 0;
+	queue_elem_t* p = tp->sq.head;
+	while(p && p->elem) {
+		if(command_flow(p->elem)==flow)
+			count++;
+		p=p->next;
+	}
+	return count;
+}
+
+// oldest command not sent yet, of the flow or of the port if flow is NULL, in the lowest class down to priority:
+// a command never evicts one of a higher class
+static client_params_t *oldest_waiting(thread_params_t *tp, const void *flow, int priority) {
+	for(int i=NUM_COMMAND_PRIORITIES-1;i>=priority;i--) {
+		queue_elem_t* p = tp->sq.head;
+		while(p && p->elem) {
+			client_params_t *cp = p->elem;
+			if(cp->status==COMMAND_STATE_WAIT_TO_SEND && cp->priority==i && (!flow || command_flow(cp)==flow))
+				return cp;
+			p=p->next;
+		}
+	}
+	return NULL;
+}
+
+// with sq.lock. 0 if the command can be queued
+static int admit_command(thread_params_t *tp, client_params_t *cp) {
+	struct timespec ts;
+	int timed = 0;
+	for(;;) {
+		const void *flow = NULL;
+		if(tp->queue_limit && tp->sq.count>=tp->queue_limit)
+			; // port full
+		else if(tp->flow_limit && flow_count(tp, command_flow(cp))>=tp->flow_limit)
+			flow = command_flow(cp);
+		else
+			return 0;
+		if(tp->queue_policy==QUEUE_POLICY_DROP_OLDEST) {
+			client_params_t *old = oldest_waiting(tp, flow, cp->priority);
+			if(!old)
+				return -1; // everything is in flight or of a higher class
+			DBGT("dropped: %s", old->name)
+			complete_command(tp, old, COMMAND_STATE_BUSY);
+		} else if(tp->queue_policy==QUEUE_POLICY_BLOCK) {
+			if(!timed) {
+				get_timeout_abstime(&ts, tp->queue_block_msec);
+				timed = 1;
+			}
+			if(pthread_cond_timedwait(&tp->sq_room, &tp->sq.lock, &ts)==ETIMEDOUT)
+				return -1;
+		} else
+			return -1;
+	}
+}
+
+// return 0=success: the command is queued, and cancel_command can withdraw it
+int submit_command(void *cmd, client_params_t *cp) {
+	thread_params_t *tp = cp->tp_interface;
+	sched_class_stats_t *st = &tp->sched.stats[cp->priority];
 	cp->command = cmd;
 	cp->status = COMMAND_STATE_WAIT_TO_SEND;
-	pthread_mutex_lock(&cp->waitmutex);
-	append_elem_to_queue(&cp->tp_interface->sq, cp);
+	cp->cost = tp->thread_command_cost ? tp->thread_command_cost(cp) : 1;
+	cp->sched_flow = -1;
+	cp->submit_msec = get_monotonic_msec();
+	pthread_mutex_lock(&tp->sq.lock);
+	if(admit_command(tp, cp)) {
+		pthread_mutex_unlock(&tp->sq.lock);
+		cp->status = COMMAND_STATE_BUSY;
+		DBGC("port busy")
+		return -1;
+	}
+	cp->command_seq = ++tp->command_seq;
+	append_elem_to_queue_nolock(&tp->sq, cp);
+	if(++st->depth>st->max_depth)
+		st->max_depth = st->depth;
+	if(cp->timeout_msec)
+		add_timer(&tp->timers, &cp->timer, cp->timeout_msec);
+	pthread_mutex_unlock(&tp->sq.lock);
+	wake_loop_thread(tp);
 	DBGC()
-	pthread_cond_wait(&cp->waitcond, &cp->waitmutex);
+	return 0;
+}
+
+// return 0=success
+int wait_command(client_params_t *cp) {
+	pthread_mutex_lock(&cp->waitmutex);
+	while(cp->status==COMMAND_STATE_WAIT_TO_SEND || cp->status==COMMAND_STATE_WAIT_ANSWER)
+		pthread_cond_wait(&cp->waitcond, &cp->waitmutex);
+	pthread_mutex_unlock(&cp->waitmutex);
+	return cp->status==COMMAND_STATE_DONE ? 0 : -1;
+}
+
+// return 0=success
+int send_command(void *cmd, client_params_t *cp) {
+	if(submit_command(cmd, cp))
+		return -1;
+	return wait_command(cp);
+}
+
+void complete_command(thread_params_t *tp, client_params_t *cp, int status) {
+	if(cp->status==COMMAND_STATE_WAIT_TO_SEND) // never sent
+		tp->sched.stats[cp->priority].depth--;
+	del_timer(&tp->timers, &cp->timer);
+	remove_elem_from_queue_nolock(&tp->sq, cp);
+	pthread_cond_broadcast(&tp->sq_room);
+	// the status changes under waitmutex, so that the wakeup can't be lost
+	pthread_mutex_lock(&cp->waitmutex);
+	cp->status = status;
+	pthread_cond_signal(&cp->waitcond);
 	pthread_mutex_unlock(&cp->waitmutex);
 }
 
@@ -161,8 +320,152 @@ void destroy_client_thread(client_params_t *cp) {
 
 void add_event_handler(thread_params_t *tp_interface, event_handler_t* eh) {
 	append_elem_to_queue(&tp_interface->eq, eh);
+	if(tp_interface->thread_event_handlers_changed)
+		tp_interface->thread_event_handlers_changed(tp_interface);
 }
 
 void remove_event_handler(thread_params_t *tp_interface, event_handler_t* eh) {
 	remove_elem_from_queue(&tp_interface->eq, eh);
+	if(tp_interface->thread_event_handlers_changed)
+		tp_interface->thread_event_handlers_changed(tp_interface);
+}
+
+// the waiter is released at once. if the command was already sent, the port drops or drains the late answer
+int cancel_command(client_params_t *cp) {
+	thread_params_t *tp = cp->tp_interface;
+	int ret = -1;
+	pthread_mutex_lock(&tp->sq.lock);
+	if(cp->status==COMMAND_STATE_WAIT_TO_SEND || cp->status==COMMAND_STATE_WAIT_ANSWER) {
+		if(cp->status==COMMAND_STATE_WAIT_ANSWER && tp->thread_cancel_notify)
+			tp->thread_cancel_notify(tp, cp);
+		complete_command(tp, cp, COMMAND_STATE_CANCELLED);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&tp->sq.lock);
+	return ret;
+}
+
+// scheduling ///////////////////////////////////////////////////////////////////
+
+// oldest waiting command of the flow
+static client_params_t *flow_head(thread_params_t *tp, int i) {
+	queue_elem_t* p = tp->sq.head;
+	while(p && p->elem) {
+		client_params_t *cp = p->elem;
+		if(cp->status==COMMAND_STATE_WAIT_TO_SEND && cp->sched_flow==i)
+			return cp;
+		p=p->next;
+	}
+	return NULL;
+}
+
+// slot of the flow in its class. when the table is full, the flow shares a slot of the same class. -1 if none
+static int assign_flow(command_sched_t *s, client_params_t *cp) {
+	const void *key = command_flow(cp);
+	int free_slot = -1, shared = -1;
+	for(int i=0;i<SCHED_MAX_FLOWS;i++) {
+		sched_flow_t *f = &s->flows[i];
+		if(!f->key) {
+			if(free_slot<0)
+				free_slot = i;
+		} else if(f->priority==cp->priority) {
+			if(f->key==key)
+				return i;
+			shared = i;
+		}
+	}
+	if(free_slot<0)
+		return shared;
+	s->flows[free_slot].key = key;
+	s->flows[free_slot].priority = cp->priority;
+	s->flows[free_slot].deficit = 0;
+	return free_slot;
+}
+
+static int next_flow_in_class(command_sched_t *s, int priority, int i) {
+	for(int n=0;n<SCHED_MAX_FLOWS;n++) {
+		i = (i+1)%SCHED_MAX_FLOWS;
+		if(s->flows[i].key && s->flows[i].priority==priority)
+			return i;
+	}
+	return -1;
+}
+
+// deficit round-robin: each flow of the class may send up to its deficit, refilled by a quantum when its turn comes
+static client_params_t *next_command_in_class(thread_params_t *tp, int priority) {
+	command_sched_t *s = &tp->sched;
+	int i = s->cursor[priority];
+	if(!s->flows[i].key || s->flows[i].priority!=priority) {
+		i = next_flow_in_class(s, priority, i);
+		if(i<0)
+			return NULL;
+		s->flows[i].deficit += SCHED_QUANTUM;
+	}
+	for(;;) {
+		sched_flow_t *f = &s->flows[i];
+		client_params_t *cp = flow_head(tp, i);
+		if(cp && (long)cp->cost<=f->deficit) {
+			s->cursor[priority] = i;
+			f->deficit -= cp->cost;
+			return cp;
+		}
+		if(!cp) // idle flows leave the rotation and lose their deficit
+			f->key = NULL;
+		i = next_flow_in_class(s, priority, i);
+		if(i<0)
+			return NULL;
+		s->flows[i].deficit += SCHED_QUANTUM;
+	}
+}
+
+client_params_t *next_command_to_send(thread_params_t *tp) {
+	command_sched_t *s = &tp->sched;
+	queue_elem_t* p = tp->sq.head;
+	while(p && p->elem) { // new commands join the rotation of their class
+		client_params_t *cp = p->elem;
+		if(cp->status==COMMAND_STATE_WAIT_TO_SEND && cp->sched_flow<0) {
+			cp->sched_flow = assign_flow(s, cp);
+			if(cp->sched_flow<0)
+				return cp; // the table is full of other classes: served at once
+		}
+		p=p->next;
+	}
+	for(int priority=0;priority<NUM_COMMAND_PRIORITIES;priority++) {
+		if(!s->stats[priority].depth)
+			continue;
+		client_params_t *cp = next_command_in_class(tp, priority);
+		if(cp)
+			return cp;
+	}
+	return NULL;
+}
+
+void command_sent(thread_params_t *tp, client_params_t *cp) {
+	sched_class_stats_t *st = &tp->sched.stats[cp->priority];
+	uint64_t wait = get_monotonic_msec()-cp->submit_msec;
+	cp->status = COMMAND_STATE_WAIT_ANSWER;
+	st->depth--;
+	st->sent++;
+	st->wait_total_msec += wait;
+	if(wait>st->wait_max_msec)
+		st->wait_max_msec = wait;
+}
+
+void print_command_stats(thread_params_t *tp) {
+	static const char *names[NUM_COMMAND_PRIORITIES] = {"control", "interactive", "bulk"};
+	pthread_mutex_lock(&tp->sq.lock);
+	for(int priority=0;priority<NUM_COMMAND_PRIORITIES;priority++) {
+		sched_class_stats_t *st = &tp->sched.stats[priority];
+		DBGT("%-11s depth %lu (max %lu), sent %lu, wait avg %lu max %lu msec", names[priority],
+			(unsigned long)st->depth, (unsigned long)st->max_depth, (unsigned long)st->sent,
+			(unsigned long)(st->sent ? st->wait_total_msec/st->sent : 0), (unsigned long)st->wait_max_msec)
+	}
+	pthread_mutex_unlock(&tp->sq.lock);
+}
+
+void set_command_queue_limits(thread_params_t *tp, size_t queue_limit, size_t flow_limit, int policy, long block_msec) {
+	tp->queue_limit = queue_limit;
+	tp->flow_limit = flow_limit;
+	tp->queue_policy = policy;
+	tp->queue_block_msec = block_msec;
 }
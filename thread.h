@@ -49,8 +49,38 @@ enum command_types {
 enum command_states {
 	COMMAND_STATE_WAIT_TO_SEND	= 1,
 	COMMAND_STATE_WAIT_ANSWER	= 2,
+	COMMAND_STATE_DONE		= 3, // final states: the client is woken up
+	COMMAND_STATE_TIMEOUT		= 4,
+	COMMAND_STATE_CANCELLED		= 5,
+	COMMAND_STATE_BUSY		= 6, // rejected or dropped by the admission control of the port
+	COMMAND_STATE_FAILED		= 7, // the port could not send it
 };
 
+// what send_command does when the port or the flow has reached its limit
+enum queue_policies {
+	QUEUE_POLICY_REJECT		= 0, // the new command fails with COMMAND_STATE_BUSY
+	QUEUE_POLICY_BLOCK		= 1, // the submitter waits for room, up to queue_block_msec, then as reject
+	QUEUE_POLICY_DROP_OLDEST	= 2, // the oldest command not sent yet of the lowest class, not above the new one, fails with COMMAND_STATE_BUSY
+};
+
+#define COMMAND_DEFAULT_TIMEOUT_MSEC	(30000) // from the submission, answer included
+
+// the highest class with waiting commands is served first, clients (flows) of the same class by deficit round-robin
+enum command_priorities {
+	COMMAND_PRIORITY_CONTROL	= 0, // connect, disconnect, init
+	COMMAND_PRIORITY_INTERACTIVE	= 1, // default
+	COMMAND_PRIORITY_BULK		= 2, // sms, phonebook dumps, scans, file transfers
+	NUM_COMMAND_PRIORITIES		= 3,
+};
+
+#define SCHED_MAX_FLOWS			(32) // additional flows share a slot of their class
+#define SCHED_QUANTUM			(256) // bytes per round and flow
+#define THREAD_TIMER_TICK_MSEC		(10)
+#define THREAD_WAKE_MAX_IDLE		(16) // idle cycles for a wakeup, the poll timeout does the rest
+#define THREAD_MBIM_MAX_CANCELLED	(16) // transaction ids whose late answer is dropped
+#define THREAD_MBIM_NETDEV_LEN		(16) // IFNAMSIZ
+#define EVENT_HANDLER_INLINE_BUDGET_MSEC (5) // the port does not read while an inline handler runs
+
 enum commands {
 	COMMAND_TERMINATE_THREAD	= 1,
 };
@@ -79,10 +109,33 @@ typedef struct {
 } thread_t;
 
 typedef struct thread_params_t thread_params_t;
+typedef struct client_params_t client_params_t;
+
+typedef struct {
+	const void *key; // NULL if free
+	int priority;
+	long deficit;
+} sched_flow_t;
+
+typedef struct {
+	size_t depth; // commands waiting to be sent
+	size_t max_depth;
+	uint64_t sent;
+	uint64_t wait_total_msec;
+	uint64_t wait_max_msec;
+} sched_class_stats_t;
+
+typedef struct {
+	sched_flow_t flows[SCHED_MAX_FLOWS];
+	int cursor[NUM_COMMAND_PRIORITIES]; // flow being served in each class
+	sched_class_stats_t stats[NUM_COMMAND_PRIORITIES];
+} command_sched_t;
+
 struct thread_params_t {
 	thread_t;
 	long timeout_msec;
 	int notifyonly;
+	int input_paused; // with __atomic: the port is read by another thread meanwhile (eg: the AT data mode)
 	int fd;
 	int retval;
 	struct termios oldt;
@@ -91,21 +144,50 @@ struct thread_params_t {
 	void (*thread_exiting_notify)(thread_params_t *tp);
 	size_t (*thread_process_input)(thread_params_t *tp, const unsigned char *buf, size_t size); // return processed bytes that can be removed from the buffer
 	int (*thread_process_idle)(thread_params_t *tp); // returns 0 if processing shall continue, otherwise special result
+	void (*thread_cancel_notify)(thread_params_t *tp, client_params_t *cp); // with sq.lock, for a command already sent
+	size_t (*thread_command_cost)(client_params_t *cp); // bytes on the wire, for the scheduler. 1 if NULL
 	queue_t sq; // sending queue --> cmdq (command queue)  (for the thread and for sending)
+	timing_wheel_t timers; // command deadlines, protected by sq.lock, run by the loop
+	command_sched_t sched; // protected by sq.lock
+	size_t queue_limit; // commands queued or in flight on the port, 0=unlimited
+	size_t flow_limit; // the same for each flow
+	int queue_policy; // queue_policies enum
+	long queue_block_msec;
+	pthread_cond_t sq_room; // with sq.lock, signaled when a command completes
+	int wake_fd; // eventfd, -1 if none: a new command wakes the loop up instead of waiting for the poll timeout
+	uint64_t command_seq; // last number given to a queued command, with sq.lock
 
 // add event_thread tp->queue, from another thread
 
 	queue_t eq; // event_handler queue -> to be moved to the event_loop thread associated with the port loop_thread
 	void (*thread_event_handler)(thread_params_t *tp, void *event);
+	void (*thread_event_handlers_changed)(thread_params_t *tp); // after add_event_handler and remove_event_handler
 
 // replace with default_modem for tty, under which there will be the interfaces
 	thread_params_t *tp_at;
 	thread_params_t *tp_mbim;
+	struct at_pool_t *at_pool; // AT commands are balanced on the pool if available, otherwise sent to tp_at
 
 // in thread_data_mbim_t
 	uint32_t mbim_sequence;
 	uint32_t mbim_MaxControlTransfer;
+	mbim_usb_limits_t mbim_limits; // from the USB descriptors, all 0 if unknown
 	mbim_frame_t *current; // for concatenation
+	uint32_t mbim_cancelled[THREAD_MBIM_MAX_CANCELLED]; // 0 if free
+	unsigned int mbim_cancelled_next;
+	struct mbim_state_t *mbim_state; // modem state mirror
+	struct mbim_procs_t *mbim_procs; // per modem state of the procedures (long running ones, settings to apply again)
+	int mbim_opened; // with eq.lock, as the subscription fields below
+	uint64_t mbim_subscribed; // MBIM_CID_BIT set active on the device
+	int mbim_resubscribing; // a client thread is pushing the subscribe list
+	struct mbim_handler_index_t *mbim_handlers; // eq by command code, published for the lockless dispatch
+	unsigned long mbim_dispatch_seq; // odd while the mbim thread reads mbim_handlers
+	struct mbim_handler_index_t *mbim_handlers_retired; // replaced during a dispatch, by the mbim thread itself
+	struct mbim_event_window_t *mbim_windows; // per command code
+	char mbim_netdev[THREAD_MBIM_NETDEV_LEN]; // data path of the sessions, with eq.lock. empty: not configured
+	uint64_t mbim_autoinit_msec; // plug time of an auto init until registered, 0 then
+	uint64_t mbim_registered_after_msec; // plug to registered, of the auto init
+	const char *mbim_autoconnect_apn; // once registered after the auto init, NULL: none
 
 // rename to td (thread_data)
 	void *ext;
@@ -170,7 +252,7 @@ typedef struct {
 	thread_params_t *tp_port;
 } procedure_params_t;
 
-typedef struct {
+struct client_params_t {
 	thread_t;
 	int cmd_type;
 	union {
@@ -183,13 +265,33 @@ typedef struct {
 	thread_params_t *tp_interface; // tp_port would be better
 	pthread_cond_t waitcond;
 	pthread_mutex_t waitmutex;
-} client_params_t;
+	long timeout_msec; // 0 for no timeout
+	timer_node_t timer;
+	int priority; // command_priorities enum
+	const void *flow; // commands with the same flow share the bandwidth of their class. NULL: the client itself
+	size_t cost;
+	int sched_flow; // slot in tp->sched, -1 until the port sees the command
+	uint64_t submit_msec;
+	uint64_t command_seq; // given by the port on submission: tells a new command of the same client from the previous one
+};
+
+// with a window set on their cid (mbim_set_event_window), the handlers can receive the events once per window
+enum event_deliveries {
+	EVENT_DELIVERY_EACH		= 0, // default: each event at once
+	EVENT_DELIVERY_LATEST		= 1, // the last event of the window
+	EVENT_DELIVERY_BATCH		= 2, // all the events of the window, to batch_function
+};
 
 typedef struct {
 	char handler_name[32]; // thread name will be handler_name+msg specific (sequence_id for mbim)
 	int cmd_code; // urc command type, for mbim
 	queue_elem_t *cmd_prefix; // urc prefix list for AT
 	void *(*thread_start_function)(void *thread_data);
+	void (*inline_function)(thread_params_t *tp, const void *event); // if set, runs on the port thread instead: must not block nor send commands
+	long inline_budget_msec; // a longer run is reported. 0: EVENT_HANDLER_INLINE_BUDGET_MSEC
+	unsigned long inline_overruns;
+	int delivery; // event_deliveries enum
+	void (*batch_function)(thread_params_t *tp, const void **events, unsigned int count); // inline, oldest first
 } event_handler_t;
 
 // LOOP thread
@@ -198,11 +300,22 @@ void loop_thread_created(thread_params_t *tp);
 void loop_thread_exiting(thread_params_t *tp);
 
 int create_thread(thread_params_t *tp);
+void wake_loop_thread(thread_params_t *tp); // from any thread: the idle processing runs at once
 
 // CLIENT thread -> COMMAND thread
 client_params_t *new_client_thread(const char *name, thread_params_t *interface);
-void send_command(void *cmd, client_params_t *cp);
+int send_command(void *cmd, client_params_t *cp); // 0=success, otherwise cp->status tells why
+int submit_command(void *cmd, client_params_t *cp); // send_command in two steps: queue the command,
+int wait_command(client_params_t *cp); // then wait for its completion
 void destroy_client_thread(client_params_t *cp);
+void complete_command(thread_params_t *tp, client_params_t *cp, int status); // call with sq.lock: dequeues and wakes up the client
+int cancel_command(client_params_t *cp); // from any thread. 0 if withdrawn, -1 if already completed
+
+// for the port threads, with sq.lock
+client_params_t *next_command_to_send(thread_params_t *tp); // NULL if nothing is waiting
+void command_sent(thread_params_t *tp, client_params_t *cp);
+void print_command_stats(thread_params_t *tp);
+void set_command_queue_limits(thread_params_t *tp, size_t queue_limit, size_t flow_limit, int policy, long block_msec);
 
 void add_event_handler(thread_params_t *tp_interface, event_handler_t* eh);
 void remove_event_handler(thread_params_t *tp_interface, event_handler_t* eh);
@@ -30,11 +30,23 @@ either expressed or implied, of the <project name> project.
 
 *******************************************************************************/
 
+#define _GNU_SOURCE // splice
 #include "thread_at.h"
+#include "at_lib.h"
 #include <string.h>
 #include <stdlib.h>
 #include <poll.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+
+#define AT_STREAM_CHUNK		(16*1024)
+#define AT_DATA_PIPE_SIZE	(64*1024)
+#define AT_ESCAPE_GUARD_MSEC	(1000) // silence before and after +++
+#define AT_DRAIN_TIMEOUT_MSEC	(5000) // for the final result of a cancelled command
+#define AT_MAX_LINE_LEN		(THREAD_RECEIVE_BUFSIZE/2) // longer lines are moved to the response without waiting for the \n
 
 #define NUM_AT_TERMINATORS	(10)
 const char *canonical_at_terminators[NUM_AT_TERMINATORS] = {
@@ -51,121 +63,525 @@ const char *canonical_at_terminators[NUM_AT_TERMINATORS] = {
 	// AT^SBNW errors not included here
 };
 
-// returns consumed
-size_t at_process_input(thread_params_t *tp, const unsigned char *buf, size_t size) {
-	size_t consumed = 0;
+static int at_is_terminator(const unsigned char *line, size_t len) {
+	for(int i=0;i<NUM_AT_TERMINATORS;i++)
+		if(at_line_starts_with(line, len, canonical_at_terminators[i]))
+			return 1;
+	return 0;
+}
 
-	int incomplete_answer = 0;
-	pthread_mutex_lock(&tp->sq.lock); {
-		queue_elem_t* p = tp->sq.head;
-		while(p && p->elem) {
-			client_params_t *cp = p->elem;
-			if(cp->status == COMMAND_STATE_WAIT_ANSWER) {
-				int i;
-				incomplete_answer = 1;
-				// looking for a line like: \r\n<term>[^\r]*\r\n
-				for(i=0;i<NUM_AT_TERMINATORS;i++) {
-					const unsigned char *pos = buf;
-					pos = strchr(pos, '\n');
-					while(pos && (pos-buf+1)<size) {
-						pos++;
-						if(strncmp(pos, canonical_at_terminators[i], strlen(canonical_at_terminators[i]))==0) {
-							size_t anslen;
-							pos = strchr(pos, '\n');
-							if(!pos || (pos-buf)>=size)
-								goto finished;
-							while(*pos == '\r' || *pos == '\n') // remove from the answer
-								pos--;
-							incomplete_answer = 0;
-							anslen = pos-buf+1;
-							cp->response = strndup(buf, anslen); // the string will be anslen+1 bytes with a null terminator
-							// ready to process the rest
-							buf+=anslen;
-							size-=anslen;
-							consumed+=anslen;
-							// remove command from the list, unlock condition
-							pthread_mutex_unlock((&tp->sq.lock));
-							remove_elem_from_queue(&tp->sq, cp);
-							pthread_mutex_lock((&tp->sq.lock));
-							pthread_cond_signal(&cp->waitcond);
-							goto finished;
-						}
-						pos = strchr(pos, '\n');
-					}
+// last decimal number of the line, for example 20 in "^SISR: 1,20"
+static size_t at_last_number(const unsigned char *line, size_t len) {
+	size_t v = 0, mult = 1;
+	while(len && (line[len-1]<'0' || line[len-1]>'9'))
+		len--;
+	while(len && line[len-1]>='0' && line[len-1]<='9') {
+		v += (line[len-1]-'0')*mult;
+		mult *= 10;
+		len--;
+	}
+	return v;
+}
+
+typedef struct {
+	int fd; // dup of the command payload_fd, or -1
+	unsigned char *buf;
+	size_t len;
+	int terminator;
+} at_payload_t;
+
+// zero-copy with sendfile() if the source allows it (regular files), otherwise read/write in chunks
+static int at_stream_payload(thread_params_t *tp, int fd, size_t len) {
+	unsigned char chunk[AT_STREAM_CHUNK];
+	int use_sendfile = 1;
+	size_t sent = 0;
+	while(!len || sent<len) {
+		size_t n = AT_STREAM_CHUNK;
+		ssize_t ret;
+		if(len && len-sent<n)
+			n = len-sent;
+		if(use_sendfile) {
+			if(wait_port(tp->fd, POLLOUT, tp->timeout_msec))
+				return -1;
+			ret = sendfile(tp->fd, fd, NULL, n);
+			if(ret>0) {
+				sent += ret;
+				continue;
+			} else if(ret==0)
+				break; // EOF
+			else if(errno==EAGAIN || errno==EINTR)
+				continue;
+			else if(errno!=EINVAL && errno!=ENOSYS)
+				return -1;
+			use_sendfile = 0;
+		}
+		ret = read(fd, chunk, n);
+		if(ret==0)
+			break; // EOF
+		if(ret<0) {
+			if(errno==EAGAIN && wait_port(fd, POLLIN, tp->timeout_msec)==0)
+				continue;
+			if(errno==EINTR)
+				continue;
+			return -1;
+		}
+		if(write_port(tp->fd, chunk, ret, tp->timeout_msec))
+			return -1;
+		sent += ret;
+	}
+	return 0;
+}
+
+// with sq.lock. the client thread may free the command while the payload is sent, so it is sent from a copy
+static int at_take_payload(at_command_t *cmd, at_payload_t *p) {
+	p->fd = -1;
+	p->buf = NULL;
+	p->len = cmd->payload_len;
+	p->terminator = cmd->payload_terminator;
+	if(cmd->payload_fd>=0)
+		p->fd = dup(cmd->payload_fd);
+	else if((p->buf = malloc(p->len ? p->len : 1)))
+		memcpy(p->buf, cmd->payload, p->len);
+	return (p->fd<0 && !p->buf) ? -1 : 0;
+}
+
+static void at_release_payload(at_payload_t *p) {
+	if(p->fd>=0)
+		close(p->fd);
+	free(p->buf);
+}
+
+// without sq.lock: a long upload must not block the clients queueing or cancelling commands
+static int at_send_payload(thread_params_t *tp, at_payload_t *p) {
+	int ret;
+	if(p->fd>=0)
+		ret = at_stream_payload(tp, p->fd, p->len);
+	else
+		ret = write_port(tp->fd, p->buf, p->len, tp->timeout_msec);
+	if(ret==0 && p->terminator>=0) {
+		unsigned char t = p->terminator;
+		ret = write_port(tp->fd, &t, 1, tp->timeout_msec);
+	}
+	return ret;
+}
+
+// call with sq.lock
+static client_params_t *at_get_waiting_command(thread_params_t *tp) {
+	queue_elem_t* p = tp->sq.head;
+	while(p && p->elem) {
+		client_params_t *cp = p->elem;
+		if(cp->status == COMMAND_STATE_WAIT_ANSWER)
+			return cp; // for AT commands, only 1 outstanding at a time
+		p=p->next;
+	}
+	return NULL;
+}
+
+// call with sq.lock
+static void at_complete_command(thread_params_t *tp, client_params_t *cp) {
+	at_response_t *resp = cp->response;
+	while(resp->len && (resp->buf[resp->len-1]=='\r' || resp->buf[resp->len-1]=='\n')) // remove from the answer
+		resp->buf[--resp->len] = 0;
+	complete_command(tp, cp, COMMAND_STATE_DONE);
+}
+
+// data mode ///////////////////////////////////////////////////////////////////
+
+typedef struct {
+	int escape[2]; // written by at_data_mode_escape, to leave the data mode
+	int data_mode; // with __atomic: set by the loop, cleared by the bridge
+	pthread_t data_tid; // the bridge, joinable while data_bridge is set
+	int data_bridge;
+	uint64_t data_up; // pty -> modem
+	uint64_t data_down; // modem -> pty
+	int drain; // final results still due to cancelled commands, protected by sq.lock
+	int escape_due; // ESC requested by a cancel, protected by sq.lock. the loop writes it without the lock
+	timer_node_t drain_timer;
+} thread_at_ext_t;
+
+// moves what is available on src to dst, zero-copy through the pipe with splice() if both fds support it.
+// returns the bytes moved, -1 on error or end of file
+static ssize_t at_data_forward(int src, int dst, int *pipefd, int *use_splice) {
+	unsigned char chunk[AT_STREAM_CHUNK];
+	ssize_t n, done = 0;
+	if(*use_splice) {
+		n = splice(src, NULL, pipefd[1], NULL, AT_STREAM_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(n<0 && errno==EINVAL)
+			*use_splice = 0; // the source does not support splice
+		else {
+			if(n<0)
+				return errno==EAGAIN || errno==EINTR ? 0 : -1;
+			if(n==0)
+				return -1;
+			while(done<n) {
+				ssize_t w = splice(pipefd[0], NULL, dst, NULL, n-done, SPLICE_F_MOVE);
+				if(w<0 && errno==EAGAIN && wait_port(dst, POLLOUT, AT_ESCAPE_GUARD_MSEC)==0)
+					continue;
+				if(w<0 && errno==EINVAL) { // the destination does not support splice: empty the pipe by hand
+					*use_splice = 0;
+					w = read(pipefd[0], chunk, n-done);
+					if(w<=0 || write_port(dst, chunk, w, AT_ESCAPE_GUARD_MSEC))
+						return -1;
 				}
-				break; // for AT commands, only 1 outstanding at a time
+				if(w<=0)
+					return -1;
+				done += w;
 			}
+			return n;
 		}
 	}
-finished:
+	n = read(src, chunk, sizeof(chunk));
+	if(n<0)
+		return errno==EAGAIN || errno==EINTR ? 0 : -1;
+	if(n==0 || write_port(dst, chunk, n, AT_ESCAPE_GUARD_MSEC))
+		return -1;
+	return n;
+}
+
+static void at_data_escape(thread_params_t *tp, int hangup) {
+	usleep(AT_ESCAPE_GUARD_MSEC*1000);
+	write_port(tp->fd, (const unsigned char *)"+++", 3, tp->timeout_msec);
+	usleep(AT_ESCAPE_GUARD_MSEC*1000);
+	if(hangup)
+		write_port(tp->fd, (const unsigned char *)"ATH\r", 4, tp->timeout_msec);
+}
+
+typedef struct {
+	thread_params_t *tp;
+	int pty;
+	size_t pending_size;
+	unsigned char pending[]; // the data received after CONNECT
+} at_data_bridge_t;
+
+// bridges the port and the pty until escape, loss of carrier or pty hangup.
+// it runs on its own thread: the loop keeps running the timers and the queue, without reading the port
+static void *at_data_mode(void *data) {
+	at_data_bridge_t *bridge = data;
+	thread_params_t *tp = bridge->tp;
+	thread_at_ext_t *ext = tp->ext;
+	int pty = bridge->pty;
+	int up[2] = {-1, -1}, down[2] = {-1, -1};
+	int splice_up = 1, splice_down = 1;
+	int slave_opened = 0, dcd = -1, modem_bits;
+	char c;
+
+	if(pipe(up) || pipe(down))
+		goto end;
+	fcntl(up[1], F_SETPIPE_SZ, AT_DATA_PIPE_SIZE); // best effort
+	fcntl(down[1], F_SETPIPE_SZ, AT_DATA_PIPE_SIZE);
+	while(read(ext->escape[0], &c, 1)>0); // old requests
+	if(ioctl(tp->fd, TIOCMGET, &modem_bits)==0)
+		dcd = (modem_bits & TIOCM_CAR) != 0; // not available on cmux channels and on some usb ports
+	ext->data_up = ext->data_down = 0;
+	if(bridge->pending_size && write_port(pty, bridge->pending, bridge->pending_size, tp->timeout_msec)==0)
+		ext->data_down += bridge->pending_size;
+	DBGT("data mode")
+
+	for(;;) {
+		struct pollfd fds[3];
+		fds[0].fd = tp->fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = slave_opened ? pty : -1; // the master reports POLLHUP until the slave is opened
+		fds[1].events = POLLIN;
+		fds[2].fd = ext->escape[0];
+		fds[2].events = POLLIN;
+		if(!slave_opened) {
+			struct pollfd p = { .fd = pty, .events = POLLIN };
+			if(poll(&p, 1, 0)>=0 && !(p.revents & POLLHUP))
+				slave_opened = 1;
+		}
+		int pollret = poll(fds, 3, tp->timeout_msec);
+		if(pollret<0) {
+			if(errno==EINTR)
+				continue;
+			break;
+		}
+		if(fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+			break;
+		if(fds[0].revents & POLLIN) {
+			ssize_t n = at_data_forward(tp->fd, pty, down, &splice_down);
+			if(n<0)
+				break;
+			ext->data_down += n;
+		}
+		if(fds[1].revents & POLLIN) {
+			ssize_t n = at_data_forward(pty, tp->fd, up, &splice_up);
+			if(n<0) {
+				DBGT("pty closed, hanging up")
+				at_data_escape(tp, 1);
+				break;
+			}
+			ext->data_up += n;
+		} else if(fds[1].revents & (POLLERR | POLLHUP)) {
+			DBGT("pty closed, hanging up")
+			at_data_escape(tp, 1);
+			break;
+		}
+		if(fds[2].revents & POLLIN) {
+			while(read(ext->escape[0], &c, 1)>0);
+			at_data_escape(tp, 0);
+			break;
+		}
+		if(dcd==1 && ioctl(tp->fd, TIOCMGET, &modem_bits)==0 && !(modem_bits & TIOCM_CAR)) {
+			DBGT("carrier lost")
+			break;
+		}
+	}
+end:
+	DBGT("command mode. data up: %lu, down: %lu", (unsigned long)ext->data_up, (unsigned long)ext->data_down)
+	if(up[0]>=0) { close(up[0]); close(up[1]); }
+	if(down[0]>=0) { close(down[0]); close(down[1]); }
+	close(pty);
+	free(bridge);
+	__atomic_store_n(&ext->data_mode, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&tp->input_paused, 0, __ATOMIC_SEQ_CST);
+	wake_loop_thread(tp); // the port is read by the loop again
+	return NULL;
+}
+
+// from the loop thread, which stops reading the port until the bridge is done
+static void at_start_data_mode(thread_params_t *tp, int pty, const unsigned char *pending, size_t pending_size) {
+	thread_at_ext_t *ext = tp->ext;
+	at_data_bridge_t *bridge = malloc(sizeof(at_data_bridge_t)+pending_size);
+	if(ext->data_bridge) { // the previous session is over, since the loop reads the port again
+		pthread_join(ext->data_tid, NULL);
+		ext->data_bridge = 0;
+	}
+	bridge->tp = tp;
+	bridge->pty = pty;
+	bridge->pending_size = pending_size;
+	memcpy(bridge->pending, pending, pending_size);
+	__atomic_store_n(&ext->data_mode, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&tp->input_paused, 1, __ATOMIC_SEQ_CST);
+	if(pthread_create(&ext->data_tid, NULL, at_data_mode, bridge)) {
+		DBGT("no data mode thread")
+		__atomic_store_n(&ext->data_mode, 0, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&tp->input_paused, 0, __ATOMIC_SEQ_CST);
+		close(pty);
+		free(bridge);
+		return;
+	}
+	ext->data_bridge = 1;
+}
+
+// cancellation //////////////////////////////////////////////////////////////////
+
+// with sq.lock. the port can't send anything else until the final result of the cancelled command
+static void at_cancel_notify(thread_params_t *tp, client_params_t *cp) {
+	thread_at_ext_t *ext = tp->ext;
+	at_command_t *cmd = cp->command;
+	if(cmd->prompt) // the payload phase is still due: ESC aborts it
+		ext->escape_due = 1;
+	ext->drain++;
+	add_timer(&tp->timers, &ext->drain_timer, AT_DRAIN_TIMEOUT_MSEC);
+	wake_loop_thread(tp); // a stalled port must not block the clients holding sq.lock: the loop writes the ESC
+}
+
+// with sq.lock. a partial payload: ESC makes the modem drop it, its final result is drained
+static void at_abort_payload(thread_params_t *tp, client_params_t *cp) {
+	thread_at_ext_t *ext = tp->ext;
+	ext->escape_due = 1;
+	at_cancel_notify(tp, cp);
+}
+
+// from the loop, without sq.lock
+static void at_write_escape_due(thread_params_t *tp) {
+	thread_at_ext_t *ext = tp->ext;
+	unsigned char esc = 0x1B;
+	int due;
+	pthread_mutex_lock(&tp->sq.lock);
+	due = ext->escape_due;
+	ext->escape_due = 0;
 	pthread_mutex_unlock(&tp->sq.lock);
+	if(due && write_port(tp->fd, &esc, 1, tp->timeout_msec))
+		DBGT("ESC not sent")
+}
 
-	if(incomplete_answer)
-		return consumed; // 0 for AT commands, since it is one at a time and no urc in the middle (for now)
+static void at_drain_expired(timer_node_t *t, void *data) {
+	thread_params_t *tp = data;
+	thread_at_ext_t *ext = tp->ext;
+	DBGT("%d final results never came", ext->drain)
+	ext->drain = 0;
+}
 
-	// skip blanks
-	while(size && (*buf=='\n' || *buf=='\r')) {
-		buf++;
-		consumed++;
-		size--;
+// a final result without a waiting command: 1 if it belongs to a cancelled command
+static int at_drain_line(thread_params_t *tp, const unsigned char *line, size_t len) {
+	thread_at_ext_t *ext = tp->ext;
+	int drained = 0;
+	if(!at_is_terminator(line, len))
+		return 0;
+	pthread_mutex_lock(&tp->sq.lock);
+	if(ext->drain) {
+		drained = 1;
+		if(--ext->drain==0)
+			del_timer(&tp->timers, &ext->drain_timer);
 	}
-	// if a full line is present, it is an urc
-	const unsigned char *pos=strchr(buf,'\n');
-	while(size && pos) {
-		size_t urc_len=pos-buf;
-		char *urc = strndup(buf, urc_len);
+	pthread_mutex_unlock(&tp->sq.lock);
+	if(drained) {
+		DBGT("drained '%.*s'", (int)len, line)
+		if(at_line_starts_with(line, len, "CONNECT"))
+			at_data_escape(tp, 1); // nobody wants this connection
+	}
+	return drained;
+}
 
-		while(urc_len && buf[urc_len-1]=='\r') {
-			urc[urc_len-1]=0;
-			urc_len--;
+// urcs that at_lib knows are decoded, the others are only printed
+static void at_process_urc(thread_params_t *tp, const unsigned char *line, size_t len) {
+	static const char *reg_prefixes[] = { "+CREG:", "+CGREG:", "+CEREG:" };
+	at_reg_t reg;
+	at_cpin_t cpin;
+	DBGT("URC>'%.*s'", (int)len, line);
+	for(int i=0;i<3;i++)
+		if(at_line_starts_with(line, len, reg_prefixes[i]) && at_parse_reg(line, len, reg_prefixes[i], &reg)==0) {
+			DBGT("%s stat %d, lac %lx, ci %lx, act %d", reg_prefixes[i], reg.stat, reg.lac, reg.ci, reg.act)
+			return;
 		}
-		DBGT("URC>'%s'", urc);
-		free(urc);
+	if(at_line_starts_with(line, len, "+CPIN:") && at_parse_cpin(line, len, &cpin)==0)
+		DBGT("sim: %s", cpin.code)
+}
 
-		urc_len = pos-buf+1;
-		buf+=urc_len;
-		consumed+=urc_len;
-		size-=urc_len;
+// returns consumed. raw data in the buffer: no 0 terminator assumed
+size_t at_process_input(thread_params_t *tp, const unsigned char *buf, size_t size) {
+	size_t consumed = 0;
+	int pty = -1;
+	client_params_t *cp;
 
-		// skip blanks
-		while(size && (*buf=='\n' || *buf=='\r')) {
-			buf++;
-			consumed++;
-			size--;
+	pthread_mutex_lock(&tp->sq.lock);
+	cp = at_get_waiting_command(tp);
+	while(cp && size) {
+		at_command_t *cmd = cp->command;
+		at_response_t *resp = cp->response;
+		if(cmd->phase == AT_PHASE_RX_BODY) {
+			size_t n = size<cmd->rx_remaining ? size : cmd->rx_remaining;
+			if(cmd->rx_fd<0)
+				at_append_response(resp, buf, n);
+			else if(write_port(cmd->rx_fd, buf, n, tp->timeout_msec))
+				DBGT("rx body: %lu bytes lost", n)
+			buf+=n;
+			size-=n;
+			consumed+=n;
+			cmd->rx_remaining-=n;
+			if(!cmd->rx_remaining)
+				cmd->phase = AT_PHASE_COMMAND;
+			continue;
+		}
+		if(cmd->prompt) { // the prompt has no line terminator: look for it at the beginning of a line
+			size_t blanks = 0, plen = strlen(cmd->prompt);
+			while(blanks<size && (buf[blanks]=='\r' || buf[blanks]=='\n'))
+				blanks++;
+			if(size-blanks>=plen && memcmp(buf+blanks, cmd->prompt, plen)==0) {
+				at_append_response(resp, buf, blanks+plen);
+				buf+=blanks+plen;
+				size-=blanks+plen;
+				consumed+=blanks+plen;
+				at_payload_t payload;
+				uint64_t seq = cp->command_seq; // cp may be completed and reused by its client meanwhile
+				int ret;
+				cmd->prompt = NULL; // only one payload phase
+				ret = at_take_payload(cmd, &payload);
+				pthread_mutex_unlock(&tp->sq.lock);
+				if(ret==0)
+					ret = at_send_payload(tp, &payload);
+				at_release_payload(&payload);
+				pthread_mutex_lock(&tp->sq.lock);
+				cp = at_get_waiting_command(tp);
+				if(ret && cp && cp->command_seq==seq) {
+					DBGT("payload not sent")
+					at_abort_payload(tp, cp);
+					complete_command(tp, cp, COMMAND_STATE_FAILED);
+					cp = NULL;
+				}
+				continue;
+			}
+		}
+		const unsigned char *eol = at_find_line_end(buf, size);
+		if(!eol) {
+			if(size>=AT_MAX_LINE_LEN) { // do not block the receive buffer
+				at_append_response(resp, buf, size);
+				consumed+=size;
+				size=0;
+			}
+			break; // incomplete answer
 		}
-		pos=strchr(buf,'\n'); // look for the next
+		size_t linelen = eol-buf+1;
+		const unsigned char *line = buf;
+		size_t len = linelen;
+		while(len && (*line=='\r' || *line=='\n')) {
+			line++;
+			len--;
+		}
+		while(len && (line[len-1]=='\r' || line[len-1]=='\n'))
+			len--;
+		at_append_response(resp, buf, linelen);
+		buf+=linelen;
+		size-=linelen;
+		consumed+=linelen;
+		if(!len)
+			continue;
+		if(cmd->rx_prefix && at_line_starts_with(line, len, cmd->rx_prefix)) {
+			cmd->rx_remaining = cmd->rx_len ? cmd->rx_len : at_last_number(line, len);
+			if(cmd->rx_remaining)
+				cmd->phase = AT_PHASE_RX_BODY;
+		} else if(at_is_terminator(line, len)) {
+			if(cmd->pty_fd>=0 && at_line_starts_with(line, len, "CONNECT")) {
+				pty = cmd->pty_fd; // owned by the data mode from now on
+				cmd->pty_fd = -1;
+			}
+			at_complete_command(tp, cp);
+			cp = NULL;
+		}
+	}
+	pthread_mutex_unlock(&tp->sq.lock);
+
+	if(pty>=0) { // the rest of the buffer is already data
+		at_start_data_mode(tp, pty, buf, size);
+		return consumed+size;
+	}
+
+	if(cp)
+		return consumed; // incomplete answer, no urc in the middle (for now)
+
+	// if a full line is present, it is an urc
+	const unsigned char *eol;
+	while(size && (eol=at_find_line_end(buf, size))) {
+		size_t linelen = eol-buf+1;
+		const unsigned char *line = buf;
+		size_t len = linelen;
+		while(len && (*line=='\r' || *line=='\n')) {
+			line++;
+			len--;
+		}
+		while(len && (line[len-1]=='\r' || line[len-1]=='\n'))
+			len--;
+		if(len && !at_drain_line(tp, line, len))
+			at_process_urc(tp, line, len);
+		buf+=linelen;
+		consumed+=linelen;
+		size-=linelen;
 	}
 	return consumed;
 }
 
 int at_process_idle(thread_params_t *tp) {
+	thread_at_ext_t *ext = tp->ext;
+	client_params_t *cp;
+	at_write_escape_due(tp); // before anything else is sent, the drain holds the queue meanwhile
 	pthread_mutex_lock(&tp->sq.lock); {
-		queue_elem_t* p = tp->sq.head;
-		while(p && p->elem) {
-			client_params_t *cp = p->elem;
-			if(cp->status != COMMAND_STATE_WAIT_TO_SEND) // status == COMMAND_STATE_WAIT_ANSWER
-				goto finished; // for AT interface, no multiple sending
-			else {
-				struct pollfd fds[1];
-				int pollret;
-				fds[0].fd = tp->fd;
-				fds[0].events = POLLOUT | POLLERR | POLLHUP | POLLNVAL;
-				size_t bufsize = strlen(cp->command);
-				size_t written = 0;
-				while(written<bufsize) {
-					pollret = poll(fds, 1, tp->timeout_msec);
-					if(pollret>0) {
-						if(fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
-							goto finished; // do not process error here, the reading poll will do it
-						written += write(tp->fd, cp->command+written, bufsize-written);
-					} else if(pollret<0)
-						goto finished;
-					// else in case of timeout, just repeat
-				}
-				cp->status = COMMAND_STATE_WAIT_ANSWER;
-				goto finished; // one command sending for cycle
-			}
-			p=p->next;
+		if(__atomic_load_n(&ext->data_mode, __ATOMIC_SEQ_CST))
+			goto finished; // the port belongs to the data mode bridge
+		if(ext->drain)
+			goto finished; // the modem is still busy with a cancelled command
+		if(at_get_waiting_command(tp))
+			goto finished; // for AT interface, no multiple sending
+		cp = next_command_to_send(tp);
+		if(cp) {
+			at_command_t *cmd = cp->command;
+			if(!cp->response)
+				cp->response = at_new_response();
+			cmd->phase = AT_PHASE_COMMAND;
+			if(write_port(tp->fd, cmd->data, cmd->len, tp->timeout_msec))
+				goto finished;
+			command_sent(tp, cp); // one command sending for cycle
 		}
 	}
 finished:
@@ -173,22 +589,182 @@ finished:
 	return IDLE_FINISHED_PROC;
 }
 
-thread_params_t *create_at_thread(const char *portname) {
-	thread_params_t *tp = (thread_params_t *)calloc(1, sizeof(thread_params_t));
-	strncpy(tp->name, portname, sizeof(tp->name));
-	tp->fd = openport(portname, &tp->oldt, &tp->newt);
-	if(tp->fd<0)
+// command line and payload bytes, for the scheduler
+static size_t at_command_cost(client_params_t *cp) {
+	at_command_t *cmd = cp->command;
+	return cmd->len + (cmd->payload_fd>=0 && !cmd->payload_len ? AT_STREAM_CHUNK : cmd->payload_len);
+}
+
+static void at_thread_exiting(thread_params_t *tp) {
+	thread_at_ext_t *ext = tp->ext;
+	if(ext && ext->data_bridge) {
+		at_data_mode_escape(tp);
+		pthread_join(ext->data_tid, NULL);
+	}
+	loop_thread_exiting(tp);
+	if(ext) {
+		close(ext->escape[0]);
+		close(ext->escape[1]);
+		free(ext);
+		tp->ext = NULL;
+	}
+}
+
+static thread_params_t *start_at_thread(thread_params_t *tp) {
+	thread_at_ext_t *ext = calloc(1, sizeof(thread_at_ext_t));
+	tp->ext = ext;
+	ext->drain_timer.expired = at_drain_expired;
+	ext->drain_timer.data = tp;
+	if(pipe2(ext->escape, O_NONBLOCK)) {
+		ext->escape[0] = ext->escape[1] = -1;
 		goto error;
+	}
 	tp->timeout_msec = 100; // standard interval between at commands
 	tp->thread_created_notify = loop_thread_created;
-	tp->thread_exiting_notify = loop_thread_exiting;
+	tp->thread_exiting_notify = at_thread_exiting;
 	tp->thread_process_input = at_process_input;
 	tp->thread_process_idle = at_process_idle;
+	tp->thread_cancel_notify = at_cancel_notify;
+	tp->thread_command_cost = at_command_cost;
+	set_command_queue_limits(tp, 32, 8, QUEUE_POLICY_REJECT, 0); // only one command at a time in flight
 	if(create_loop_thread(tp) != 0)
 		goto error;
 	return tp;
 error:
-	loop_thread_exiting(tp);
+	at_thread_exiting(tp);
 	free(tp);
 	return NULL;
 }
+
+thread_params_t *create_at_thread(const char *portname) {
+	thread_params_t *tp = (thread_params_t *)calloc(1, sizeof(thread_params_t));
+	strncpy(tp->name, portname, sizeof(tp->name));
+	tp->fd = openport(portname, &tp->oldt, &tp->newt);
+	if(tp->fd<0) {
+		free(tp);
+		return NULL;
+	}
+	return start_at_thread(tp);
+}
+
+// for channels that are not a tty (eg: a cmux dlc)
+thread_params_t *create_at_thread_fd(const char *name, int fd) {
+	thread_params_t *tp = (thread_params_t *)calloc(1, sizeof(thread_params_t));
+	strncpy(tp->name, name, sizeof(tp->name));
+	tp->fd = fd;
+	tcgetattr(fd, &tp->oldt); // no effect if not a tty
+	return start_at_thread(tp);
+}
+
+int at_probe_port(const char *portname) {
+	struct termios oldt, newt;
+	char resp[128];
+	size_t len = 0;
+	int found = 0;
+	int fd = openport(portname, &oldt, &newt);
+	if(fd<0)
+		return 0;
+	tcflush(fd, TCIOFLUSH);
+	if(write_port(fd, (const unsigned char *)"AT\r", 3, 100)==0) {
+		for(int i=0;i<5 && len<sizeof(resp)-1 && !found;i++) { // 500 msec
+			struct pollfd fds[1];
+			fds[0].fd = fd;
+			fds[0].events = POLLIN;
+			if(poll(fds, 1, 100)>0) {
+				ssize_t n = read(fd, resp+len, sizeof(resp)-1-len);
+				if(n>0)
+					len += n;
+			}
+			resp[len] = 0;
+			found = strstr(resp, "OK")!=NULL;
+		}
+	}
+	closeport(fd, &oldt);
+	return found;
+}
+
+at_pool_t *create_at_pool() {
+	at_pool_t *pool = calloc(1, sizeof(at_pool_t));
+	init_queue(&pool->ports);
+	return pool;
+}
+
+void at_pool_add_port(at_pool_t *pool, thread_params_t *tp) {
+	if(!tp)
+		return;
+	if(!pool->tp_urc)
+		pool->tp_urc = tp;
+	else
+		append_elem_to_queue(&pool->ports, tp);
+}
+
+thread_params_t *at_pool_get_port(at_pool_t *pool) {
+	thread_params_t *best = NULL;
+	size_t best_count = 0;
+	pthread_mutex_lock(&pool->ports.lock); {
+		queue_elem_t* p = pool->ports.head;
+		while(p && p->elem) {
+			thread_params_t *tp = p->elem;
+			size_t count;
+			pthread_mutex_lock(&tp->sq.lock);
+			count = tp->sq.count; // commands outstanding or waiting
+			pthread_mutex_unlock(&tp->sq.lock);
+			if(at_in_data_mode(tp)) {
+				p=p->next;
+				continue; // busy until the data mode is left
+			}
+			if(!best || count<best_count) {
+				best = tp;
+				best_count = count;
+			}
+			p=p->next;
+		}
+	}
+	pthread_mutex_unlock(&pool->ports.lock);
+	return best ? best : pool->tp_urc;
+}
+
+int at_in_data_mode(thread_params_t *tp) {
+	thread_at_ext_t *ext = tp->ext;
+	return ext && __atomic_load_n(&ext->data_mode, __ATOMIC_SEQ_CST);
+}
+
+// return 0 if the port was in data mode
+int at_data_mode_escape(thread_params_t *tp) {
+	thread_at_ext_t *ext = tp->ext;
+	if(!at_in_data_mode(tp))
+		return -1;
+	return write(ext->escape[1], "e", 1)==1 ? 0 : -1;
+}
+
+// return 0 if a port of the pool was in data mode
+int at_pool_escape(at_pool_t *pool) {
+	int ret;
+	if(!pool->tp_urc)
+		return -1; // no port yet
+	ret = at_data_mode_escape(pool->tp_urc);
+	pthread_mutex_lock(&pool->ports.lock); {
+		queue_elem_t* p = pool->ports.head;
+		while(p && p->elem) {
+			if(at_data_mode_escape(p->elem)==0)
+				ret = 0;
+			p=p->next;
+		}
+	}
+	pthread_mutex_unlock(&pool->ports.lock);
+	return ret;
+}
+
+void at_pool_print_stats(at_pool_t *pool) {
+	if(!pool->tp_urc)
+		return; // no port yet
+	print_command_stats(pool->tp_urc);
+	pthread_mutex_lock(&pool->ports.lock); {
+		queue_elem_t* p = pool->ports.head;
+		while(p && p->elem) {
+			print_command_stats(p->elem);
+			p=p->next;
+		}
+	}
+	pthread_mutex_unlock(&pool->ports.lock);
+}
@@ -36,5 +36,25 @@ either expressed or implied, of the <project name> project.
 #include "thread.h"
 
 thread_params_t *create_at_thread(const char *portname);
+thread_params_t *create_at_thread_fd(const char *name, int fd);
+
+int at_probe_port(const char *portname); // 1 if the port answers to AT
+
+// data mode: entered by a command with pty_fd after CONNECT, left on escape (+++), loss of carrier or pty hangup
+int at_in_data_mode(thread_params_t *tp);
+int at_data_mode_escape(thread_params_t *tp);
+
+// AT port pool of a modem: commands go to the least busy port, one port is reserved for URCs
+typedef struct at_pool_t at_pool_t;
+struct at_pool_t {
+	queue_t ports; // thread_params_t
+	thread_params_t *tp_urc; // used for commands only if there is no other port
+};
+
+at_pool_t *create_at_pool();
+void at_pool_add_port(at_pool_t *pool, thread_params_t *tp); // the first port is reserved for URCs
+thread_params_t *at_pool_get_port(at_pool_t *pool); // ports in data mode are skipped
+int at_pool_escape(at_pool_t *pool);
+void at_pool_print_stats(at_pool_t *pool);
 
 #endif /* __THREAD_AT_H__ */
@@ -0,0 +1,475 @@
+/*******************************************************************************
+// software distributed under freeBSD license as follow
+
+Copyright (c) 2018, Gemalto M2M
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the <project name> project.
+
+*******************************************************************************/
+
+#include "thread_cmux.h"
+#include "thread_at.h"
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#define CMUX_FLAG		0xF9
+#define CMUX_EA			0x01
+#define CMUX_CR			0x02
+#define CMUX_PF			0x10
+
+#define CMUX_MAX_N1		(1509)
+#define CMUX_T1_MSEC		(300) // acknowledgement timer
+#define CMUX_N2			(3) // maximum number of retransmissions
+
+enum cmux_frame_types {
+	CMUX_SABM	= 0x2F,
+	CMUX_UA		= 0x63,
+	CMUX_DM		= 0x0F,
+	CMUX_DISC	= 0x43,
+	CMUX_UIH	= 0xEF,
+	CMUX_UI		= 0x03,
+};
+
+// control channel messages (dlci 0), without EA and C/R bits
+enum cmux_control_types {
+	CMUX_CTRL_TEST	= 0x20,
+	CMUX_CTRL_FCOFF	= 0x60,
+	CMUX_CTRL_FCON	= 0xA0,
+	CMUX_CTRL_CLD	= 0xC0,
+	CMUX_CTRL_MSC	= 0xE0,
+};
+
+// V.24 signals in MSC
+#define CMUX_V24_FC		0x02
+#define CMUX_V24_RTC		0x04
+#define CMUX_V24_RTR		0x08
+#define CMUX_V24_DV		0x80
+
+typedef struct {
+	thread_params_t *tp_mux;
+	int dlci;
+	int fd; // mux side of the channel, the other side belongs to the AT thread
+	int peer_fd; // the other side while no AT thread owns it (channel not opened)
+	int flow_stopped; // FC from the modem
+	int uplink; // tid is running
+	pthread_t tid; // uplink: channel -> port
+	thread_params_t *tp_at;
+} cmux_dlc_t;
+
+typedef struct {
+	int num_dlc;
+	size_t n1;
+	pthread_mutex_t write_lock; // frames are written by the loop thread and by the uplink threads
+	pthread_mutex_t state_lock;
+	pthread_cond_t state_cond;
+	uint32_t open_mask; // UA received, by dlci
+	uint32_t dm_mask; // DM received, by dlci
+	int flow_stopped; // FCoff from the modem
+	int closing; // the uplink threads must not wait for the flow control anymore
+	cmux_dlc_t dlc[CMUX_MAX_DLC+1];
+} thread_cmux_ext_t;
+
+static unsigned char crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void cmux_init_crc_table() {
+	for(int i=0;i<256;i++) {
+		unsigned char crc = i;
+		for(int j=0;j<8;j++)
+			crc = (crc&1) ? (crc>>1)^0xE0 : crc>>1; // x^8+x^2+x+1, reversed
+		crc_table[i] = crc;
+	}
+}
+
+static unsigned char cmux_fcs(const unsigned char *buf, size_t len) {
+	unsigned char crc = 0xFF;
+	while(len--)
+		crc = crc_table[crc ^ *buf++];
+	return 0xFF-crc;
+}
+
+// return 0=success
+static int cmux_send_frame(thread_params_t *tp, int dlci, unsigned char control, const unsigned char *info, size_t len) {
+	thread_cmux_ext_t *mux = tp->ext;
+	unsigned char frame[CMUX_MAX_N1+7];
+	size_t hlen = len>127 ? 4 : 3; // address, control, length on 1 or 2 bytes
+	unsigned char type = control & ~CMUX_PF;
+	int ret;
+	if(len>CMUX_MAX_N1)
+		return -1;
+	frame[0] = CMUX_FLAG;
+	// the host is the initiator: C/R set for commands, cleared for responses
+	frame[1] = (dlci<<2) | ((type==CMUX_UA || type==CMUX_DM) ? 0 : CMUX_CR) | CMUX_EA;
+	frame[2] = control;
+	if(hlen==3)
+		frame[3] = (len<<1) | CMUX_EA;
+	else {
+		frame[3] = (len<<1) & 0xFE;
+		frame[4] = len>>7;
+	}
+	if(len)
+		memcpy(frame+1+hlen, info, len);
+	frame[1+hlen+len] = cmux_fcs(frame+1, type==CMUX_UIH ? hlen : hlen+len);
+	frame[2+hlen+len] = CMUX_FLAG;
+	pthread_mutex_lock(&mux->write_lock);
+	ret = write_port(tp->fd, frame, 3+hlen+len, tp->timeout_msec);
+	pthread_mutex_unlock(&mux->write_lock);
+	return ret;
+}
+
+static int cmux_send_msc(thread_params_t *tp, int dlci) {
+	unsigned char msc[4] = {
+		CMUX_CTRL_MSC | CMUX_CR | CMUX_EA,
+		(2<<1) | CMUX_EA,
+		(dlci<<2) | CMUX_CR | CMUX_EA,
+		CMUX_V24_RTC | CMUX_V24_RTR | CMUX_V24_DV | CMUX_EA
+	};
+	return cmux_send_frame(tp, 0, CMUX_UIH, msc, sizeof(msc));
+}
+
+static void cmux_process_control(thread_params_t *tp, const unsigned char *info, size_t len) {
+	thread_cmux_ext_t *mux = tp->ext;
+	while(len>=2) {
+		unsigned char type = info[0];
+		size_t vlen = info[1]>>1; // control messages are short: 1 byte length
+		const unsigned char *v = info+2;
+		if(!(info[1]&CMUX_EA) || 2+vlen>len)
+			return;
+		if(type & CMUX_CR) { // command from the modem: process it, then acknowledge with the same content
+			unsigned char resp[2+vlen];
+			pthread_mutex_lock(&mux->state_lock);
+			switch(type & 0xFC) {
+			case CMUX_CTRL_MSC:
+				if(vlen>=2 && (v[0]>>2)>0 && (v[0]>>2)<=mux->num_dlc)
+					mux->dlc[v[0]>>2].flow_stopped = (v[1] & CMUX_V24_FC) ? 1 : 0;
+				break;
+			case CMUX_CTRL_FCOFF:
+				mux->flow_stopped = 1;
+				break;
+			case CMUX_CTRL_FCON:
+				mux->flow_stopped = 0;
+				break;
+			case CMUX_CTRL_CLD:
+				DBGT("multiplexer closed by the modem")
+				mux->open_mask = 0;
+				break;
+			}
+			pthread_cond_broadcast(&mux->state_cond);
+			pthread_mutex_unlock(&mux->state_lock);
+			memcpy(resp, info, 2+vlen);
+			resp[0] &= ~CMUX_CR;
+			cmux_send_frame(tp, 0, CMUX_UIH, resp, 2+vlen);
+		} // else response to one of our commands: nothing to do
+		info += 2+vlen;
+		len -= 2+vlen;
+	}
+}
+
+static void cmux_process_frame(thread_params_t *tp, int dlci, unsigned char control, const unsigned char *info, size_t len) {
+	thread_cmux_ext_t *mux = tp->ext;
+	if(dlci>mux->num_dlc) {
+		DBGT("frame on unknown dlc %d dropped", dlci)
+		return; // the state masks have a bit per opened channel only
+	}
+	switch(control & ~CMUX_PF) {
+	case CMUX_UA:
+	case CMUX_DM:
+		pthread_mutex_lock(&mux->state_lock);
+		if((control & ~CMUX_PF)==CMUX_UA)
+			mux->open_mask |= 1<<dlci;
+		else {
+			mux->dm_mask |= 1<<dlci;
+			mux->open_mask &= ~(1<<dlci);
+		}
+		pthread_cond_broadcast(&mux->state_cond);
+		pthread_mutex_unlock(&mux->state_lock);
+		break;
+	case CMUX_DISC:
+		pthread_mutex_lock(&mux->state_lock);
+		mux->open_mask &= ~(1<<dlci);
+		pthread_mutex_unlock(&mux->state_lock);
+		cmux_send_frame(tp, dlci, CMUX_UA | CMUX_PF, NULL, 0);
+		break;
+	case CMUX_UIH:
+	case CMUX_UI:
+		if(dlci==0)
+			cmux_process_control(tp, info, len);
+		else if(mux->dlc[dlci].fd>=0) {
+			if(write_port(mux->dlc[dlci].fd, info, len, tp->timeout_msec))
+				DBGT("dlc %d: %lu bytes lost", dlci, len)
+		}
+		break;
+	}
+}
+
+// returns consumed
+size_t cmux_process_input(thread_params_t *tp, const unsigned char *buf, size_t size) {
+	size_t consumed = 0;
+	for(;;) {
+		const unsigned char *f;
+		size_t avail, hlen = 3, len;
+		while(consumed<size && buf[consumed]!=CMUX_FLAG) // sync on the opening flag
+			consumed++;
+		while(size-consumed>=2 && buf[consumed+1]==CMUX_FLAG) // closing flag of the previous frame
+			consumed++;
+		f = buf+consumed;
+		avail = size-consumed;
+		if(avail<4)
+			return consumed;
+		len = f[3]>>1;
+		if(!(f[3]&CMUX_EA)) {
+			if(avail<5)
+				return consumed;
+			len |= f[4]<<7;
+			hlen = 4;
+		}
+		if(len>CMUX_MAX_N1) { // not a frame start
+			consumed++;
+			continue;
+		}
+		if(avail<1+hlen+len+2)
+			return consumed; // incomplete frame
+		unsigned char control = f[2];
+		unsigned char type = control & ~CMUX_PF;
+		if(f[2+hlen+len]!=CMUX_FLAG || cmux_fcs(f+1, type==CMUX_UIH ? hlen : hlen+len)!=f[1+hlen+len]) {
+			consumed++; // corrupted: resync
+			continue;
+		}
+		cmux_process_frame(tp, f[1]>>2, control, f+1+hlen, len);
+		consumed += 1+hlen+len+1; // the closing flag is left, it can be the opening flag of the next frame
+	}
+}
+
+// return 0=success
+static int cmux_open_dlc(thread_params_t *tp, int dlci) {
+	thread_cmux_ext_t *mux = tp->ext;
+	uint32_t mask = 1<<dlci;
+	int ret;
+	pthread_mutex_lock(&mux->state_lock);
+	mux->dm_mask &= ~mask;
+	for(int i=0;i<CMUX_N2 && !((mux->open_mask|mux->dm_mask)&mask);i++) {
+		struct timespec ts;
+		cmux_send_frame(tp, dlci, CMUX_SABM | CMUX_PF, NULL, 0);
+		get_timeout_abstime(&ts, CMUX_T1_MSEC);
+		while(!((mux->open_mask|mux->dm_mask)&mask))
+			if(pthread_cond_timedwait(&mux->state_cond, &mux->state_lock, &ts))
+				break;
+	}
+	ret = (mux->open_mask&mask) ? 0 : -1;
+	pthread_mutex_unlock(&mux->state_lock);
+	return ret;
+}
+
+static void *cmux_uplink_thread(void *data) {
+	cmux_dlc_t *dlc = data;
+	thread_params_t *tp = dlc->tp_mux;
+	thread_cmux_ext_t *mux = tp->ext;
+	unsigned char buf[CMUX_MAX_N1];
+	for(;;) {
+		ssize_t n = read(dlc->fd, buf, mux->n1);
+		if(n<0 && errno==EINTR)
+			continue;
+		if(n<=0)
+			break; // channel closed
+		pthread_mutex_lock(&mux->state_lock);
+		while((mux->flow_stopped || dlc->flow_stopped) && !mux->closing)
+			pthread_cond_wait(&mux->state_cond, &mux->state_lock);
+		pthread_mutex_unlock(&mux->state_lock);
+		if(mux->closing)
+			break;
+		if(cmux_send_frame(tp, dlc->dlci, CMUX_UIH, buf, n))
+			break;
+	}
+	return NULL;
+}
+
+// switch the port to multiplexer mode. return 0=success
+static int cmux_negotiate(thread_params_t *tp) {
+	const char *cmd = "AT+CMUX=0\r";
+	char resp[256];
+	size_t len = 0;
+	if(write_port(tp->fd, (const unsigned char *)cmd, strlen(cmd), tp->timeout_msec))
+		return -1;
+	for(int i=0;i<50 && len<sizeof(resp)-1;i++) { // 5 seconds
+		struct pollfd fds[1];
+		fds[0].fd = tp->fd;
+		fds[0].events = POLLIN;
+		if(poll(fds, 1, 100)>0) {
+			ssize_t n = read(tp->fd, resp+len, sizeof(resp)-1-len);
+			if(n>0)
+				len += n;
+		}
+		resp[len] = 0;
+		if(strstr(resp, "\r\nOK\r\n"))
+			return 0;
+		if(strstr(resp, "ERROR"))
+			return -1;
+	}
+	return -1;
+}
+
+void cmux_thread_exiting(thread_params_t *tp) {
+	DBGT()
+	thread_cmux_ext_t *mux = tp->ext;
+	unsigned char cld[2] = { CMUX_CTRL_CLD | CMUX_CR | CMUX_EA, CMUX_EA };
+	// stop the uplink threads before their fds are closed: shutdown() wakes up the blocked reads
+	pthread_mutex_lock(&mux->state_lock);
+	mux->closing = 1;
+	pthread_cond_broadcast(&mux->state_cond);
+	pthread_mutex_unlock(&mux->state_lock);
+	for(int dlci=1;dlci<=mux->num_dlc;dlci++) {
+		cmux_dlc_t *dlc = &mux->dlc[dlci];
+		if(dlc->fd>=0)
+			shutdown(dlc->fd, SHUT_RDWR); // the AT thread gets a hangup
+		if(dlc->uplink)
+			pthread_join(dlc->tid, NULL);
+		dlc->uplink = 0;
+	}
+	for(int dlci=mux->num_dlc;dlci>0;dlci--) {
+		if(mux->open_mask & (1<<dlci))
+			cmux_send_frame(tp, dlci, CMUX_DISC | CMUX_PF, NULL, 0);
+		if(mux->dlc[dlci].fd>=0)
+			close(mux->dlc[dlci].fd);
+		if(mux->dlc[dlci].peer_fd>=0)
+			close(mux->dlc[dlci].peer_fd);
+		mux->dlc[dlci].fd = -1;
+		mux->dlc[dlci].peer_fd = -1;
+	}
+	cmux_send_frame(tp, 0, CMUX_UIH, cld, sizeof(cld));
+	loop_thread_exiting(tp);
+}
+
+// the loop stops once the multiplexer is closing
+static int cmux_process_idle(thread_params_t *tp) {
+	thread_cmux_ext_t *mux = tp->ext;
+	int closing;
+	pthread_mutex_lock(&mux->state_lock);
+	closing = mux->closing;
+	pthread_mutex_unlock(&mux->state_lock);
+	return closing ? IDLE_TERMINATE : IDLE_CONTINUE_PROC;
+}
+
+// from the creator, if the channels could not be opened: the loop leaves the multiplexer mode and closes the port
+static void cmux_close(thread_params_t *tp) {
+	thread_cmux_ext_t *mux = tp->ext;
+	pthread_mutex_lock(&mux->state_lock);
+	mux->closing = 1;
+	pthread_mutex_unlock(&mux->state_lock);
+	wake_loop_thread(tp);
+	pthread_join(tp->tid, NULL);
+	close(tp->wake_fd);
+}
+
+thread_params_t *create_cmux_thread(const char *portname, int num_dlc) {
+	char name[64];
+	if(num_dlc<1 || num_dlc>CMUX_MAX_DLC)
+		return NULL;
+	pthread_once(&crc_table_once, cmux_init_crc_table);
+	thread_params_t *tp = (thread_params_t *)calloc(1, sizeof(thread_params_t));
+	thread_cmux_ext_t *mux = calloc(1, sizeof(thread_cmux_ext_t));
+	tp->ext = mux;
+	for(int dlci=0;dlci<=CMUX_MAX_DLC;dlci++) {
+		mux->dlc[dlci].fd = -1;
+		mux->dlc[dlci].peer_fd = -1;
+	}
+	strncpy(tp->name, portname, sizeof(tp->name));
+	tp->fd = openport(portname, &tp->oldt, &tp->newt);
+	if(tp->fd<0)
+		goto error;
+	tp->timeout_msec = 100;
+	if(cmux_negotiate(tp)) {
+		DBGT(REDCOLOR"AT+CMUX refused"NOCOLOR)
+		goto error;
+	}
+	mux->num_dlc = num_dlc;
+	mux->n1 = CMUX_DEFAULT_N1;
+	pthread_mutex_init(&mux->write_lock, NULL);
+	pthread_mutex_init(&mux->state_lock, NULL);
+	pthread_cond_init(&mux->state_cond, NULL);
+	// the channels are set up before the loop thread starts, which then only reads them
+	for(int dlci=1;dlci<=num_dlc;dlci++) {
+		cmux_dlc_t *dlc = &mux->dlc[dlci];
+		int sv[2];
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+			goto error;
+		dlc->tp_mux = tp;
+		dlc->dlci = dlci;
+		dlc->fd = sv[0];
+		dlc->peer_fd = sv[1];
+	}
+	tp->thread_created_notify = loop_thread_created;
+	tp->thread_exiting_notify = cmux_thread_exiting;
+	tp->thread_process_input = cmux_process_input;
+	tp->thread_process_idle = cmux_process_idle; // only to stop: uplink is done by the channel threads
+	if(create_loop_thread(tp) != 0)
+		goto error;
+
+	if(cmux_open_dlc(tp, 0)) {
+		DBGT(REDCOLOR"no answer on the control channel"NOCOLOR)
+		goto close;
+	}
+	for(int dlci=1;dlci<=num_dlc;dlci++) {
+		cmux_dlc_t *dlc = &mux->dlc[dlci];
+		if(cmux_open_dlc(tp, dlci)) {
+			DBGT("dlc %d not opened", dlci)
+			if(dlci==1)
+				goto close; // no channel at all
+			break;
+		}
+		cmux_send_msc(tp, dlci);
+		snprintf(name, sizeof(name), "%s:dlc%d", portname, dlci);
+		dlc->tp_at = create_at_thread_fd(name, dlc->peer_fd);
+		dlc->peer_fd = -1;
+		dlc->uplink = pthread_create(&dlc->tid, NULL, cmux_uplink_thread, dlc)==0;
+	}
+	return tp;
+error:
+	for(int dlci=1;dlci<=num_dlc;dlci++) {
+		if(mux->dlc[dlci].fd>=0)
+			close(mux->dlc[dlci].fd);
+		if(mux->dlc[dlci].peer_fd>=0)
+			close(mux->dlc[dlci].peer_fd);
+	}
+	loop_thread_exiting(tp);
+	goto end;
+close:
+	cmux_close(tp);
+end:
+	free(mux);
+	free(tp);
+	return NULL;
+}
+
+thread_params_t *cmux_get_channel(thread_params_t *tp_mux, int dlci) {
+	thread_cmux_ext_t *mux = tp_mux->ext;
+	if(dlci<1 || dlci>mux->num_dlc)
+		return NULL;
+	return mux->dlc[dlci].tp_at;
+}
@@ -33,10 +33,35 @@ either expressed or implied, of the <project name> project.
 #include "thread_mbim.h"
 #include "mbim_lib.h"
 #include "mbim_procs.h"
+#include "mbim_state.h"
 #include <stdlib.h>
 #include <string.h>
 #include <poll.h>
 #include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+
+// event handlers by command code, immutable once published: the handlers of cc are eh[first[cc]] to eh[first[cc+1]-1]
+typedef struct mbim_handler_index_t mbim_handler_index_t;
+struct mbim_handler_index_t {
+	mbim_handler_index_t *retired_next;
+	unsigned int first[MBIM_INVALID+1];
+	event_handler_t *eh[];
+};
+
+#define MBIM_EVENT_WINDOW_MAX_BATCH	(32) // the oldest events of a longer batch are dropped
+#define MBIM_EVENT_WINDOW_DEFAULT_MSEC	(1000) // on the cids that flap with the radio: SIGNAL_STATE, PACKET_SERVICE, REGISTER_STATE
+
+// events of one cid held for the handlers that do not take each of them
+typedef struct mbim_event_window_t mbim_event_window_t;
+struct mbim_event_window_t {
+	long window_msec; // 0: off
+	timer_node_t timer; // with sq.lock
+	int due; // set by the timer, with sq.lock
+	mbim_function_message_t *pending[MBIM_EVENT_WINDOW_MAX_BATCH]; // by the mbim thread only
+	unsigned int npending;
+	unsigned long dropped;
+};
 
 void discard_current_frame(thread_params_t *tp) {
 	if(!tp->current) // normal case
@@ -50,12 +75,166 @@ void discard_current_frame(thread_params_t *tp) {
 	tp->current=NULL;
 }
 
+// with sq.lock. the transaction id of a cancelled command, to drop its late answer
+static void mbim_cancel_notify(thread_params_t *tp, client_params_t *cp) {
+	queue_elem_t* p = tp->sq.head;
+	while(p && p->elem) {
+		client_params_t *other = p->elem;
+		if(other!=cp && other->status==COMMAND_STATE_WAIT_ANSWER && other->sequence_id==cp->sequence_id)
+			return; // coalesced query: the answer is still awaited by the others
+		p=p->next;
+	}
+	tp->mbim_cancelled[tp->mbim_cancelled_next++ % THREAD_MBIM_MAX_CANCELLED] = cp->sequence_id; // the oldest is forgotten
+}
+
+// late answers of cancelled commands are dropped by transaction id, before reassembly and copies
+static int mbim_drop_cancelled(thread_params_t *tp, const unsigned char *frame) {
+	uint32_t sequence_id = mbim_get_frame_sequence_id(frame);
+	uint32_t type = mbim_get_frame_msg_type(frame);
+	int dropped = 0;
+	if(!sequence_id)
+		return 0;
+	pthread_mutex_lock(&tp->sq.lock);
+	for(int i=0;i<THREAD_MBIM_MAX_CANCELLED;i++) {
+		if(tp->mbim_cancelled[i]!=sequence_id)
+			continue;
+		dropped = 1;
+		if(type==MBIM_OPEN_DONE || type==MBIM_CLOSE_DONE || type==MBIM_FUNCTION_ERROR_MSG ||
+				mbim_get_frame_current_fragment(frame)+1>=mbim_get_frame_fragments(frame))
+			tp->mbim_cancelled[i] = 0; // last fragment
+		break;
+	}
+	pthread_mutex_unlock(&tp->sq.lock);
+	return dropped;
+}
+
+// on the port thread, timed: the frames wait for it
+static void mbim_run_inline_handler(thread_params_t *tp, event_handler_t *eh, const mbim_function_message_t *msg) {
+	long budget = eh->inline_budget_msec ? eh->inline_budget_msec : EVENT_HANDLER_INLINE_BUDGET_MSEC;
+	uint64_t start = get_monotonic_msec();
+	eh->inline_function(tp, msg);
+	uint64_t elapsed = get_monotonic_msec()-start;
+	if(elapsed>(uint64_t)budget) {
+		eh->inline_overruns++;
+		DBGT(REDCOLOR"inline handler %s ran %lu msec (budget %ld, %lu times)"NOCOLOR, eh->handler_name,
+			(unsigned long)elapsed, budget, eh->inline_overruns)
+	}
+}
+
+// inline or on a new thread
+static void mbim_deliver_event(thread_params_t *tp, event_handler_t *eh, mbim_function_message_t *msg) {
+	if(eh->inline_function) {
+		mbim_run_inline_handler(tp, eh, msg);
+		return;
+	}
+	char name[64];
+	sprintf(name, "%s-%08X", eh->handler_name, msg->sequence_id);
+	client_params_t *cp = new_client_thread(name, tp);
+	cp->response = mbim_ref_function_message(msg); // shared by all the handlers, sequence_id even if it is 0
+	DBGT("spawn: %s", cp->name)
+	pthread_create(&cp->tid, NULL, eh->thread_start_function, cp);
+}
+
+// the handler index is read without lock between these: add and remove wait for the end
+static mbim_handler_index_t *mbim_dispatch_begin(thread_params_t *tp) {
+	__atomic_add_fetch(&tp->mbim_dispatch_seq, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&tp->mbim_handlers, __ATOMIC_ACQUIRE);
+}
+
+static void mbim_dispatch_end(thread_params_t *tp) {
+	__atomic_add_fetch(&tp->mbim_dispatch_seq, 1, __ATOMIC_SEQ_CST);
+	while(tp->mbim_handlers_retired) {
+		mbim_handler_index_t *idx = tp->mbim_handlers_retired;
+		tp->mbim_handlers_retired = idx->retired_next;
+		free(idx);
+	}
+}
+
+static void mbim_event_window_expired(timer_node_t *t, void *data) { // with sq.lock
+	mbim_event_window_t *w = data;
+	w->due = 1;
+}
+
+static void mbim_hold_event(thread_params_t *tp, enum mbim_command_code cc, mbim_function_message_t *msg, long window) {
+	mbim_event_window_t *w = &tp->mbim_windows[cc];
+	if(w->npending==MBIM_EVENT_WINDOW_MAX_BATCH) {
+		mbim_free_function_message(w->pending[0]);
+		memmove(w->pending, w->pending+1, (MBIM_EVENT_WINDOW_MAX_BATCH-1)*sizeof(w->pending[0]));
+		w->npending--;
+		w->dropped++;
+	}
+	w->pending[w->npending++] = mbim_ref_function_message(msg);
+	if(w->npending==1) { // opens the window
+		pthread_mutex_lock(&tp->sq.lock);
+		add_timer(&tp->timers, &w->timer, window);
+		pthread_mutex_unlock(&tp->sq.lock);
+	}
+}
+
+static void mbim_release_events(mbim_event_window_t *w) {
+	for(unsigned int i=0;i<w->npending;i++)
+		mbim_free_function_message(w->pending[i]);
+	w->npending = 0;
+}
+
+// from the idle processing: the events of the windows that expired go to their handlers
+static void mbim_flush_event_windows(thread_params_t *tp) {
+	uint64_t due = 0;
+	pthread_mutex_lock(&tp->sq.lock);
+	for(enum mbim_command_code cc=0;cc<MBIM_INVALID;cc++) {
+		if(tp->mbim_windows[cc].due) {
+			tp->mbim_windows[cc].due = 0;
+			due |= MBIM_CID_BIT(cc);
+		}
+	}
+	pthread_mutex_unlock(&tp->sq.lock);
+	if(!due)
+		return;
+	mbim_handler_index_t *idx = mbim_dispatch_begin(tp);
+	for(enum mbim_command_code cc=0;idx && cc<MBIM_INVALID;cc++) {
+		mbim_event_window_t *w = &tp->mbim_windows[cc];
+		if(!(due & MBIM_CID_BIT(cc)) || !w->npending)
+			continue;
+		for(unsigned int i=idx->first[cc];i<idx->first[cc+1];i++) {
+			event_handler_t *eh = idx->eh[i];
+			if(eh->delivery==EVENT_DELIVERY_LATEST)
+				mbim_deliver_event(tp, eh, w->pending[w->npending-1]);
+			else if(eh->delivery==EVENT_DELIVERY_BATCH && eh->batch_function) {
+				uint64_t start = get_monotonic_msec();
+				eh->batch_function(tp, (const void **)w->pending, w->npending);
+				if(get_monotonic_msec()-start>(uint64_t)(eh->inline_budget_msec ? eh->inline_budget_msec : EVENT_HANDLER_INLINE_BUDGET_MSEC)) {
+					eh->inline_overruns++;
+					DBGT(REDCOLOR"batch handler %s over budget (%lu times)"NOCOLOR, eh->handler_name, eh->inline_overruns)
+				}
+			} else if(eh->delivery==EVENT_DELIVERY_BATCH) { // no batch function: one by one
+				for(unsigned int j=0;j<w->npending;j++)
+					mbim_deliver_event(tp, eh, w->pending[j]);
+			}
+		}
+		mbim_release_events(w);
+	}
+	mbim_dispatch_end(tp);
+}
+
+// from any thread. events of cc are held up to window_msec for the handlers that do not take each of them.
+// 0 turns it off: the events held are delivered at the end of the current window
+void mbim_set_event_window(thread_params_t *tp, enum mbim_command_code cc, long window_msec) {
+	if(cc<MBIM_INVALID)
+		__atomic_store_n(&tp->mbim_windows[cc].window_msec, window_msec, __ATOMIC_RELAXED);
+}
+
 void process_mbim_frame(thread_params_t *tp, unsigned char *frame) {
 	DBGT()
 	print_mbim_frame(frame);
 	mbim_function_message_t *msg;
 	uint32_t header_len = sizeof(uint32_t)*5;
 
+	if(mbim_drop_cancelled(tp, frame)) {
+		DBGT("answer of a cancelled command. Delete.")
+		free(frame);
+		return;
+	}
+
 	// message fragmentation management. TODO: check that each fragment has the same type and sequence_id
 	uint32_t fragments = mbim_get_frame_fragments(frame);
 	if(fragments>1) {
@@ -117,52 +296,54 @@ void process_mbim_frame(thread_params_t *tp, unsigned char *frame) {
 		free(frame);
 	}
 
-	if(msg->sequence_id>0) { // look for a possible waiting thread
+	// the mirror is updated before the waiters are woken up, so that they find it current
+	if(msg->type==MBIM_OPEN_DONE || msg->type==MBIM_CLOSE_DONE) {
+		mbim_state_invalidate(tp->mbim_state);
+		pthread_mutex_lock(&tp->eq.lock);
+		tp->mbim_opened = msg->type==MBIM_OPEN_DONE; // the device starts without subscriptions
+		tp->mbim_subscribed = 0;
+		pthread_mutex_unlock(&tp->eq.lock);
+	} else
+		mbim_state_update(tp->mbim_state, msg);
+
+	if(msg->sequence_id>0) { // look for the waiting threads: more than one for coalesced queries
 		pthread_mutex_lock(&tp->sq.lock); {
+			int delivered = 0;
 			queue_elem_t* p = tp->sq.head;
 			while(p && p->elem) {
 				client_params_t *cp = p->elem;
+				p=p->next; // before completion, that removes the element
 				if(cp->status == COMMAND_STATE_WAIT_ANSWER && cp->sequence_id==msg->sequence_id) {
-					cp->response = msg;
-					msg = NULL;
-					// remove command from the list, unlock condition
-					pthread_mutex_unlock((&tp->sq.lock));
-					remove_elem_from_queue(&tp->sq, cp);
-					pthread_mutex_lock((&tp->sq.lock));
-					pthread_cond_signal(&cp->waitcond);
-					break;
+					cp->response = mbim_ref_function_message(msg); // shared by the coalesced waiters
+					complete_command(tp, cp, COMMAND_STATE_DONE);
+					delivered = 1;
 				}
-				p=p->next;
+			}
+			if(delivered) {
+				mbim_free_function_message(msg); // the waiters hold it now
+				msg = NULL;
 			}
 		}
 		pthread_mutex_unlock(&tp->sq.lock);
 
-	} else if(msg->type == MBIM_INDICATE_STATUS_MSG) { // look for a possible handler
-		int cmd_code = mbim_get_msg_cmd_code(msg);
-		pthread_mutex_lock(&tp->eq.lock); { // to prevent insertions and removal at this time
-			queue_elem_t* p = tp->eq.head;
-			while(p && p->elem) {
-				event_handler_t *eh = p->elem;
-				if(eh->cmd_code ==  cmd_code) {
-					char name[64];
-					sprintf(name, "%s-%08X", eh->handler_name, msg->sequence_id);
-					client_params_t *cp = new_client_thread(name, tp);
-					// need to copy because there can be several handlers
-					mbim_function_message_t *m = calloc(1, sizeof(mbim_function_message_t));
-					m->bin_buf = malloc(msg->size);
-					memcpy(m->bin_buf, msg->bin_buf, msg->size);
-					m->type = msg->type;
-					m->size = msg->size;
-					m->sequence_id = msg->sequence_id; // even if it is 0
-					cp->response = m;
-					DBGT("spawn: %s", cp->name)
-					pthread_create(&cp->tid, NULL, eh->thread_start_function, cp);
-				}
-				p=p->next;
+	} else if(msg->type == MBIM_INDICATE_STATUS_MSG) { // look for the handlers of this code
+		enum mbim_command_code cc = mbim_get_msg_cmd_code(msg);
+		mbim_handler_index_t *idx = mbim_dispatch_begin(tp);
+		if(idx && cc<MBIM_INVALID) {
+			int held = 0;
+			long window = __atomic_load_n(&tp->mbim_windows[cc].window_msec, __ATOMIC_RELAXED);
+			for(unsigned int i=idx->first[cc];i<idx->first[cc+1];i++) {
+				event_handler_t *eh = idx->eh[i];
+				if(window && eh->delivery!=EVENT_DELIVERY_EACH)
+					held = 1; // at the end of the window
+				else
+					mbim_deliver_event(tp, eh, msg);
 			}
+			if(held)
+				mbim_hold_event(tp, cc, msg, window);
 		}
-		pthread_mutex_unlock(&tp->eq.lock);
-		mbim_free_function_message(msg); // if unprocessed, delete (printed above)
+		mbim_dispatch_end(tp);
+		mbim_free_function_message(msg); // the handlers keep their references
 		msg=NULL;
 	}
 	if(msg) {
@@ -189,44 +370,68 @@ size_t mbim_process_input(thread_params_t *tp, const unsigned char *buf, size_t
 
 const char waitspinner[] = "-/|\\";
 
+// with sq.lock. an identical query already in flight answers for this one too: same uuid, cid and payload
+static int mbim_coalesce_query(thread_params_t *tp, client_params_t *cp) {
+	mbim_message_t *cmd = cp->command;
+	if(!mbim_message_is_query(cmd))
+		return 0;
+	queue_elem_t* p = tp->sq.head;
+	while(p && p->elem) {
+		client_params_t *inflight = p->elem;
+		mbim_message_t *icmd = inflight->command;
+		if(inflight->status==COMMAND_STATE_WAIT_ANSWER && icmd->type==MBIM_COMMAND_MSG && strcmp(icmd->hex_buf, cmd->hex_buf)==0) {
+			cp->sequence_id = inflight->sequence_id;
+			command_sent(tp, cp);
+			DBGT("%s coalesced with %s", cp->name, inflight->name)
+			return 1;
+		}
+		p=p->next;
+	}
+	return 0;
+}
+
+// about the bytes on the wire, for the scheduler: the message is hex formatted
+static size_t mbim_command_cost(client_params_t *cp) {
+	mbim_message_t *msg = cp->command;
+	return msg->hex_buf ? strlen(msg->hex_buf)/2 : 0; // OPEN and CLOSE have no payload
+}
+
 int mbim_process_idle(thread_params_t *tp) {
 	mbim_frame_t *frame = NULL;
+	mbim_flush_event_windows(tp);
 	pthread_mutex_lock(&tp->sq.lock); {
-		queue_elem_t* p = tp->sq.head;
-		while(p && p->elem) {
-			client_params_t *cp = p->elem;
-			if(cp->status == COMMAND_STATE_WAIT_TO_SEND) {
-				struct pollfd fds[1];
-				int pollret;
-				fds[0].fd = tp->fd;
-				fds[0].events = POLLOUT | POLLERR | POLLHUP | POLLNVAL;
-				frame = mbim_message_to_frames(cp->command, ++tp->mbim_sequence, tp->mbim_MaxControlTransfer);
-				cp->sequence_id=tp->mbim_sequence;
-				mbim_frame_t *f=frame;
-				int framenum=0;
-				while(f) {
-					print_mbim_frame(f->data);
-					size_t bufsize = mbim_get_frame_length(f->data);
-					size_t written = 0;
-					while(written<bufsize) {
-						pollret = poll(fds, 1, tp->timeout_msec);
-						if(pollret>0) {
-							if(fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
-								goto finished; // do not process error here, the reading poll will do it
-							}
-							written += write(tp->fd, f->data+written, bufsize-written);
-						} else if(pollret<0) {
-							goto finished;
+		client_params_t *cp;
+		while((cp = next_command_to_send(tp)) && mbim_coalesce_query(tp, cp))
+			; // coalesced queries cost nothing: look for a command to send
+		if(cp) {
+			struct pollfd fds[1];
+			int pollret;
+			fds[0].fd = tp->fd;
+			fds[0].events = POLLOUT | POLLERR | POLLHUP | POLLNVAL;
+			frame = mbim_message_to_frames(cp->command, ++tp->mbim_sequence, tp->mbim_MaxControlTransfer);
+			cp->sequence_id=tp->mbim_sequence;
+			mbim_frame_t *f=frame;
+			int framenum=0;
+			while(f) {
+				print_mbim_frame(f->data);
+				size_t bufsize = mbim_get_frame_length(f->data);
+				size_t written = 0;
+				while(written<bufsize) {
+					pollret = poll(fds, 1, tp->timeout_msec);
+					if(pollret>0) {
+						if(fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+							goto finished; // do not process error here, the reading poll will do it
 						}
-						// else in case of timeout, just repeat
+						written += write(tp->fd, f->data+written, bufsize-written);
+					} else if(pollret<0) {
+						goto finished;
 					}
-					cp->status = COMMAND_STATE_WAIT_ANSWER;
-					f=f->next;
-					framenum++;
+					// else in case of timeout, just repeat
 				}
-				goto finished; // one command sending for cycle
+				f=f->next;
+				framenum++;
 			}
-			p=p->next;
+			command_sent(tp, cp); // one command sending for cycle
 		}
 	}
 finished:
@@ -236,16 +441,161 @@ finished:
 	return IDLE_FINISHED_PROC;
 }
 
+// with eq.lock
+uint64_t mbim_wanted_subscriptions_nolock(thread_params_t *tp) {
+	uint64_t cids = mbim_state_subscriptions();
+	for(queue_elem_t* p = tp->eq.head;p && p->elem;p=p->next) {
+		event_handler_t *eh = p->elem;
+		if(eh->cmd_code>=0 && eh->cmd_code<MBIM_INVALID)
+			cids |= MBIM_CID_BIT(eh->cmd_code);
+	}
+	return cids & MBIM_NOTIFICATION_CIDS;
+}
+
+uint64_t mbim_wanted_subscriptions(thread_params_t *tp) {
+	pthread_mutex_lock(&tp->eq.lock);
+	uint64_t cids = mbim_wanted_subscriptions_nolock(tp);
+	pthread_mutex_unlock(&tp->eq.lock);
+	return cids;
+}
+
+// with eq.lock. one client thread at a time pushes the list, until it matches the handlers
+static void mbim_resync_subscriptions_nolock(thread_params_t *tp) {
+	if(!tp->mbim_opened || tp->mbim_resubscribing || mbim_wanted_subscriptions_nolock(tp)==tp->mbim_subscribed)
+		return;
+	tp->mbim_resubscribing = 1;
+	if(mbim_resubscribe(tp))
+		tp->mbim_resubscribing = 0;
+}
+
+// with eq.lock
+static mbim_handler_index_t *mbim_build_handler_index_nolock(thread_params_t *tp) {
+	unsigned int pos[MBIM_INVALID+1] = {0};
+	unsigned int n = 0;
+	queue_elem_t* p;
+	for(p = tp->eq.head;p && p->elem;p=p->next) {
+		event_handler_t *eh = p->elem;
+		if(eh->cmd_code>=0 && eh->cmd_code<MBIM_INVALID) {
+			pos[eh->cmd_code]++;
+			n++;
+		}
+	}
+	mbim_handler_index_t *idx = calloc(1, sizeof(mbim_handler_index_t)+n*sizeof(event_handler_t *));
+	for(int cc=0, first=0;cc<=MBIM_INVALID;cc++) { // counts to offsets
+		idx->first[cc] = first;
+		first += pos[cc];
+		pos[cc] = idx->first[cc];
+	}
+	for(p = tp->eq.head;p && p->elem;p=p->next) { // registration order within a code
+		event_handler_t *eh = p->elem;
+		if(eh->cmd_code>=0 && eh->cmd_code<MBIM_INVALID)
+			idx->eh[pos[eh->cmd_code]++] = eh;
+	}
+	return idx;
+}
+
+// with eq.lock. returns the old index, for mbim_retire_handler_index
+static mbim_handler_index_t *mbim_publish_handler_index_nolock(thread_params_t *tp) {
+	return __atomic_exchange_n(&tp->mbim_handlers, mbim_build_handler_index_nolock(tp), __ATOMIC_SEQ_CST);
+}
+
+// without eq.lock, that an inline handler of the running dispatch may take.
+// on return no dispatch sees the old index, so the removed handler can be freed by the caller
+static void mbim_retire_handler_index(thread_params_t *tp, mbim_handler_index_t *old) {
+	unsigned long seq = __atomic_load_n(&tp->mbim_dispatch_seq, __ATOMIC_SEQ_CST);
+	if(!old)
+		return;
+	if(seq & 1) { // a dispatch is running
+		if(pthread_equal(pthread_self(), tp->tid)) { // from within it: freed when it ends
+			old->retired_next = tp->mbim_handlers_retired;
+			tp->mbim_handlers_retired = old;
+			return;
+		}
+		while(__atomic_load_n(&tp->mbim_dispatch_seq, __ATOMIC_ACQUIRE)==seq)
+			sched_yield();
+	}
+	free(old);
+}
+
+static void mbim_event_handlers_changed(thread_params_t *tp) {
+	mbim_handler_index_t *old;
+	pthread_mutex_lock(&tp->eq.lock);
+	old = mbim_publish_handler_index_nolock(tp);
+	mbim_resync_subscriptions_nolock(tp);
+	pthread_mutex_unlock(&tp->eq.lock);
+	mbim_retire_handler_index(tp, old);
+}
+
+void mbim_set_subscribed(thread_params_t *tp, uint64_t cids) {
+	pthread_mutex_lock(&tp->eq.lock);
+	tp->mbim_subscribed = cids;
+	mbim_resync_subscriptions_nolock(tp); // handlers changed meanwhile
+	pthread_mutex_unlock(&tp->eq.lock);
+}
+
+void mbim_set_netdev(thread_params_t *tp, const char *netdev) {
+	pthread_mutex_lock(&tp->eq.lock);
+	strncpy(tp->mbim_netdev, netdev, sizeof(tp->mbim_netdev)-1);
+	pthread_mutex_unlock(&tp->eq.lock);
+}
+
+int mbim_get_netdev(thread_params_t *tp, char netdev[THREAD_MBIM_NETDEV_LEN]) {
+	pthread_mutex_lock(&tp->eq.lock);
+	memcpy(netdev, tp->mbim_netdev, THREAD_MBIM_NETDEV_LEN);
+	pthread_mutex_unlock(&tp->eq.lock);
+	return netdev[0] ? 0 : -1;
+}
+
+static void mbim_thread_exiting(thread_params_t *tp) {
+	pthread_mutex_lock(&tp->sq.lock);
+	for(enum mbim_command_code cc=0;cc<MBIM_INVALID;cc++)
+		del_timer(&tp->timers, &tp->mbim_windows[cc].timer);
+	pthread_mutex_unlock(&tp->sq.lock);
+	for(enum mbim_command_code cc=0;cc<MBIM_INVALID;cc++)
+		mbim_release_events(&tp->mbim_windows[cc]);
+	pthread_mutex_lock(&tp->eq.lock);
+	free(__atomic_exchange_n(&tp->mbim_handlers, NULL, __ATOMIC_SEQ_CST)); // no more dispatch
+	while(tp->mbim_handlers_retired) {
+		mbim_handler_index_t *idx = tp->mbim_handlers_retired;
+		tp->mbim_handlers_retired = idx->retired_next;
+		free(idx);
+	}
+	pthread_mutex_unlock(&tp->eq.lock);
+	mbim_reconnect_forget(tp);
+	loop_thread_exiting(tp);
+}
+
 void mbim_thread_created(thread_params_t *tp) { // this function should be passed to create_mbim_thread
 	// register event handlers
 	event_handler_t* eh = calloc(1, sizeof(event_handler_t));
 	sprintf(eh->handler_name, "CONNECT");
 	eh->cmd_code = MBIM_CID_CONNECT;
-	eh->thread_start_function = mbim_event_connect;
+	eh->inline_function = mbim_event_connect;
+	add_event_handler(tp, eh);
+	eh = calloc(1, sizeof(event_handler_t));
+	sprintf(eh->handler_name, "REGISTER_STATE");
+	eh->cmd_code = MBIM_CID_REGISTER_STATE;
+	eh->inline_function = mbim_event_register_state;
 	add_event_handler(tp, eh);
 }
 
-thread_params_t *create_mbim_thread(const char *portname, uint32_t mbim_MaxControlTransfer) {
+// the sysfs descriptors of the USB device: "descriptors" of its syspath. return 0=success
+int mbim_read_usb_limits(const char *descriptors_path, mbim_usb_limits_t *limits) {
+	unsigned char *desc = malloc(THREAD_RECEIVE_BUFSIZE);
+	ssize_t len = -1;
+	int fd = open(descriptors_path, O_RDONLY | O_CLOEXEC);
+	if(fd>=0) {
+		len = read(fd, desc, THREAD_RECEIVE_BUFSIZE);
+		close(fd);
+	}
+	int ret = len>0 ? mbim_parse_usb_descriptors(desc, len, limits) : -1;
+	if(ret)
+		memset(limits, 0, sizeof(mbim_usb_limits_t));
+	free(desc);
+	return ret;
+}
+
+thread_params_t *create_mbim_thread(const char *portname, const mbim_usb_limits_t *limits) {
 	thread_params_t *tp = (thread_params_t *)calloc(1, sizeof(thread_params_t));
 	strncpy(tp->name, portname, sizeof(tp->name));
 	tp->fd = openport(portname, &tp->oldt, &tp->newt);
@@ -253,16 +603,39 @@ thread_params_t *create_mbim_thread(const char *portname, uint32_t mbim_MaxContr
 		goto error;
 	tp->timeout_msec = 10; // acceptable interval for mbim
 	tp->thread_created_notify = mbim_thread_created;
-	tp->thread_exiting_notify = loop_thread_exiting;
+	tp->thread_exiting_notify = mbim_thread_exiting;
 	tp->thread_process_input = mbim_process_input;
 	tp->thread_process_idle = mbim_process_idle;
-	tp->mbim_MaxControlTransfer = mbim_MaxControlTransfer;
+	tp->thread_cancel_notify = mbim_cancel_notify;
+	tp->thread_command_cost = mbim_command_cost;
+	tp->thread_event_handlers_changed = mbim_event_handlers_changed;
+	set_command_queue_limits(tp, 64, 16, QUEUE_POLICY_REJECT, 0);
+	if(limits)
+		tp->mbim_limits = *limits;
+	// the largest transfer of the device: fewer fragments for the long answers
+	tp->mbim_MaxControlTransfer = tp->mbim_limits.MaxControlMessage ? tp->mbim_limits.MaxControlMessage : MBIM_DEFAULT_MAX_CONTROL_TRANSFER;
+	DBGT("MaxControlTransfer %u, filters %u of %u bytes, mtu %u", tp->mbim_MaxControlTransfer, tp->mbim_limits.NumberFilters,
+		tp->mbim_limits.MaxFilterSize, tp->mbim_limits.MTU)
+	tp->mbim_state = mbim_state_new();
+	tp->mbim_procs = mbim_procs_new();
+	tp->mbim_windows = calloc(MBIM_INVALID, sizeof(mbim_event_window_t));
+	for(enum mbim_command_code cc=0;cc<MBIM_INVALID;cc++) {
+		tp->mbim_windows[cc].timer.expired = mbim_event_window_expired;
+		tp->mbim_windows[cc].timer.data = &tp->mbim_windows[cc];
+	}
+	// only the handlers with latest or batch delivery see the windows, the others still get each event
+	mbim_set_event_window(tp, MBIM_CID_SIGNAL_STATE, MBIM_EVENT_WINDOW_DEFAULT_MSEC);
+	mbim_set_event_window(tp, MBIM_CID_PACKET_SERVICE, MBIM_EVENT_WINDOW_DEFAULT_MSEC);
+	mbim_set_event_window(tp, MBIM_CID_REGISTER_STATE, MBIM_EVENT_WINDOW_DEFAULT_MSEC);
 	if(create_loop_thread(tp) != 0)
 		goto error;
 	return tp;
 error:
 	DBG(REDCOLOR"no mbim thread! make sure to be sudo"NOCOLOR);
 	loop_thread_exiting(tp);
+	mbim_state_free(tp->mbim_state);
+	mbim_procs_free(tp->mbim_procs);
+	free(tp->mbim_windows);
 	free(tp);
 	return NULL;
 }
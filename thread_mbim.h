@@ -34,7 +34,17 @@ either expressed or implied, of the <project name> project.
 #define __THREAD_MBIM_H__
 
 #include "thread.h"
-
-thread_params_t *create_mbim_thread(const char *portname, uint32_t mbim_MaxControlTransfer);
+#include "mbim_lib.h"
+
+thread_params_t *create_mbim_thread(const char *portname, const mbim_usb_limits_t *limits); // NULL: defaults
+int mbim_read_usb_limits(const char *descriptors_path, mbim_usb_limits_t *limits); // return 0=success
+
+// subscriptions: the cids wanted by the event handlers and by the state mirror (MBIM_CID_BIT set)
+uint64_t mbim_wanted_subscriptions(thread_params_t *tp);
+uint64_t mbim_wanted_subscriptions_nolock(thread_params_t *tp); // with eq.lock
+void mbim_set_event_window(thread_params_t *tp, enum mbim_command_code cc, long window_msec); // see event_deliveries
+void mbim_set_subscribed(thread_params_t *tp, uint64_t cids); // after a successful SET, pushes again if needed
+void mbim_set_netdev(thread_params_t *tp, const char *netdev); // configured with the ip parameters of the sessions
+int mbim_get_netdev(thread_params_t *tp, char netdev[THREAD_MBIM_NETDEV_LEN]); // return 0=success
 
 #endif /* __THREAD_MBIM_H__ */
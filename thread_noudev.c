@@ -49,9 +49,12 @@ we use:
 */
 ////////////////////////////////////////////////////////////////////////////////
 
+#include "freembim.h"
 #include "thread_udev.h"
 #include "thread_at.h"
+#include "thread_cmux.h"
 #include "thread_mbim.h"
+#include "mbim_procs.h"
 #include <string.h>
 #include <stdlib.h>
 #include <libudev.h>
@@ -93,12 +96,35 @@ extern thread_params_t *tp_tty; // temp hack
 int udev_process_idle(thread_params_t *tp) {
 	tp->thread_process_idle = NULL; // remove specific thread processing
 	char *atport = "/dev/ttyACM0"; // hardcoded, may need to be changed manually
-	DBGT("create AT loop for: %s", atport)
-	thread_params_t *tp2 = create_at_thread(atport);
-	tp_tty->tp_at = tp2;
+	thread_params_t *tp2 = NULL;
+	at_pool_t *pool = create_at_pool();
+	if(freembim_options.cmux_channels) {
+		DBGT("create CMUX loop for: %s", atport)
+		tp2 = create_cmux_thread(atport, freembim_options.cmux_channels);
+		for(int dlci=1;tp2 && dlci<=freembim_options.cmux_channels;dlci++)
+			at_pool_add_port(pool, cmux_get_channel(tp2, dlci));
+		if(!tp2)
+			DBGT("no CMUX on: %s", atport)
+	}
+	if(!tp2) { // no multiplexer wanted, or it failed
+		DBGT("create AT loop for: %s", atport)
+		tp2 = create_at_thread(atport);
+		at_pool_add_port(pool, tp2);
+	}
+	tp_tty->at_pool = pool;
+	tp_tty->tp_at = pool->tp_urc;
 	char *mbimport = "/dev/cdc-wdm1"; // hardcoded, may need to be changed manually (for example to cdc-wdm0)
 	DBGT("create MBIM loop for: %s", mbimport)
-	tp2 = create_mbim_thread(mbimport, 4096);
+	mbim_usb_limits_t limits;
+	char *descriptors = strdup_printf("/sys/class/usbmisc/%s/device/../descriptors", strrchr(mbimport, '/')+1); // of the usb device
+	if(mbim_read_usb_limits(descriptors, &limits))
+		DBGT("no MBIM functional descriptor in %s", descriptors)
+	free(descriptors);
+	tp2 = create_mbim_thread(mbimport, &limits);
+	if(tp2)
+		mbim_set_netdev(tp2, "wwan0"); // hardcoded as well, the net device of the same function
+	if(tp2 && freembim_options.auto_init)
+		mbim_autoinit(tp2, freembim_options.auto_apn);
 	tp_tty->tp_mbim = tp2;
 	return IDLE_FINISHED_PROC;
 }
@@ -33,6 +33,9 @@ either expressed or implied, of the <project name> project.
 #include "thread_tty.h"
 #include "at_procs.h"
 #include "mbim_procs.h"
+#include "thread_at.h"
+#include "thread_mbim.h"
+#include "mbim_state.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -46,13 +49,21 @@ void discard() {
 	DBG("discarded: no device present.")
 }
 
+static uint32_t tty_ip_type(const char *type) {
+	if(strcmp(type,"ipv6")==0)
+		return MBIM_CONTEXT_IP_TYPE_IPV6;
+	if(strcmp(type,"ipv4v6")==0)
+		return MBIM_CONTEXT_IP_TYPE_IPV4V6;
+	return MBIM_CONTEXT_IP_TYPE_IPV4;
+}
+
 size_t tty_process_input(thread_params_t *tp, const unsigned char *buf, size_t size) {
 	// here we have the default stdout behavior, so it will buffer the entire line and return it
 	// arrows will generate escape sequences, but backspace removes from the buffer before sending here.
 	// the final \n is also included
 	if(memcmp(buf,"at",2)==0) {
 		// spawn thread and add the line to the at queue
-		if(tp->tp_at)
+		if(generic_at_port(tp))
 			generic_at_send(tp, buf); else discard();
 	} else {
 		char command[1024];
@@ -63,9 +74,18 @@ size_t tty_process_input(thread_params_t *tp, const unsigned char *buf, size_t s
 				"\texit\n"
 				"\tinit // initialize mbim\n"
 				"\tclose // close mbim\n"
-				"\tconnect apn // activate apn\n"
-				"\tdisconnect apn // deactivate apn\n"
+				"\tconnect apn [session [ipv4|ipv6|ipv4v6]] // activate apn, session 0 ipv4 by default\n"
+				"\tdisconnect apn [session] // deactivate apn\n"
 				"\tat... // sends at command\n"
+				"\tdial atd... // sends a dial command, data mode on a pty\n"
+				"\tescape // back to command mode\n"
+				"\tstats // command queue statistics\n"
+				"\tstate // modem state, as mirrored from mbim indications and answers\n"
+				"\tsignal sec|auto // signal reporting interval, auto follows the readers\n"
+				"\tsample msec // packet statistics sampling, shown by state. 0 stops\n"
+				"\tnetdev ifname // net device configured with the ip parameters of the sessions\n"
+				"\treconnect [session] // reconnect statistics, sessions are reconnected until disconnected\n"
+				"\twindow signal|packet|register msec // event window of the cid, for the latest or batch handlers. 0 stops\n"
 			);
 		} else if(strcmp(command,"exit")==0) {
 			// to do: send kill signal to all threads and return for the pthread_join in the main
@@ -77,13 +97,97 @@ size_t tty_process_input(thread_params_t *tp, const unsigned char *buf, size_t s
 		} else if(strcmp(command,"close")==0) {
 			if(tp->tp_mbim) mbim_closeproc(tp); else discard();
 		} else if(strcmp(command,"connect")==0) {
-			char apn[1024];
-			sscanf(buf, "%s %s", command, apn);
-			if(tp->tp_mbim)  mbim_connect(tp, 1, apn); else discard();
+			char apn[1024] = "", type[16] = "ipv4";
+			unsigned int session = 0;
+			sscanf(buf, "%s %s %u %15s", command, apn, &session, type);
+			if(tp->tp_mbim)  mbim_connect(tp, session, 1, apn, tty_ip_type(type)); else discard();
 		} else if(strcmp(command,"disconnect")==0) {
-			char apn[1024];
-			sscanf(buf, "%s %s", command, apn);
-			if(tp->tp_mbim) mbim_connect(tp, 0, apn); else discard();
+			char apn[1024] = "";
+			unsigned int session = 0;
+			sscanf(buf, "%s %s %u", command, apn, &session);
+			if(tp->tp_mbim) mbim_connect(tp, session, 0, apn, MBIM_CONTEXT_IP_TYPE_DEFAULT); else discard();
+		} else if(strcmp(command,"dial")==0) {
+			char dial[1024];
+			sscanf(buf, "%s %s", command, dial);
+			if(generic_at_port(tp)) generic_at_dial(tp, (unsigned char*)dial); else discard();
+		} else if(strcmp(command,"escape")==0) {
+			int ret = -1;
+			if(tp->at_pool)
+				ret = at_pool_escape(tp->at_pool);
+			else if(tp->tp_at)
+				ret = at_data_mode_escape(tp->tp_at);
+			if(ret)
+				printf("no port in data mode\n");
+		} else if(strcmp(command,"state")==0) {
+			if(tp->tp_mbim) mbim_state_print(tp->tp_mbim->mbim_state); else discard();
+		} else if(strcmp(command,"signal")==0) {
+			char arg[1024] = "";
+			sscanf(buf, "%s %s", command, arg);
+			mbim_signal_policy_t policy = { .rssi_threshold = MBIM_SIGNAL_DEFAULT, .error_rate_threshold = MBIM_SIGNAL_DEFAULT };
+			if(strcmp(arg,"auto")==0) {
+				policy.adaptive = 1;
+				policy.interval_sec = policy.min_interval_sec = 5;
+				policy.max_interval_sec = 300;
+				policy.adapt_period_msec = 60000;
+			} else
+				policy.interval_sec = atoi(arg);
+			if(tp->tp_mbim) mbim_set_signal_policy(tp, &policy); else discard();
+		} else if(strcmp(command,"sample")==0) {
+			char arg[1024] = "0";
+			sscanf(buf, "%s %s", command, arg);
+			if(tp->tp_mbim) mbim_start_packet_sampler(tp, atol(arg)); else discard();
+		} else if(strcmp(command,"netdev")==0) {
+			char netdev[1024] = "";
+			sscanf(buf, "%s %s", command, netdev);
+			if(tp->tp_mbim) mbim_set_netdev(tp->tp_mbim, netdev); else discard();
+		} else if(strcmp(command,"reconnect")==0) {
+			unsigned int session = 0;
+			mbim_reconnect_stats_t rs;
+			sscanf(buf, "%s %u", command, &session);
+			if(!tp->tp_mbim)
+				discard();
+			else if(mbim_get_reconnect_stats(tp, session, &rs))
+				printf("session %u not supervised\n", session);
+			else
+				printf("session %u: drops %u, attempts %u, failures %u, rate limited %u, reconnects %u, latency min/avg/max %llu/%llu/%llu msec\n",
+					session, rs.drops, rs.attempts, rs.failures, rs.rate_limited, rs.reconnects,
+					(unsigned long long)rs.latency_min_msec,
+					(unsigned long long)(rs.reconnects ? rs.latency_total_msec/rs.reconnects : 0),
+					(unsigned long long)rs.latency_max_msec);
+		} else if(strcmp(command,"window")==0) {
+			char cid[1024] = "", arg[1024] = "0";
+			enum mbim_command_code cc = MBIM_INVALID;
+			sscanf(buf, "%s %s %s", command, cid, arg);
+			if(strcmp(cid,"signal")==0)
+				cc = MBIM_CID_SIGNAL_STATE;
+			else if(strcmp(cid,"packet")==0)
+				cc = MBIM_CID_PACKET_SERVICE;
+			else if(strcmp(cid,"register")==0)
+				cc = MBIM_CID_REGISTER_STATE;
+			if(cc==MBIM_INVALID)
+				printf("unknown cid '%s'\n", cid);
+			else if(tp->tp_mbim)
+				mbim_set_event_window(tp->tp_mbim, cc, atol(arg));
+			else
+				discard();
+		} else if(strcmp(command,"stats")==0) {
+			if(tp->tp_mbim)
+				print_command_stats(tp->tp_mbim);
+			if(tp->tp_mbim && tp->tp_mbim->mbim_registered_after_msec)
+				printf("registered %llu msec after the plug\n", (unsigned long long)tp->tp_mbim->mbim_registered_after_msec);
+			for(uint32_t session=0;tp->tp_mbim && session<MBIM_STATE_MAX_SESSIONS;session++) {
+				mbim_connect_timing_t t;
+				if(mbim_get_connect_timing(tp, session, &t))
+					continue;
+				printf("session %u: connected in %llu msec: ready %llu%s, connect %llu, ip %llu%s, net %llu%s\n", session,
+					(unsigned long long)t.total_msec, (unsigned long long)t.ready_msec, t.ready_from_mirror ? " (known)" : "",
+					(unsigned long long)t.connect_msec, (unsigned long long)t.ip_msec, t.ip_from_mirror ? " (known)" : "",
+					(unsigned long long)t.net_msec, t.net_configured ? "" : " (not configured)");
+			}
+			if(tp->at_pool)
+				at_pool_print_stats(tp->at_pool);
+			else if(tp->tp_at)
+				print_command_stats(tp->tp_at);
 		} else
 			printf("unknown command '%s'\n", command);
 	}
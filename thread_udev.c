@@ -49,9 +49,12 @@ we use:
 */
 ////////////////////////////////////////////////////////////////////////////////
 
+#include "freembim.h"
 #include "thread_udev.h"
 #include "thread_at.h"
+#include "thread_cmux.h"
 #include "thread_mbim.h"
+#include "mbim_procs.h"
 #include <string.h>
 #include <stdlib.h>
 #include <libudev.h>
@@ -70,6 +73,8 @@ typedef struct {
 	char *number;
 	char *subsystem;
 	char *devnode;
+	thread_params_t *tp; // loop thread, once created
+	int probed; // AT probe done
 } interface_t;
 
 typedef struct {
@@ -86,6 +91,8 @@ typedef struct {
 
 	device_t; // udev composite device ID's
 	queue_t *usb_ports; // loop_threads with port path string handling it
+	at_pool_t *at_pool; // AT capable ports
+	thread_params_t *cmux; // multiplexer, on the first AT capable port
 } modem_t;
 
 
@@ -252,19 +259,56 @@ int udev_process_idle(thread_params_t *tp) {
 		while(q) {
 			interface_t *i = q->elem;
 			if(strcmp(m->vendor,"1e2d")==0 && (strcmp(m->model,"0065")==0 || strcmp(m->model,"005d")==0)) {
-				if(strcmp(i->subsystem,"tty")==0) {
-					if(strcmp(i->number,"00")==0) {
-					//if(strcmp(i->number,"02")==0) {
-						DBGT("create AT loop for: %s", i->devnode)
-						thread_params_t *tp = create_at_thread(i->devnode);
-						append_elem_to_queue(m->usb_ports, tp);
-						// notify tty
-						tp_tty->tp_at = tp;
+				if(strcmp(i->subsystem,"tty")==0 && !i->probed) {
+					i->probed = 1;
+					if(!m->at_pool)
+						m->at_pool = create_at_pool();
+					if(!at_probe_port(i->devnode)) {
+						DBGT("no AT on: %s", i->devnode)
+					} else {
+						if(freembim_options.cmux_channels && !m->cmux) {
+							DBGT("create CMUX loop for: %s", i->devnode)
+							m->cmux = i->tp = create_cmux_thread(i->devnode, freembim_options.cmux_channels);
+							if(i->tp) {
+								append_elem_to_queue(m->usb_ports, i->tp);
+								for(int dlci=1;dlci<=freembim_options.cmux_channels;dlci++) {
+									thread_params_t *tp_dlc = cmux_get_channel(i->tp, dlci);
+									if(tp_dlc) {
+										append_elem_to_queue(m->usb_ports, tp_dlc);
+										at_pool_add_port(m->at_pool, tp_dlc);
+									}
+								}
+							} else
+								DBGT("no CMUX on: %s", i->devnode)
+						}
+						if(!i->tp) { // no multiplexer wanted, or it failed
+							DBGT("create AT loop for: %s", i->devnode)
+							i->tp = create_at_thread(i->devnode);
+							if(i->tp) {
+								append_elem_to_queue(m->usb_ports, i->tp);
+								at_pool_add_port(m->at_pool, i->tp);
+							}
+						}
 					}
-				} else if(strcmp(i->subsystem,"usbmisc")==0) {
+					// notify tty
+					tp_tty->at_pool = m->at_pool;
+					tp_tty->tp_at = m->at_pool->tp_urc;
+				} else if(strcmp(i->subsystem,"usbmisc")==0 && !i->tp) {
 					DBGT("create MBIM loop for: %s", i->devnode)
-					thread_params_t *tp = create_mbim_thread(i->devnode, 4096);
+					mbim_usb_limits_t limits;
+					char *descriptors = strdup_printf("%s/descriptors", m->syspath);
+					if(mbim_read_usb_limits(descriptors, &limits))
+						DBGT("no MBIM functional descriptor in %s", descriptors)
+					free(descriptors);
+					thread_params_t *tp = i->tp = create_mbim_thread(i->devnode, &limits);
 					append_elem_to_queue(m->usb_ports, tp);
+					for(queue_elem_t *n = m->interfaces->head;tp && n;n = n->next) {
+						interface_t *netif = n->elem;
+						if(strcmp(netif->subsystem,"net")==0) // devnode is the interface name
+							mbim_set_netdev(tp, netif->devnode);
+					}
+					if(tp && freembim_options.auto_init)
+						mbim_autoinit(tp, freembim_options.auto_apn);
 					// notify tty
 					tp_tty->tp_mbim = tp;
 				}